@@ -28,7 +28,10 @@ const char *dhara_strerror(dhara_error_t err)
 		[DHARA_E_JOURNAL_FULL] = "Journal is full",
 		[DHARA_E_NOT_FOUND] = "No such sector",
 		[DHARA_E_MAP_FULL] = "Sector map is full",
-		[DHARA_E_CORRUPT_MAP] = "Sector map is corrupted"
+		[DHARA_E_CORRUPT_MAP] = "Sector map is corrupted",
+		[DHARA_E_PINNED] = "Block is pinned by a reader",
+		[DHARA_E_BAD_FORMAT] = "Journal was written in another format",
+		[DHARA_E_SECTOR_RANGE] = "Sector number is out of range"
 	};
 	const char *msg = NULL;
 
@@ -22,19 +22,66 @@
  * Metapage binary format
  */
 
-/* Does the page buffer contain a valid checkpoint page? */
-static inline int hdr_has_magic(const uint8_t *buf)
+/* Does the page buffer contain a valid checkpoint page? The last byte
+ * of the magic number identifies the metadata format. Builds with a
+ * non-default metadata layout record the sector width and radix there
+ * instead.
+ *
+ * The fixed format is written as 'a', unless it's extended: the map may
+ * store tombstones, or groups may be closed early. Older builds, which
+ * would misread both, know only 'a', and so an extended checkpoint is
+ * marked 'b'. Both are read.
+ */
+static inline uint8_t hdr_format_id(uint8_t format, int extended)
+{
+#if (DHARA_SECTOR_BITS == 32) && (DHARA_RADIX_BITS == 1)
+	if (format == DHARA_META_COMPACT)
+		return 'c';
+
+	return extended ? 'b' : 'a';
+#else
+	(void)extended;
+
+	return ((format == DHARA_META_COMPACT) ? 0x80 : 0) |
+		((DHARA_RADIX_BITS - 1) << 5) | (DHARA_SECTOR_BITS - 1);
+#endif
+}
+
+static inline int hdr_id_ok(uint8_t id, uint8_t format)
+{
+#if (DHARA_SECTOR_BITS == 32) && (DHARA_RADIX_BITS == 1)
+	if (id == hdr_format_id(format, 0))
+		return 1;
+#endif
+	return id == hdr_format_id(format, 1);
+}
+
+/* Is this a checkpoint page written in some other format? */
+static inline int hdr_is_foreign(const uint8_t *buf, uint8_t format)
 {
 	return (buf[0] == 'D') &&
 	       (buf[1] == 'h') &&
-	       (buf[2] == 'a');
+	       !hdr_id_ok(buf[2], format);
 }
 
-static inline void hdr_put_magic(uint8_t *buf)
+static inline int hdr_has_magic(const uint8_t *buf, uint8_t format)
+{
+	return (buf[0] == 'D') &&
+	       (buf[1] == 'h') &&
+	       hdr_id_ok(buf[2], format);
+}
+
+static inline void hdr_put_magic(uint8_t *buf, uint8_t format,
+				 int extended)
 {
 	buf[0] = 'D';
 	buf[1] = 'h';
-	buf[2] = 'a';
+	buf[2] = hdr_format_id(format, extended);
+}
+
+static inline int hdr_is_extended(const uint8_t *buf, uint8_t format)
+{
+	return buf[2] == hdr_format_id(format, 1);
 }
 
 /* What epoch is this page? */
@@ -92,6 +139,314 @@ static inline size_t hdr_user_offset(uint8_t which)
 		which * DHARA_META_SIZE;
 }
 
+/* An early checkpoint, written before its group is full, records the
+ * offset of the root within the group. It's stored where the metadata
+ * for the checkpoint page itself would go, so for a full group, it's
+ * left blank.
+ */
+static inline size_t hdr_early_offset(uint8_t log2_ppc)
+{
+	return hdr_user_offset((1 << log2_ppc) - 1);
+}
+
+/************************************************************************
+ * Compact metadata format
+ *
+ * The checkpoint header is followed by a table of 2**log2_ppc 16-bit
+ * entries, and then by the encoded metadata for each user page, packed
+ * one after the other. Table entry i gives the end of user page i's
+ * encoding within the packed area. It begins where the previous entry
+ * ends, and entries are filled in for any pages skipped before a
+ * written one. Pages with no entry (0xffff) have blank metadata. The
+ * last entry holds the root offset for an early checkpoint.
+ *
+ * Metadata is treated as a sequence of 32-bit words. The first (the
+ * sector ID, for the map) is stored as-is, followed by a bitmap showing
+ * which of the rest are present (not 0xffffffff), one bit per word.
+ * Each present word is then stored as a variable-length distance back
+ * from the page it describes, since most alt-pointers refer to recent
+ * pages. Blank metadata takes no space at all.
+ */
+#define CM_WORDS		(DHARA_META_SIZE >> 2)
+#define CM_MAP_SIZE		((CM_WORDS + 6) >> 3)
+#define CM_HEADER_SIZE		(4 + CM_MAP_SIZE)
+#define CM_MAX_SIZE		(CM_HEADER_SIZE + (CM_WORDS - 1) * 5)
+#define CM_BLANK		0xffff
+
+/* Encoded size assumed when choosing the checkpoint period. If groups
+ * turn out to need more, they're closed early.
+ */
+#define CM_TYPICAL_SIZE		48
+
+static inline size_t cm_table_offset(uint8_t which)
+{
+	return DHARA_HEADER_SIZE + DHARA_COOKIE_SIZE + (which << 1);
+}
+
+static inline size_t cm_data_offset(uint8_t log2_ppc)
+{
+	return cm_table_offset(0) + (2 << log2_ppc);
+}
+
+static inline uint16_t cm_get_end(const uint8_t *buf, uint8_t which)
+{
+	return dhara_r16(buf + cm_table_offset(which));
+}
+
+static inline void cm_set_end(uint8_t *buf, uint8_t which, uint16_t end)
+{
+	dhara_w16(buf + cm_table_offset(which), end);
+}
+
+/* Find where the encoding for the given page begins */
+static uint16_t cm_start(const uint8_t *buf, uint8_t which)
+{
+	while (which) {
+		const uint16_t end = cm_get_end(buf, --which);
+
+		if (end != CM_BLANK)
+			return end;
+	}
+
+	return 0;
+}
+
+static size_t cm_encode(const uint8_t *meta, dhara_page_t self,
+			uint8_t *out)
+{
+	uint8_t *const present = out + 4;
+	size_t len = CM_HEADER_SIZE;
+	int i;
+
+	if (!meta)
+		return 0;
+
+	memset(present, 0, CM_MAP_SIZE);
+
+	for (i = 1; i < CM_WORDS; i++) {
+		const uint32_t w = dhara_r32(meta + (i << 2));
+		uint32_t d = self - w;
+
+		if (w == 0xffffffff)
+			continue;
+
+		present[(i - 1) >> 3] |= 1 << ((i - 1) & 7);
+
+		while (d >= 0x80) {
+			out[len++] = d | 0x80;
+			d >>= 7;
+		}
+
+		out[len++] = d;
+	}
+
+	if ((len == CM_HEADER_SIZE) && (dhara_r32(meta) == 0xffffffff))
+		return 0;
+
+	memcpy(out, meta, 4);
+	return len;
+}
+
+static void cm_decode(const uint8_t *in, size_t len, dhara_page_t self,
+		      uint8_t *meta)
+{
+	const uint8_t *const present = in + 4;
+	size_t pos = CM_HEADER_SIZE;
+	int i;
+
+	memset(meta, 0xff, DHARA_META_SIZE);
+	if (len < CM_HEADER_SIZE)
+		return;
+
+	memcpy(meta, in, 4);
+
+	for (i = 1; i < CM_WORDS; i++) {
+		uint32_t d = 0;
+		int shift = 0;
+
+		if (!(present[(i - 1) >> 3] & (1 << ((i - 1) & 7))))
+			continue;
+
+		while ((pos < len) && (shift < 32)) {
+			const uint8_t c = in[pos++];
+
+			d |= ((uint32_t)(c & 0x7f)) << shift;
+			shift += 7;
+
+			if (!(c & 0x80))
+				break;
+		}
+
+		dhara_w32(meta + (i << 2), self - d);
+	}
+}
+
+/************************************************************************
+ * Metadata slots
+ */
+
+/* Extract a page's metadata from a buffered checkpoint page */
+static void slot_get(const uint8_t *buf, uint8_t format, uint8_t log2_ppc,
+		     dhara_page_t p, uint8_t *meta)
+{
+	const uint8_t which = p & ((1 << log2_ppc) - 1);
+	uint16_t start;
+	uint16_t end;
+
+	if (format != DHARA_META_COMPACT) {
+		memcpy(meta, buf + hdr_user_offset(which), DHARA_META_SIZE);
+		return;
+	}
+
+	start = cm_start(buf, which);
+	end = cm_get_end(buf, which);
+
+	if ((end == CM_BLANK) || (end < start))
+		end = start;
+
+	cm_decode(buf + cm_data_offset(log2_ppc) + start, end - start,
+		  p, meta);
+}
+
+/* Read a page's metadata from its checkpoint page on the chip. In the
+ * compact format, the page's table entries are read together with the
+ * start of the packed area, which usually holds its encoding too. An
+ * encoding beyond this window takes a second read.
+ */
+static int slot_read(const struct dhara_nand *n, uint8_t format,
+		     uint8_t log2_ppc, dhara_page_t meta_page,
+		     dhara_page_t p, uint8_t *meta, dhara_error_t *err)
+{
+	const uint8_t which = p & ((1 << log2_ppc) - 1);
+	const size_t first = cm_table_offset(which ? which - 1 : 0);
+	const size_t data = cm_data_offset(log2_ppc) - first;
+	size_t len = CM_MAX_SIZE;
+	uint8_t win[CM_MAX_SIZE];
+	uint16_t start = 0;
+	uint16_t end;
+
+	if (format != DHARA_META_COMPACT)
+		return dhara_nand_read(n, meta_page, hdr_user_offset(which),
+				       DHARA_META_SIZE, meta, err);
+
+	if (first + len > (1u << n->log2_page_size))
+		len = (1u << n->log2_page_size) - first;
+
+	if (dhara_nand_read(n, meta_page, first, len, win, err) < 0)
+		return -1;
+
+	if (which) {
+		start = dhara_r16(win);
+		end = dhara_r16(win + 2);
+	} else {
+		end = dhara_r16(win);
+	}
+
+	if ((end == CM_BLANK) || (start == CM_BLANK) || (end < start) ||
+	    (end - start > CM_MAX_SIZE))
+		end = start = 0;
+
+	if (end == start) {
+		cm_decode(win, 0, p, meta);
+		return 0;
+	}
+
+	if (data + end <= len) {
+		cm_decode(win + data + start, end - start, p, meta);
+		return 0;
+	}
+
+	if (dhara_nand_read(n, meta_page, first + data + start,
+			    end - start, win, err) < 0)
+		return -1;
+
+	cm_decode(win, end - start, p, meta);
+	return 0;
+}
+
+/* Is there room in the buffered checkpoint page for the head page's
+ * metadata?
+ */
+static int slot_fits(const struct dhara_journal *j, const uint8_t *meta)
+{
+	const uint8_t which = j->head & ((1 << j->log2_ppc) - 1);
+	uint8_t enc[CM_MAX_SIZE];
+
+	if (j->meta_format != DHARA_META_COMPACT)
+		return 1;
+
+	return cm_data_offset(j->log2_ppc) + cm_start(j->page_buf, which) +
+		cm_encode(meta, j->head, enc) <=
+		(1u << j->nand->log2_page_size);
+}
+
+/* Add the head page's metadata to the buffered checkpoint page */
+static void slot_put(struct dhara_journal *j, const uint8_t *meta)
+{
+	const uint8_t which = j->head & ((1 << j->log2_ppc) - 1);
+	uint8_t *const buf = j->page_buf;
+	uint8_t enc[CM_MAX_SIZE];
+	uint16_t start = 0;
+	size_t len;
+	int i;
+
+	if (j->meta_format != DHARA_META_COMPACT) {
+		if (meta)
+			memcpy(buf + hdr_user_offset(which), meta,
+			       DHARA_META_SIZE);
+		else
+			memset(buf + hdr_user_offset(which), 0xff,
+			       DHARA_META_SIZE);
+		return;
+	}
+
+	/* Forget anything left over from another group */
+	if (!which)
+		memset(buf + cm_table_offset(0), 0xff, 2 << j->log2_ppc);
+
+	for (i = 0; i < which; i++) {
+		const uint16_t end = cm_get_end(buf, i);
+
+		if (end == CM_BLANK)
+			cm_set_end(buf, i, start);
+		else
+			start = end;
+	}
+
+	len = cm_encode(meta, j->head, enc);
+	memcpy(buf + cm_data_offset(j->log2_ppc) + start, enc, len);
+	cm_set_end(buf, which, start + len);
+}
+
+/* The root offset recorded by an early checkpoint, or DHARA_PAGE_NONE */
+static dhara_page_t hdr_get_early(const struct dhara_journal *j,
+				  const uint8_t *buf)
+{
+	const uint8_t mask = (1 << j->log2_ppc) - 1;
+
+	if (j->meta_format == DHARA_META_COMPACT) {
+		const uint16_t r = cm_get_end(buf, mask);
+
+		return (r == CM_BLANK) ? DHARA_PAGE_NONE : r;
+	}
+
+	if (!dhara_journal_can_flush(j))
+		return DHARA_PAGE_NONE;
+
+	return dhara_r32(buf + hdr_early_offset(j->log2_ppc));
+}
+
+static void hdr_set_early(struct dhara_journal *j, dhara_page_t r)
+{
+	const uint8_t mask = (1 << j->log2_ppc) - 1;
+
+	if (j->meta_format == DHARA_META_COMPACT)
+		cm_set_end(j->page_buf, mask,
+			   (r == DHARA_PAGE_NONE) ? CM_BLANK : r);
+	else if (dhara_journal_can_flush(j))
+		dhara_w32(j->page_buf + hdr_early_offset(j->log2_ppc), r);
+}
+
 /************************************************************************
  * Page geometry helpers
  */
@@ -156,6 +511,109 @@ static int choose_ppc(int log2_page_size, int max)
 	return ppc;
 }
 
+/* In the compact format, choose the longest period for which encodings
+ * of typical size fit on the checkpoint page. An empty group must also
+ * have room for the largest possible encoding.
+ */
+static int choose_ppc_compact(int log2_page_size, int max)
+{
+	const size_t page_size = 1 << log2_page_size;
+	int ppc = 1;
+
+	while (ppc < max) {
+		const size_t data = cm_data_offset(ppc + 1);
+
+		if ((data + CM_MAX_SIZE > page_size) ||
+		    (data + ((1 << (ppc + 1)) - 1) * CM_TYPICAL_SIZE >
+		     page_size))
+			break;
+
+		ppc++;
+	}
+
+	return ppc;
+}
+
+/************************************************************************
+ * Metadata cache
+ */
+
+static inline struct dhara_meta_cache_slot *mcache_slot(
+	const struct dhara_journal *j, dhara_page_t p)
+{
+	return &j->mcache[p % j->mcache_size];
+}
+
+static void mcache_clear(struct dhara_journal *j)
+{
+	unsigned int i;
+
+	for (i = 0; i < j->mcache_size; i++)
+		j->mcache[i].page = DHARA_PAGE_NONE;
+}
+
+/* Forget any cached metadata for pages in the given block. This must be
+ * done before the block is erased, or once it has been given up on
+ * during recovery.
+ */
+static void mcache_drop_block(struct dhara_journal *j, dhara_block_t blk)
+{
+	const dhara_page_t first = blk << j->nand->log2_ppb;
+	const unsigned int ppb = 1 << j->nand->log2_ppb;
+	unsigned int i;
+
+	/* If the cache is larger than a block, it's cheaper to visit
+	 * only the slots that the block's pages map to.
+	 */
+	if (ppb < j->mcache_size) {
+		for (i = 0; i < ppb; i++) {
+			struct dhara_meta_cache_slot *s =
+				mcache_slot(j, first + i);
+
+			if (s->page == first + i)
+				s->page = DHARA_PAGE_NONE;
+		}
+
+		return;
+	}
+
+	for (i = 0; i < j->mcache_size; i++) {
+		struct dhara_meta_cache_slot *s = &j->mcache[i];
+
+		if ((s->page != DHARA_PAGE_NONE) &&
+		    ((s->page >> j->nand->log2_ppb) == blk))
+			s->page = DHARA_PAGE_NONE;
+	}
+}
+
+/* Fetch metadata from a checkpoint page, via the cache if possible */
+static int mcache_read(struct dhara_journal *j, dhara_page_t p,
+		       dhara_page_t meta_page, uint8_t *buf,
+		       dhara_error_t *err)
+{
+	struct dhara_meta_cache_slot *s;
+
+	if (!j->mcache_size)
+		return slot_read(j->nand, j->meta_format, j->log2_ppc,
+				 meta_page, p, buf, err);
+
+	s = mcache_slot(j, p);
+	if (s->page == p) {
+		memcpy(buf, s->meta, DHARA_META_SIZE);
+		j->mcache_hits++;
+		return 0;
+	}
+
+	j->mcache_misses++;
+	if (slot_read(j->nand, j->meta_format, j->log2_ppc,
+		      meta_page, p, buf, err) < 0)
+		return -1;
+
+	memcpy(s->meta, buf, DHARA_META_SIZE);
+	s->page = p;
+	return 0;
+}
+
 /************************************************************************
  * Journal setup/resume
  */
@@ -188,12 +646,15 @@ static void reset_journal(struct dhara_journal *j)
 	j->tail = 0;
 	j->tail_sync = 0;
 	j->root = DHARA_PAGE_NONE;
+	j->prepared = DHARA_PAGE_NONE;
+	j->pin = DHARA_PAGE_NONE;
 
 	/* No recovery required */
 	clear_recovery(j);
 
 	/* Empty metadata buffer */
 	memset(j->page_buf, 0xff, 1 << j->nand->log2_page_size);
+	mcache_clear(j);
 }
 
 static void roll_stats(struct dhara_journal *j)
@@ -210,11 +671,50 @@ void dhara_journal_init(struct dhara_journal *j,
 	/* Set fixed parameters */
 	j->nand = n;
 	j->page_buf = page_buf;
+	j->meta_format = DHARA_META_FIXED;
+	j->extended = 0;
 	j->log2_ppc = choose_ppc(n->log2_page_size, n->log2_ppb);
 
+	/* No metadata cache until one is supplied */
+	j->mcache = NULL;
+	j->mcache_size = 0;
+	j->mcache_hits = 0;
+	j->mcache_misses = 0;
+
 	reset_journal(j);
 }
 
+void dhara_journal_set_meta_format(struct dhara_journal *j,
+				   uint8_t format)
+{
+	const struct dhara_nand *n = j->nand;
+
+	/* Even a group of two must have room for the largest encoding */
+	if ((format == DHARA_META_COMPACT) &&
+	    (cm_data_offset(1) + CM_MAX_SIZE > (1u << n->log2_page_size)))
+		format = DHARA_META_FIXED;
+
+	j->meta_format = format;
+	j->log2_ppc = (format == DHARA_META_COMPACT) ?
+		choose_ppc_compact(n->log2_page_size, n->log2_ppb) :
+		choose_ppc(n->log2_page_size, n->log2_ppb);
+
+	reset_journal(j);
+	mcache_clear(j);
+}
+
+void dhara_journal_set_meta_cache(struct dhara_journal *j,
+				  struct dhara_meta_cache_slot *slots,
+				  unsigned int count)
+{
+	j->mcache = slots;
+	j->mcache_size = slots ? count : 0;
+	j->mcache_hits = 0;
+	j->mcache_misses = 0;
+
+	mcache_clear(j);
+}
+
 /* Find the first checkpoint-containing block. If a block contains any
  * checkpoints at all, then it must contain one in the first checkpoint
  * location -- otherwise, we would have considered the block eraseable.
@@ -230,14 +730,30 @@ static int find_checkblock(struct dhara_journal *j,
 		const dhara_page_t p =
 			(blk << j->nand->log2_ppb) |
 			((1 << j->log2_ppc) - 1);
+		const dhara_page_t last =
+			p | ((1 << j->nand->log2_ppb) - 1);
 
 		if (!(dhara_nand_is_bad(j->nand, blk) ||
 		      dhara_nand_read(j->nand, p,
 				      0, 1 << j->nand->log2_page_size,
-				      j->page_buf, err)) &&
-		    hdr_has_magic(j->page_buf)) {
-			*where = blk;
-			return 0;
+				      j->page_buf, err))) {
+			if (hdr_has_magic(j->page_buf, j->meta_format)) {
+				*where = blk;
+				return 0;
+			}
+
+			/* Don't mistake the chip for a blank one. Other
+			 * formats may have a different checkpoint
+			 * period, but the last page of a full block is
+			 * always a checkpoint.
+			 */
+			if (hdr_is_foreign(j->page_buf, j->meta_format) ||
+			    (!dhara_nand_read(j->nand, last,
+					      0, 3, j->page_buf, NULL) &&
+			     hdr_is_foreign(j->page_buf, j->meta_format))) {
+				dhara_set_error(err, DHARA_E_BAD_FORMAT);
+				return -1;
+			}
 		}
 
 		blk++;
@@ -352,9 +868,13 @@ static int find_root(struct dhara_journal *j, dhara_page_t start,
 		if (!dhara_nand_read(j->nand, p,
 				     0, 1 << j->nand->log2_page_size,
 				     j->page_buf, err) &&
-		    (hdr_has_magic(j->page_buf)) &&
+		    (hdr_has_magic(j->page_buf, j->meta_format)) &&
 		    (hdr_get_epoch(j->page_buf) == j->epoch)) {
-			j->root = p - 1;
+			const dhara_page_t mask = (1 << j->log2_ppc) - 1;
+			const dhara_page_t r = hdr_get_early(j, j->page_buf);
+
+			/* An early checkpoint tells us where the root is */
+			j->root = (r < mask) ? (p - mask + r) : (p - 1);
 			return 0;
 		}
 
@@ -365,8 +885,7 @@ static int find_root(struct dhara_journal *j, dhara_page_t start,
 	return -1;
 }
 
-static int find_head(struct dhara_journal *j, dhara_page_t start,
-		     dhara_error_t *err)
+static void find_head(struct dhara_journal *j, dhara_page_t start)
 {
 	j->head = start;
 
@@ -394,8 +913,6 @@ static int find_head(struct dhara_journal *j, dhara_page_t start,
 			break;
 		}
 	} while (!cp_free(j, j->head));
-
-	return 0;
 }
 
 int dhara_journal_resume(struct dhara_journal *j, dhara_error_t *err)
@@ -403,6 +920,10 @@ int dhara_journal_resume(struct dhara_journal *j, dhara_error_t *err)
 	dhara_block_t first, last;
 	dhara_page_t last_group;
 
+	/* Cached metadata may not match what's on the chip */
+	mcache_clear(j);
+	j->prepared = DHARA_PAGE_NONE;
+
 	/* Find the first checkpoint-containing block */
 	if (find_checkblock(j, 0, &first, err) < 0) {
 		reset_journal(j);
@@ -425,16 +946,16 @@ int dhara_journal_resume(struct dhara_journal *j, dhara_error_t *err)
 	}
 
 	/* Restore settings from checkpoint */
+	if (hdr_is_extended(j->page_buf, j->meta_format))
+		j->extended = 1;
+
 	j->tail = hdr_get_tail(j->page_buf);
 	j->bb_current = hdr_get_bb_current(j->page_buf);
 	j->bb_last = hdr_get_bb_last(j->page_buf);
 	hdr_clear_user(j->page_buf, j->nand->log2_page_size);
 
 	/* Perform another linear scan to find the next free user page */
-	if (find_head(j, last_group, err) < 0) {
-		reset_journal(j);
-		return -1;
-	}
+	find_head(j, last_group);
 
 	j->flags = 0;
 	j->tail_sync = j->tail;
@@ -459,16 +980,20 @@ dhara_page_t dhara_journal_capacity(const struct dhara_journal *j)
 	return (good_cps << j->log2_ppc) - good_cps;
 }
 
-dhara_page_t dhara_journal_size(const struct dhara_journal *j)
+/* Count the user pages from one raw page up to (but not including)
+ * another, allowing for wraparound.
+ */
+static dhara_page_t upages_between(const struct dhara_journal *j,
+				   dhara_page_t from, dhara_page_t to)
 {
 	/* Find the number of raw pages, and the number of checkpoints
-	 * between the head and the tail. The difference between the two
-	 * is the number of user pages (upper limit).
+	 * between the two. The difference between the two is the number
+	 * of user pages (upper limit).
 	 */
-	dhara_page_t num_pages = j->head;
-	dhara_page_t num_cps = j->head >> j->log2_ppc;
+	dhara_page_t num_pages = to;
+	dhara_page_t num_cps = to >> j->log2_ppc;
 
-	if (j->head < j->tail_sync) {
+	if (to < from) {
 		const dhara_page_t total_pages =
 			j->nand->num_blocks << j->nand->log2_ppb;
 
@@ -476,22 +1001,30 @@ dhara_page_t dhara_journal_size(const struct dhara_journal *j)
 		num_cps += total_pages >> j->log2_ppc;
 	}
 
-	num_pages -= j->tail_sync;
-	num_cps -= j->tail_sync >> j->log2_ppc;
+	num_pages -= from;
+	num_cps -= from >> j->log2_ppc;
 
 	return num_pages - num_cps;
 }
 
+dhara_page_t dhara_journal_size(const struct dhara_journal *j)
+{
+	return upages_between(j, j->tail_sync, j->head);
+}
+
+dhara_page_t dhara_journal_dequeued(const struct dhara_journal *j)
+{
+	return upages_between(j, j->tail_sync, j->tail);
+}
+
 int dhara_journal_read_meta(struct dhara_journal *j, dhara_page_t p,
 			    uint8_t *buf, dhara_error_t *err)
 {
-	/* Offset of metadata within the metadata page */
 	const dhara_page_t ppc_mask = (1 << j->log2_ppc) - 1;
-	const size_t offset = hdr_user_offset(p & ppc_mask);
 
 	/* Special case: buffered metadata */
 	if (align_eq(p, j->head, j->log2_ppc)) {
-		memcpy(buf, j->page_buf + offset, DHARA_META_SIZE);
+		slot_get(j->page_buf, j->meta_format, j->log2_ppc, p, buf);
 		return 0;
 	}
 
@@ -500,19 +1033,16 @@ int dhara_journal_read_meta(struct dhara_journal *j, dhara_page_t p,
 	 */
 	if ((j->recover_meta != DHARA_PAGE_NONE) &&
 	    align_eq(p, j->recover_root, j->log2_ppc))
-		return dhara_nand_read(j->nand, j->recover_meta,
-				       offset, DHARA_META_SIZE,
-				       buf, err);
+		return slot_read(j->nand, j->meta_format, j->log2_ppc,
+				 j->recover_meta, p, buf, err);
 
 	/* General case: fetch from metadata page for checkpoint group */
-	return dhara_nand_read(j->nand, p | ppc_mask,
-			       offset, DHARA_META_SIZE,
-			       buf, err);
+	return mcache_read(j, p, p | ppc_mask, buf, err);
 }
 
 dhara_page_t dhara_journal_peek(struct dhara_journal *j)
 {
-	if (j->head == j->tail)
+	if ((j->head == j->tail) || (j->flags & DHARA_JOURNAL_F_HOLD))
 		return DHARA_PAGE_NONE;
 
 	if (is_aligned(j->tail, j->nand->log2_ppb)) {
@@ -561,6 +1091,7 @@ void dhara_journal_clear(struct dhara_journal *j)
 	j->flags |= DHARA_JOURNAL_F_DIRTY;
 
 	hdr_clear_user(j->page_buf, j->nand->log2_page_size);
+	mcache_clear(j);
 }
 
 static int skip_block(struct dhara_journal *j, dhara_error_t *err)
@@ -603,8 +1134,21 @@ static int prepare_head(struct dhara_journal *j, dhara_error_t *err)
 	for (i = 0; i < DHARA_MAX_RETRIES; i++) {
 		const dhara_block_t blk = j->head >> j->nand->log2_ppb;
 
-		if (!dhara_nand_is_bad(j->nand, blk))
+		if (align_eq(j->head, j->pin, j->nand->log2_ppb)) {
+			dhara_set_error(err, DHARA_E_PINNED);
+			return -1;
+		}
+
+		if (!dhara_nand_is_bad(j->nand, blk)) {
+			/* Already erased while we were idle? */
+			if (j->prepared == j->head) {
+				j->prepared = DHARA_PAGE_NONE;
+				return 0;
+			}
+
+			mcache_drop_block(j, blk);
 			return dhara_nand_erase(j->nand, blk, err);
+		}
 
 		j->bb_current++;
 		if (skip_block(j, err) < 0)
@@ -615,6 +1159,104 @@ static int prepare_head(struct dhara_journal *j, dhara_error_t *err)
 	return -1;
 }
 
+int dhara_journal_pre_erase(struct dhara_journal *j, dhara_error_t *err)
+{
+	const int log2_ppb = j->nand->log2_ppb;
+	dhara_block_t blk = j->head >> log2_ppb;
+	dhara_error_t my_err;
+
+	if (dhara_journal_in_recovery(j))
+		return 0;
+
+	/* If the head is part-way through a block, that block is
+	 * already erased, and the one we want is the next.
+	 */
+	if (!is_aligned(j->head, log2_ppb))
+		blk = next_block(j->nand, blk);
+
+	/* We can't touch the block holding the last-synced tail, unless
+	 * the journal is empty.
+	 */
+	if (((j->tail_sync >> log2_ppb) == blk) && (j->tail_sync != j->head))
+		return 0;
+
+	if ((j->prepared == (blk << log2_ppb)) ||
+	    ((j->pin >> log2_ppb) == blk) ||
+	    dhara_nand_is_bad(j->nand, blk))
+		return 0;
+
+	mcache_drop_block(j, blk);
+	if (dhara_nand_erase(j->nand, blk, &my_err) < 0) {
+		if (my_err != DHARA_E_BAD_BLOCK) {
+			dhara_set_error(err, my_err);
+			return -1;
+		}
+
+		/* prepare_head() will skip and count it */
+		dhara_nand_mark_bad(j->nand, blk);
+		return 0;
+	}
+
+	j->prepared = blk << log2_ppb;
+	return 0;
+}
+
+dhara_block_t dhara_journal_pin_room(const struct dhara_journal *j)
+{
+	const int log2_ppb = j->nand->log2_ppb;
+	const dhara_block_t head = j->head >> log2_ppb;
+	const dhara_block_t pin = j->pin >> log2_ppb;
+
+	if (j->pin == DHARA_PAGE_NONE)
+		return j->nand->num_blocks;
+
+	/* If the head is at the start of its block, it hasn't entered
+	 * it yet.
+	 */
+	if (is_aligned(j->head, log2_ppb))
+		return (pin + j->nand->num_blocks - head) %
+			j->nand->num_blocks;
+
+	return (pin + j->nand->num_blocks - head - 1) % j->nand->num_blocks;
+}
+
+int dhara_journal_view_capture(const struct dhara_journal *j,
+			       struct dhara_journal_view *v,
+			       uint8_t *page_buf, dhara_error_t *err)
+{
+	if (dhara_journal_in_recovery(j)) {
+		dhara_set_error(err, DHARA_E_RECOVER);
+		return -1;
+	}
+
+	v->nand = j->nand;
+	v->page_buf = page_buf;
+	v->log2_ppc = j->log2_ppc;
+	v->meta_format = j->meta_format;
+	v->tail = j->tail;
+	v->head = j->head;
+	v->root = j->root;
+
+	memcpy(page_buf, j->page_buf, 1 << j->nand->log2_page_size);
+	return 0;
+}
+
+int dhara_journal_view_read_meta(const struct dhara_journal_view *v,
+				 dhara_page_t p, uint8_t *buf,
+				 dhara_error_t *err)
+{
+	const dhara_page_t ppc_mask = (1 << v->log2_ppc) - 1;
+
+	/* Metadata which was buffered at the time */
+	if (align_eq(p, v->head, v->log2_ppc)) {
+		slot_get(v->page_buf, v->meta_format, v->log2_ppc, p, buf);
+		return 0;
+	}
+
+	return slot_read(v->nand, v->meta_format, v->log2_ppc,
+			 p | ppc_mask, p, buf, err);
+}
+
 static void restart_recovery(struct dhara_journal *j, dhara_page_t old_head)
 {
 	/* Mark the current head bad immediately, unless we're also
@@ -691,6 +1333,7 @@ static int recover_from(struct dhara_journal *j,
 
 	/* Advance to the next free page */
 	j->bb_current++;
+	mcache_drop_block(j, old_head >> j->nand->log2_ppb);
 	if (skip_block(j, err) < 0)
 		return -1;
 
@@ -707,13 +1350,31 @@ static int recover_from(struct dhara_journal *j,
 		return 0;
 	}
 
+	/* If the root isn't in this block, then everything we've written
+	 * here belongs to an unfinished run of member pages. There's
+	 * nothing to recover, but the caller must begin the run again.
+	 */
+	if ((j->root == DHARA_PAGE_NONE) ||
+	    !align_eq(j->root, old_head, j->nand->log2_ppb)) {
+		hdr_clear_user(j->page_buf, j->nand->log2_page_size);
+		dhara_nand_mark_bad(j->nand, old_head >> j->nand->log2_ppb);
+		dhara_set_error(err, DHARA_E_RECOVER);
+		return -1;
+	}
+
 	j->recover_root = j->root;
 	j->recover_next =
 		j->recover_root & ~((1 << j->nand->log2_ppb) - 1);
 
-	/* Are we holding buffered metadata? Dump it first. */
-	if (!is_aligned(old_head, j->log2_ppc) &&
-	    dump_meta(j, err) < 0)
+	/* Are we holding buffered metadata? Dump it first. If the root
+	 * is in an earlier group, its metadata is already on the chip,
+	 * and what we hold belongs to member pages which will be written
+	 * again.
+	 */
+	if (!align_eq(j->root, old_head, j->log2_ppc))
+		hdr_clear_user(j->page_buf, j->nand->log2_page_size);
+	else if (!is_aligned(old_head, j->log2_ppc) &&
+		 dump_meta(j, err) < 0)
 		return -1;
 
 	j->flags |= DHARA_JOURNAL_F_RECOVERY;
@@ -728,6 +1389,7 @@ static void finish_recovery(struct dhara_journal *j)
 	 */
 	dhara_nand_mark_bad(j->nand,
 		j->recover_root >> j->nand->log2_ppb);
+	mcache_drop_block(j, j->recover_root >> j->nand->log2_ppb);
 
 	/* If we had to dump metadata, and the page on which we
 	 * did this also went bad, mark it bad too.
@@ -740,45 +1402,64 @@ static void finish_recovery(struct dhara_journal *j)
 	clear_recovery(j);
 }
 
-static int push_meta(struct dhara_journal *j, const uint8_t *meta,
-		     dhara_error_t *err)
+/* Program the checkpoint page for the current group. If the group isn't
+ * full, this is an early checkpoint: the remaining user pages are
+ * skipped, and the root's position within the group is recorded.
+ *
+ * We don't need to check for immediate recover, because that'll never
+ * happen -- we're not block-aligned.
+ */
+static int write_checkpoint(struct dhara_journal *j, int early,
+			    dhara_error_t *err)
 {
+	const dhara_page_t mask = (1 << j->log2_ppc) - 1;
 	const dhara_page_t old_head = j->head;
 	dhara_error_t my_err;
-	const size_t offset =
-		hdr_user_offset(j->head & ((1 << j->log2_ppc) - 1));
 
-	/* We've just written a user page. Add the metadata to the
-	 * buffer.
-	 */
-	if (meta)
-		memcpy(j->page_buf + offset, meta, DHARA_META_SIZE);
-	else
-		memset(j->page_buf + offset, 0xff, DHARA_META_SIZE);
+	if (early && (j->meta_format != DHARA_META_COMPACT)) {
+		dhara_page_t p;
 
-	/* Unless we've filled the buffer, don't do any IO */
-	if (!is_aligned(j->head + 2, j->log2_ppc)) {
-		j->root = j->head;
-		j->head++;
-		return 0;
+		for (p = j->head & mask; p < mask; p++)
+			memset(j->page_buf + hdr_user_offset(p), 0xff,
+			       DHARA_META_SIZE);
 	}
 
-	/* We don't need to check for immediate recover, because that'll
-	 * never happen -- we're not block-aligned.
-	 */
-	hdr_put_magic(j->page_buf);
+	if (early)
+		j->extended = 1;
+
+	hdr_put_magic(j->page_buf, j->meta_format, j->extended);
 	hdr_set_epoch(j->page_buf, j->epoch);
 	hdr_set_tail(j->page_buf, j->tail);
 	hdr_set_bb_current(j->page_buf, j->bb_current);
 	hdr_set_bb_last(j->page_buf, j->bb_last);
+	hdr_set_early(j, early ? (j->root & mask) : DHARA_PAGE_NONE);
 
-	if (dhara_nand_prog(j->nand, j->head + 1, j->page_buf, &my_err) < 0)
-		return recover_from(j, my_err, err);
+	if (dhara_nand_prog(j->nand, j->head | mask, j->page_buf,
+			    &my_err) < 0) {
+		hdr_set_early(j, DHARA_PAGE_NONE);
+		if (recover_from(j, my_err, err) < 0)
+			return -1;
 
+		if (early)
+			return 0;
+
+		/* With two pages per group, the only user page in the
+		 * group may begin the block, which recover_from() takes
+		 * to mean that nothing was lost. That page must be
+		 * written again.
+		 */
+		hdr_clear_user(j->page_buf, j->nand->log2_page_size);
+		dhara_set_error(err, DHARA_E_RECOVER);
+		return -1;
+	}
+
+	hdr_clear_user(j->page_buf, j->nand->log2_page_size);
 	j->flags &= ~DHARA_JOURNAL_F_DIRTY;
 
-	j->root = old_head;
-	j->head = next_upage(j, j->head);
+	if (!early)
+		j->root = old_head;
+
+	j->head = next_upage(j, j->head | mask);
 
 	if (!j->head)
 		roll_stats(j);
@@ -792,6 +1473,56 @@ static int push_meta(struct dhara_journal *j, const uint8_t *meta,
 	return 0;
 }
 
+static int push_meta(struct dhara_journal *j, const uint8_t *meta,
+		     int is_root, dhara_error_t *err)
+{
+	/* We've just written a user page. Add the metadata to the
+	 * buffer.
+	 */
+	slot_put(j, meta);
+
+	/* Unless we've filled the buffer, don't do any IO */
+	if (!is_aligned(j->head + 2, j->log2_ppc)) {
+		if (is_root)
+			j->root = j->head;
+		j->head++;
+		return 0;
+	}
+
+	return write_checkpoint(j, 0, err);
+}
+
+/* In the compact format, a group is closed early if the next page's
+ * metadata won't fit. The root is always in the group by then, because
+ * an empty group has room for anything.
+ */
+static int make_slot(struct dhara_journal *j, const uint8_t *meta,
+		     dhara_error_t *err)
+{
+	if (slot_fits(j, meta))
+		return 0;
+
+	return write_checkpoint(j, 1, err);
+}
+
+int dhara_journal_can_flush(const struct dhara_journal *j)
+{
+	return (j->meta_format == DHARA_META_COMPACT) ||
+		(hdr_early_offset(j->log2_ppc) + 4 <=
+		 (1u << j->nand->log2_page_size));
+}
+
+int dhara_journal_flush(struct dhara_journal *j, dhara_error_t *err)
+{
+	/* The root must be in the group we're about to close */
+	if (dhara_journal_is_clean(j) || dhara_journal_in_recovery(j) ||
+	    !dhara_journal_can_flush(j) || (j->root == DHARA_PAGE_NONE) ||
+	    !align_eq(j->root, j->head, j->log2_ppc))
+		return 0;
+
+	return write_checkpoint(j, 1, err);
+}
+
 int dhara_journal_enqueue(struct dhara_journal *j,
 			  const uint8_t *data, const uint8_t *meta,
 			  dhara_error_t *err)
@@ -799,11 +1530,98 @@ int dhara_journal_enqueue(struct dhara_journal *j,
 	dhara_error_t my_err;
 	int i;
 
+	if (make_slot(j, meta, err) < 0)
+		return -1;
+
 	for (i = 0; i < DHARA_MAX_RETRIES; i++) {
 		if (!(prepare_head(j, &my_err) ||
 		      (data && dhara_nand_prog(j->nand, j->head, data,
 					       &my_err))))
-			return push_meta(j, meta, err);
+			return push_meta(j, meta, 1, err);
+
+		if (recover_from(j, my_err, err) < 0)
+			return -1;
+	}
+
+	dhara_set_error(err, DHARA_E_TOO_BAD);
+	return -1;
+}
+
+/* How many pages of a run fit in the group, starting at the given user
+ * page within it?
+ */
+static dhara_page_t run_room_at(const struct dhara_journal *j,
+				dhara_page_t offset)
+{
+	const dhara_page_t mask = (1 << j->log2_ppc) - 1;
+	const dhara_page_t pages = mask - offset;
+	size_t avail;
+	dhara_page_t n;
+
+	if (j->meta_format != DHARA_META_COMPACT)
+		return pages;
+
+	/* Members encode as a bare header. Allow for the worst case for
+	 * the last page, which holds the run's record.
+	 */
+	avail = (1u << j->nand->log2_page_size) - cm_data_offset(j->log2_ppc);
+	if (offset)
+		avail -= cm_start(j->page_buf, offset);
+
+	if (avail < CM_MAX_SIZE)
+		return 0;
+
+	n = (avail - CM_MAX_SIZE) / CM_HEADER_SIZE + 1;
+	return (n < pages) ? n : pages;
+}
+
+dhara_page_t dhara_journal_run_room(const struct dhara_journal *j)
+{
+	return run_room_at(j, j->head & ((1 << j->log2_ppc) - 1));
+}
+
+dhara_page_t dhara_journal_run_max(const struct dhara_journal *j)
+{
+	return run_room_at(j, 0);
+}
+
+int dhara_journal_enqueue_member(struct dhara_journal *j,
+				 const uint8_t *data, const uint8_t *meta,
+				 dhara_error_t *err)
+{
+	dhara_error_t my_err;
+	int i;
+
+	if (make_slot(j, meta, err) < 0)
+		return -1;
+
+	for (i = 0; i < DHARA_MAX_RETRIES; i++) {
+		if (!(prepare_head(j, &my_err) ||
+		      dhara_nand_prog(j->nand, j->head, data, &my_err)))
+			return push_meta(j, meta, 0, err);
+
+		if (recover_from(j, my_err, err) < 0)
+			return -1;
+	}
+
+	dhara_set_error(err, DHARA_E_TOO_BAD);
+	return -1;
+}
+
+int dhara_journal_copy_member(struct dhara_journal *j,
+			      dhara_page_t p, const uint8_t *meta,
+			      dhara_error_t *err)
+{
+	dhara_error_t my_err;
+	int i;
+
+	if (make_slot(j, meta, err) < 0)
+		return -1;
+
+	for (i = 0; i < DHARA_MAX_RETRIES; i++) {
+		if (!(prepare_head(j, &my_err) ||
+		      dhara_nand_copy(j->nand, p, j->head, &my_err)))
+			return push_meta(j, meta, 0, err);
 
 		if (recover_from(j, my_err, err) < 0)
 			return -1;
@@ -820,10 +1638,13 @@ int dhara_journal_copy(struct dhara_journal *j,
 	dhara_error_t my_err;
 	int i;
 
+	if (make_slot(j, meta, err) < 0)
+		return -1;
+
 	for (i = 0; i < DHARA_MAX_RETRIES; i++) {
 		if (!(prepare_head(j, &my_err) ||
 		      dhara_nand_copy(j->nand, p, j->head, &my_err)))
-			return push_meta(j, meta, err);
+			return push_meta(j, meta, 1, err);
 
 		if (recover_from(j, my_err, err) < 0)
 			return -1;
@@ -29,10 +29,46 @@
  */
 #define DHARA_COOKIE_SIZE		4
 
+/* Width of the sector numbers used by the map. This may be reduced at
+ * build time (e.g. -DDHARA_SECTOR_BITS=16) for small volumes, which
+ * shortens lookups and shrinks each page's metadata. Chips written by
+ * a build with a different width won't be recognised.
+ */
+#ifndef DHARA_SECTOR_BITS
+#define DHARA_SECTOR_BITS		32
+#endif
+
+#if (DHARA_SECTOR_BITS < 8) || (DHARA_SECTOR_BITS > 32)
+#error DHARA_SECTOR_BITS must be between 8 and 32
+#endif
+
+/* Number of sector bits consumed by each level of the map's radix tree.
+ * The default is a binary tree. Experimental builds may use 2 or 4
+ * (radix-4 or radix-16 nodes), which gives shorter lookup paths at the
+ * cost of larger metadata. Like the sector width, this is recorded on
+ * the chip.
+ */
+#ifndef DHARA_RADIX_BITS
+#define DHARA_RADIX_BITS		1
+#endif
+
+#if ((DHARA_RADIX_BITS != 1) && (DHARA_RADIX_BITS != 2) && \
+     (DHARA_RADIX_BITS != 4)) || (DHARA_SECTOR_BITS % DHARA_RADIX_BITS)
+#error DHARA_RADIX_BITS must be 1, 2 or 4, and divide DHARA_SECTOR_BITS
+#endif
+
+/* Each level of the tree has an alt-pointer for every digit value but
+ * one.
+ */
+#define DHARA_MAP_ALTS			\
+	((DHARA_SECTOR_BITS / DHARA_RADIX_BITS) * \
+	 ((1 << DHARA_RADIX_BITS) - 1))
+
 /* This is the size of the metadata slice which accompanies each written
- * page. This is independent of the underlying page/OOB size.
+ * page: a sector number, and its alt-pointers. This is independent of
+ * the underlying page/OOB size.
  */
-#define DHARA_META_SIZE			132
+#define DHARA_META_SIZE			(4 + (DHARA_MAP_ALTS << 2))
 
 /* When a block fails, or garbage is encountered, we try again on the
  * next block/checkpoint. We can do this up to the given number of
@@ -50,6 +86,24 @@
 #define DHARA_JOURNAL_F_BAD_META	0x02
 #define DHARA_JOURNAL_F_RECOVERY	0x04
 #define DHARA_JOURNAL_F_ENUM_DONE	0x08
+#define DHARA_JOURNAL_F_HOLD		0x10
+
+/* Checkpoint metadata formats. In the fixed format, each user page has
+ * a DHARA_META_SIZE slot on its checkpoint page. The compact format
+ * encodes metadata with variable length, so that more user pages can
+ * share a checkpoint page.
+ */
+#define DHARA_META_FIXED		0
+#define DHARA_META_COMPACT		1
+
+/* Cached copy of the metadata belonging to a single user page. An array
+ * of these may be given to the journal to avoid repeated reads of
+ * checkpoint pages. Unused slots have a page of DHARA_PAGE_NONE.
+ */
+struct dhara_meta_cache_slot {
+	dhara_page_t			page;
+	uint8_t				meta[DHARA_META_SIZE];
+};
 
 /* The journal layer presents the NAND pages as a double-ended queue.
  * Pages, with associated metadata may be pushed onto the end of the
@@ -77,6 +131,15 @@ struct dhara_journal {
 	 */
 	uint8_t				log2_ppc;
 
+	/* Encoding of metadata on checkpoint pages (DHARA_META_*) */
+	uint8_t				meta_format;
+
+	/* Set once fixed-format checkpoints may contain anything which
+	 * earlier versions would misread (see
+	 * dhara_journal_mark_extended()).
+	 */
+	uint8_t				extended;
+
 	/* Epoch counter. This is incremented whenever the journal head
 	 * passes the end of the chip and wraps around.
 	 */
@@ -116,6 +179,31 @@ struct dhara_journal {
 	dhara_page_t			recover_next;
 	dhara_page_t			recover_root;
 	dhara_page_t			recover_meta;
+
+	/* If the block following the head has been erased in advance,
+	 * this points to its first page. Otherwise it's DHARA_PAGE_NONE.
+	 */
+	dhara_page_t			prepared;
+
+	/* Readers working from a view (see below) may still need pages
+	 * from this point onwards, so the block containing it mustn't
+	 * be erased. DHARA_PAGE_NONE if there are no such readers.
+	 */
+	dhara_page_t			pin;
+
+	/* Optional metadata cache. This is a direct-mapped table of
+	 * metadata slots, indexed by page number. Slots are invalidated
+	 * whenever the block containing their page is erased or
+	 * abandoned.
+	 */
+	struct dhara_meta_cache_slot	*mcache;
+	unsigned int			mcache_size;
+
+	/* Cache statistics: metadata lookups which were satisfied from
+	 * the cache, and those which required a NAND read.
+	 */
+	uint32_t			mcache_hits;
+	uint32_t			mcache_misses;
 };
 
 /* Initialize a journal. You must supply a pointer to a NAND chip
@@ -129,9 +217,35 @@ void dhara_journal_init(struct dhara_journal *j,
 			const struct dhara_nand *n,
 			uint8_t *page_buf);
 
+/* Select the checkpoint metadata format. This must be done before
+ * dhara_journal_resume(), and the same format must always be used with
+ * a given chip -- checkpoints of the other format aren't recognised.
+ *
+ * The compact format allows longer checkpoint groups (eight pages
+ * rather than four with 512-byte pages), so fewer pages are spent on
+ * checkpoints. When a group's metadata doesn't fit, the group is closed
+ * early, leaving its remaining pages unprogrammed. If the page is too
+ * small for the compact format (with very large metadata), the fixed
+ * format is kept.
+ */
+void dhara_journal_set_meta_format(struct dhara_journal *j,
+				   uint8_t format);
+
+/* Supply an array of metadata cache slots. This is optional, and may
+ * be done at any time (the cache and its statistics are reset). Pass
+ * NULL or a zero count to disable caching.
+ *
+ * With caching enabled, repeated metadata reads of the same page are
+ * satisfied from RAM rather than from the checkpoint page on the NAND.
+ */
+void dhara_journal_set_meta_cache(struct dhara_journal *j,
+				  struct dhara_meta_cache_slot *slots,
+				  unsigned int count);
+
 /* Start up the journal -- search the NAND for the journal head, or
  * initialize a blank journal if one isn't found. Returns 0 on success
- * or -1 if a (fatal) error occurs.
+ * or -1 if a (fatal) error occurs. If the chip holds checkpoints of a
+ * different metadata format or size, this fails with E_BAD_FORMAT.
  *
  * This operation is O(log N), where N is the number of pages in the
  * NAND chip. All other operations are O(1).
@@ -150,6 +264,12 @@ dhara_page_t dhara_journal_capacity(const struct dhara_journal *j);
  */
 dhara_page_t dhara_journal_size(const struct dhara_journal *j);
 
+/* Obtain the number of user pages which have been dequeued since the
+ * last checkpoint. Their space is included in the journal's size until
+ * the next checkpoint is written.
+ */
+dhara_page_t dhara_journal_dequeued(const struct dhara_journal *j);
+
 /* Obtain a pointer to the cookie data */
 static inline uint8_t *dhara_journal_cookie(const struct dhara_journal *j)
 {
@@ -175,6 +295,31 @@ int dhara_journal_read_meta(struct dhara_journal *j, dhara_page_t p,
  */
 dhara_page_t dhara_journal_peek(struct dhara_journal *j);
 
+/* Hold or release the tail. While the tail is held, dhara_journal_peek()
+ * always reports that no page is ready, so that nothing is dequeued and
+ * no space is reclaimed. The journal will eventually fill up.
+ */
+static inline void dhara_journal_hold_tail(struct dhara_journal *j,
+					   int hold)
+{
+	if (hold)
+		j->flags |= DHARA_JOURNAL_F_HOLD;
+	else
+		j->flags &= ~DHARA_JOURNAL_F_HOLD;
+}
+
+/* Mark fixed-format checkpoints as extended. Their metadata may then
+ * hold tagged slots (see the map's tombstones), which earlier versions
+ * of this library would misread, and so they carry a different marker
+ * in their header. Early checkpoints (see dhara_journal_flush()) mark
+ * the journal automatically, and so does resuming from an extended
+ * checkpoint. Once set, the mark is never cleared.
+ */
+static inline void dhara_journal_mark_extended(struct dhara_journal *j)
+{
+	j->extended = 1;
+}
+
 /* Remove the last page from the journal. This doesn't take permanent
  * effect until the next checkpoint.
  */
@@ -217,6 +362,116 @@ int dhara_journal_copy(struct dhara_journal *j,
 		       dhara_page_t p, const uint8_t *meta,
 		       dhara_error_t *err);
 
+/* Append a member of a run: a page whose metadata is only ever read
+ * back by page number, and which is made reachable by a later page in
+ * the same checkpoint group. The root is not moved. The upper layer
+ * must finish the run with dhara_journal_enqueue() before anything else
+ * is written, and must not begin a run longer than
+ * dhara_journal_run_room() pages, counting the final one.
+ *
+ * If a member can't be programmed, this fails with E_RECOVER, and the
+ * whole run must be written again once recovery is complete. If the
+ * root is in an earlier block, there's nothing to recover, and the
+ * journal is not left in recovery mode.
+ *
+ * A member may also be copied from an existing page, in which case the
+ * run must be finished with dhara_journal_copy(). Runs may be written
+ * during recovery, like any other page. The longest run which fits in
+ * an empty group is given by dhara_journal_run_max().
+ */
+dhara_page_t dhara_journal_run_room(const struct dhara_journal *j);
+dhara_page_t dhara_journal_run_max(const struct dhara_journal *j);
+int dhara_journal_enqueue_member(struct dhara_journal *j,
+				 const uint8_t *data, const uint8_t *meta,
+				 dhara_error_t *err);
+int dhara_journal_copy_member(struct dhara_journal *j,
+			      dhara_page_t p, const uint8_t *meta,
+			      dhara_error_t *err);
+
+/* Write a checkpoint now, without filling the rest of the current
+ * checkpoint group. The group's remaining user pages are skipped, so
+ * this costs a single page program however full the group is, at the
+ * expense of the skipped pages' capacity. The checkpoint records where
+ * the root is within the group.
+ *
+ * This requires a page with room for the root offset after the
+ * checkpoint metadata. If it isn't possible (see
+ * dhara_journal_can_flush()), nothing is done and the journal remains
+ * dirty, so the caller must fall back to enqueueing pages.
+ *
+ * Like dhara_journal_enqueue(), this may fail with E_RECOVER.
+ */
+int dhara_journal_can_flush(const struct dhara_journal *j);
+int dhara_journal_flush(struct dhara_journal *j, dhara_error_t *err);
+
+/* Erase the next block the head will need, if it isn't already erased,
+ * so that a later write can skip the erase. This is intended to be
+ * called while the device is otherwise idle. It does nothing if the head
+ * is in the middle of a block and the next block is full, bad, or
+ * already prepared, or if recovery is in progress.
+ *
+ * If the erase fails, the block is marked bad and will be skipped when
+ * the head reaches it. This isn't treated as an error.
+ */
+int dhara_journal_pre_erase(struct dhara_journal *j, dhara_error_t *err);
+
+/* Pin the block containing the given page, or remove the pin if the
+ * page is DHARA_PAGE_NONE. While a block is pinned, any operation which
+ * would need to erase it fails with E_PINNED instead.
+ */
+static inline void dhara_journal_pin(struct dhara_journal *j,
+				     dhara_page_t p)
+{
+	j->pin = p;
+}
+
+/* Obtain the number of blocks which the head can move into before it
+ * reaches the pinned block. If there's no pin, this is the number of
+ * blocks in the chip.
+ */
+dhara_block_t dhara_journal_pin_room(const struct dhara_journal *j);
+
+/* A view is a copy of the journal's state at some instant, sufficient
+ * to read the metadata of every page that was in the journal at the
+ * time. Reading through a view doesn't touch the journal, so it can be
+ * done concurrently with other operations, provided that:
+ *
+ *   - the NAND driver permits reads concurrently with other operations
+ *   - the journal is pinned at the view's tail (or earlier) for as long
+ *     as the view is in use
+ *
+ * The caller must supply a page buffer for the view. A view can't be
+ * captured while the journal is in recovery.
+ */
+struct dhara_journal_view {
+	const struct dhara_nand		*nand;
+	uint8_t				*page_buf;
+	uint8_t				log2_ppc;
+	uint8_t				meta_format;
+
+	dhara_page_t			tail;
+	dhara_page_t			head;
+	dhara_page_t			root;
+};
+
+int dhara_journal_view_capture(const struct dhara_journal *j,
+			       struct dhara_journal_view *v,
+			       uint8_t *page_buf, dhara_error_t *err);
+
+/* The cookie, as it was when the view was captured */
+static inline const uint8_t *dhara_journal_view_cookie(
+	const struct dhara_journal_view *v)
+{
+	return v->page_buf + DHARA_HEADER_SIZE;
+}
+
+/* Read metadata associated with a page, as it was when the view was
+ * captured.
+ */
+int dhara_journal_view_read_meta(const struct dhara_journal_view *v,
+				 dhara_page_t p, uint8_t *buf,
+				 dhara_error_t *err);
+
 /* Mark the journal dirty. */
 static inline void dhara_journal_mark_dirty(struct dhara_journal *j)
 {
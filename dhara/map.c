@@ -18,25 +18,66 @@
 #include "bytes.h"
 #include "map.h"
 
-#define DHARA_RADIX_DEPTH	(sizeof(dhara_sector_t) << 3)
+/* Each level of the tree decides one digit of the sector number, most
+ * significant first. A digit is DHARA_RADIX_BITS wide.
+ */
+static inline int digit(dhara_sector_t s, int level)
+{
+	return (s >> (DHARA_SECTOR_BITS - (level + 1) * DHARA_RADIX_BITS)) &
+		(DHARA_RADIX_FANOUT - 1);
+}
+
+static inline dhara_sector_t set_digit(dhara_sector_t s, int level, int d)
+{
+	const int shift = DHARA_SECTOR_BITS - (level + 1) * DHARA_RADIX_BITS;
+
+	return (s & ~((dhara_sector_t)(DHARA_RADIX_FANOUT - 1) << shift)) |
+		((dhara_sector_t)d << shift);
+}
+
+/* The tree distinguishes only the low DHARA_SECTOR_BITS bits of a
+ * sector number. Anything beyond DHARA_SECTOR_MAX would alias another
+ * sector, and is never found.
+ */
+static inline int sector_valid(dhara_sector_t s)
+{
+	return s <= DHARA_SECTOR_MAX;
+}
 
-static inline dhara_sector_t d_bit(int depth)
+/* The top of the sector space holds snapshot records (see map.h), and
+ * everything from there up is out of range for the user.
+ */
+static inline int sector_reserved(dhara_sector_t s)
 {
-	return ((dhara_sector_t)1) << (DHARA_RADIX_DEPTH - depth - 1);
+	return s >= DHARA_MAP_SNAPSHOT_BASE;
 }
 
 /************************************************************************
  * Metadata/cookie layout
  */
 
-static inline void ck_set_count(uint8_t *cookie, dhara_sector_t count)
+/* The cookie holds the number of sectors in the map, with the sector
+ * size (as log2 pages) in the top four bits. The count can't exceed
+ * DHARA_MAP_COUNT_MAX (see pages_to_sectors()).
+ */
+#define DHARA_CK_PPS_SHIFT	28
+#define DHARA_CK_COUNT_MASK	((((uint32_t)1) << DHARA_CK_PPS_SHIFT) - 1)
+
+static inline void ck_set_count(struct dhara_map *m, dhara_sector_t count)
 {
-	dhara_w32(cookie, count);
+	dhara_w32(dhara_journal_cookie(&m->journal),
+		  ((uint32_t)count & DHARA_CK_COUNT_MASK) |
+		  ((uint32_t)m->log2_pps << DHARA_CK_PPS_SHIFT));
 }
 
 static inline dhara_sector_t ck_get_count(const uint8_t *cookie)
 {
-	return dhara_r32(cookie);
+	return dhara_r32(cookie) & DHARA_CK_COUNT_MASK;
+}
+
+static inline int ck_get_pps(const uint8_t *cookie)
+{
+	return dhara_r32(cookie) >> DHARA_CK_PPS_SHIFT;
 }
 
 static inline void meta_clear(uint8_t *meta)
@@ -54,309 +95,3511 @@ static inline void meta_set_id(uint8_t *meta, dhara_sector_t id)
 	dhara_w32(meta, id);
 }
 
-static inline dhara_page_t meta_get_alt(const uint8_t *meta, int level)
+/* A tombstone is a metadata-only record, which gives a sector a new
+ * node in the tree without copying its data. The data stays in an older
+ * page, whose number is kept in one of the node's empty alt-pointer
+ * slots, tagged with the top bit set. This requires that page numbers
+ * fit in 31 bits.
+ *
+ * Run records (below) are tagged with the top two bits set. They're
+ * only written on chips whose page numbers fit in 30 bits, where a
+ * tombstone's tag is 10. On larger chips, the top bit alone marks a
+ * tombstone. The tag mask is therefore a property of the chip.
+ */
+#define DHARA_TOMBSTONE_FLAG	((dhara_page_t)0x80000000)
+#define DHARA_RUN_FLAG		((dhara_page_t)0xc0000000)
+
+static inline dhara_page_t tag_mask(const struct dhara_nand *n)
+{
+	return (n->num_blocks <= ((~DHARA_RUN_FLAG) >> n->log2_ppb)) ?
+		DHARA_RUN_FLAG : DHARA_TOMBSTONE_FLAG;
+}
+
+/* Is this slot value something other than an alt-pointer? */
+static inline int is_tagged(dhara_page_t alt)
+{
+	return (alt != DHARA_PAGE_NONE) && (alt & DHARA_TOMBSTONE_FLAG);
+}
+
+static inline int is_tombstone(dhara_page_t alt, dhara_page_t tags)
+{
+	return (alt != DHARA_PAGE_NONE) &&
+		((alt & tags) == DHARA_TOMBSTONE_FLAG);
+}
+
+/* Alt-pointer slots are stored in order of level. Each level has one
+ * slot for every digit value other than the node's own digit there.
+ */
+static inline int alt_slot(const uint8_t *meta, int level, int d)
+{
+	return level * (DHARA_RADIX_FANOUT - 1) + d -
+		(d > digit(meta_get_id(meta), level));
+}
+
+static inline dhara_page_t slot_get(const uint8_t *meta, int i)
+{
+	const dhara_page_t alt = dhara_r32(meta + 4 + (i << 2));
+
+	return is_tagged(alt) ? DHARA_PAGE_NONE : alt;
+}
+
+static inline void slot_set(uint8_t *meta, int i, dhara_page_t alt)
+{
+	dhara_w32(meta + 4 + (i << 2), alt);
+}
+
+/* Fetch the subtree for digit d at the given level. This must differ
+ * from the node's own digit there.
+ */
+static inline dhara_page_t meta_get_alt(const uint8_t *meta,
+					int level, int d)
+{
+	return slot_get(meta, alt_slot(meta, level, d));
+}
+
+static inline void meta_set_alt(uint8_t *meta, int level, int d,
+				dhara_page_t alt)
+{
+	slot_set(meta, alt_slot(meta, level, d), alt);
+}
+
+/* A run record stands for an aligned run of 2**order sectors, ending
+ * with its own. The data for the others (the members) is held in the
+ * user pages immediately before its own data page, in order. Its path
+ * is ordinary down to the run's level, and below that, it holds every
+ * digit. The order is kept in the last alt-pointer slot, which is
+ * always below the run's level, tagged with the top two bits set.
+ */
+static inline int meta_run_order(const uint8_t *meta, dhara_page_t tags)
+{
+	const dhara_page_t alt =
+		dhara_r32(meta + 4 + ((DHARA_MAP_ALTS - 1) << 2));
+
+	if ((alt == DHARA_PAGE_NONE) || ((alt & tags) != DHARA_RUN_FLAG))
+		return 0;
+
+	return alt & ~DHARA_RUN_FLAG;
+}
+
+static inline void meta_set_run(uint8_t *meta, int order)
+{
+	slot_set(meta, DHARA_MAP_ALTS - 1, DHARA_RUN_FLAG | order);
+}
+
+/* The level from which a node holds every digit */
+static inline int meta_term(const uint8_t *meta, dhara_page_t tags)
+{
+	return DHARA_RADIX_DEPTH -
+		meta_run_order(meta, tags) / DHARA_RADIX_BITS;
+}
+
+/* Does a node hold the sectors with digit d at the given level, among
+ * those which share its digits above that?
+ */
+static inline int meta_has(const uint8_t *meta, int level, int d,
+			   dhara_page_t tags)
+{
+	return (d == digit(meta_get_id(meta), level)) ||
+		(level >= meta_term(meta, tags));
+}
+
+/* Find the subtree for digit d at the given level: either the node
+ * itself (stored in page p), or one of its alt-pointers.
+ */
+static inline dhara_page_t meta_child(const uint8_t *meta, dhara_page_t p,
+				      int level, int d, dhara_page_t tags)
+{
+	return meta_has(meta, level, d, tags) ?
+		p : meta_get_alt(meta, level, d);
+}
+
+/* Return the page holding a tombstone's data, or DHARA_PAGE_NONE if
+ * this isn't a tombstone.
+ */
+static dhara_page_t meta_get_tombstone(const uint8_t *meta,
+				       dhara_page_t tags)
+{
+	int i;
+
+	for (i = 0; i < DHARA_MAP_ALTS; i++) {
+		const dhara_page_t alt = dhara_r32(meta + 4 + (i << 2));
+
+		if (is_tombstone(alt, tags))
+			return alt & ~DHARA_TOMBSTONE_FLAG;
+	}
+
+	return DHARA_PAGE_NONE;
+}
+
+/* Make a node into a tombstone for the given data page. Returns -1 if
+ * there's no empty slot to hold the page number.
+ */
+static int meta_set_tombstone(uint8_t *meta, dhara_page_t data,
+			      dhara_page_t tags)
+{
+	int slot = -1;
+	int i;
+
+	for (i = 0; i < DHARA_MAP_ALTS; i++) {
+		const dhara_page_t alt = dhara_r32(meta + 4 + (i << 2));
+
+		if (is_tombstone(alt, tags)) {
+			slot = i;
+			break;
+		}
+
+		if ((alt == DHARA_PAGE_NONE) && (slot < 0))
+			slot = i;
+	}
+
+	if (slot < 0)
+		return -1;
+
+	slot_set(meta, slot, data | DHARA_TOMBSTONE_FLAG);
+	return 0;
+}
+
+/* Fill in one level of a new node's path, given the node at that level
+ * on the path to its sector (found in page p).
+ */
+static void path_level(uint8_t *new_meta, const uint8_t *meta,
+		       dhara_page_t p, int level, dhara_page_t tags)
+{
+	const int own = digit(meta_get_id(new_meta), level);
+	int d;
+
+	for (d = 0; d < DHARA_RADIX_FANOUT; d++)
+		if (d != own)
+			meta_set_alt(new_meta, level, d,
+				     meta_child(meta, p, level, d, tags));
+}
+
+/* Clear a new node's alt-pointers from the given level down */
+static void path_clear(uint8_t *new_meta, int level)
+{
+	int i;
+
+	for (i = level * (DHARA_RADIX_FANOUT - 1); i < DHARA_MAP_ALTS; i++)
+		slot_set(new_meta, i, DHARA_PAGE_NONE);
+}
+
+/* Find the page holding the data for the node stored in page p */
+static inline dhara_page_t meta_data_page(const uint8_t *meta,
+					  dhara_page_t p, dhara_page_t tags)
+{
+	const dhara_page_t t = meta_get_tombstone(meta, tags);
+
+	return (t == DHARA_PAGE_NONE) ? p : t;
+}
+
+/* Find the page holding the data for one of the sectors held by a node
+ * (any but its own must be members of a run). A sector of 2**log2_pps
+ * pages is found by the last of them, which holds its record.
+ */
+static inline dhara_page_t meta_sector_page(const uint8_t *meta,
+					    dhara_page_t p, dhara_sector_t s,
+					    int log2_pps, dhara_page_t tags)
+{
+	return meta_data_page(meta, p, tags) -
+		((dhara_page_t)(meta_get_id(meta) - s) << log2_pps);
+}
+
+/* Find the first page of a sector, given the last */
+static inline dhara_page_t sector_start(dhara_page_t p, int log2_pps)
 {
-	return dhara_r32(meta + 4 + (level << 2));
+	if (p == DHARA_PAGE_NONE)
+		return p;
+
+	return p - ((((dhara_page_t)1) << log2_pps) - 1);
 }
 
-static inline void meta_set_alt(uint8_t *meta, int level, dhara_page_t alt)
+/* The node for a sector, as opposed to one for a run it's a member of */
+static inline dhara_page_t meta_sector_node(const uint8_t *meta,
+					    dhara_page_t p, dhara_sector_t s)
 {
-	dhara_w32(meta + 4 + (level << 2), alt);
+	return (meta_get_id(meta) == s) ? p : DHARA_PAGE_NONE;
 }
 
 /************************************************************************
- * Public interface
+ * Sector lookup cache
  */
 
-void dhara_map_init(struct dhara_map *m, const struct dhara_nand *n,
-		    uint8_t *page_buf, uint8_t gc_ratio)
+static inline struct dhara_map_cache_slot *scache_slot(
+	const struct dhara_map *m, dhara_sector_t s)
 {
-	if (!gc_ratio)
-		gc_ratio = 1;
+	return &m->scache[s % m->scache_size];
+}
 
-	dhara_journal_init(&m->journal, n, page_buf);
-	m->gc_ratio = gc_ratio;
+static void scache_clear(struct dhara_map *m)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->scache_size; i++)
+		m->scache[i].sector = DHARA_SECTOR_NONE;
 }
 
-int dhara_map_resume(struct dhara_map *m, dhara_error_t *err)
+/* Record the current location of a sector (DHARA_PAGE_NONE if it's
+ * not mapped).
+ */
+static void scache_put(struct dhara_map *m, dhara_sector_t s,
+		       dhara_page_t p)
 {
-	if (dhara_journal_resume(&m->journal, err) < 0) {
-		m->count = 0;
+	struct dhara_map_cache_slot *slot;
+
+	if (!m->scache_size || (s == DHARA_SECTOR_NONE))
+		return;
+
+	slot = scache_slot(m, s);
+	slot->sector = s;
+	slot->page = p;
+}
+
+/* Look up a sector. Returns non-zero if the location is known. */
+static int scache_get(const struct dhara_map *m, dhara_sector_t s,
+		      dhara_page_t *p)
+{
+	const struct dhara_map_cache_slot *slot;
+
+	if (!m->scache_size)
+		return 0;
+
+	slot = scache_slot(m, s);
+	if (slot->sector != s)
+		return 0;
+
+	*p = slot->page;
+	return 1;
+}
+
+/************************************************************************
+ * Logical-to-physical index
+ */
+
+/* Find the user page which comes k user pages after p in the journal,
+ * skipping over checkpoint pages.
+ */
+static dhara_page_t upage_add(const struct dhara_map *m,
+			      dhara_page_t p, dhara_sector_t k)
+{
+	const int log2_ppc = m->journal.log2_ppc;
+	const dhara_page_t per_group = (1 << log2_ppc) - 1;
+	dhara_page_t u = (p >> log2_ppc) * per_group +
+		(p & per_group) + k;
+
+	return ((u / per_group) << log2_ppc) | (u % per_group);
+}
+
+/* Find the last page of the sector which comes k sectors after the one
+ * ending at page p, assuming that they're consecutive.
+ */
+static inline dhara_page_t sector_add(const struct dhara_map *m,
+				      dhara_page_t p, dhara_sector_t k)
+{
+	return upage_add(m, p, k << m->log2_pps);
+}
+
+/* Does the index hold information about this sector? */
+static inline int idx_covers(const struct dhara_map *m, dhara_sector_t s)
+{
+	if (!m->index.valid)
+		return 0;
+
+	if (m->index.type == DHARA_MAP_INDEX_FLAT)
+		return s < m->index.size;
+
+	return 1;
+}
+
+/* Find the last extent which starts at or before the given sector, or
+ * return -1 if there isn't one.
+ */
+static int ext_search(const struct dhara_map *m, dhara_sector_t s)
+{
+	const struct dhara_map_extent *ext = m->index.extents;
+	int low = 0;
+	int high = (int)m->index.used - 1;
+
+	while (low <= high) {
+		const int mid = (low + high) >> 1;
+
+		if (ext[mid].sector <= s)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return high;
+}
+
+static inline int ext_contains(const struct dhara_map_extent *e,
+			       dhara_sector_t s)
+{
+	return (s >= e->sector) && (s - e->sector < e->length);
+}
+
+/* Make room for a new extent at position i */
+static int ext_open(struct dhara_map *m, int i)
+{
+	struct dhara_map_extent *ext = m->index.extents;
+
+	if (m->index.used >= m->index.size) {
+		m->index.valid = 0;
 		return -1;
 	}
 
-	m->count = ck_get_count(dhara_journal_cookie(&m->journal));
+	memmove(ext + i + 1, ext + i,
+		(m->index.used - i) * sizeof(ext[0]));
+	m->index.used++;
 	return 0;
 }
 
-void dhara_map_clear(struct dhara_map *m)
+static void ext_close(struct dhara_map *m, int i)
 {
-	if (m->count) {
-		m->count = 0;
-		dhara_journal_clear(&m->journal);
+	struct dhara_map_extent *ext = m->index.extents;
+
+	m->index.used--;
+	memmove(ext + i, ext + i + 1,
+		(m->index.used - i) * sizeof(ext[0]));
+}
+
+static void ext_remove(struct dhara_map *m, dhara_sector_t s)
+{
+	const int i = ext_search(m, s);
+	struct dhara_map_extent *e;
+	dhara_sector_t end;
+
+	if ((i < 0) || !ext_contains(&m->index.extents[i], s))
+		return;
+
+	e = &m->index.extents[i];
+	end = e->sector + e->length;
+
+	if (e->length == 1) {
+		ext_close(m, i);
+	} else if (s == e->sector) {
+		e->sector++;
+		e->page = sector_add(m, e->page, 1);
+		e->length--;
+	} else if (s == end - 1) {
+		e->length--;
+	} else {
+		struct dhara_map_extent *r;
+
+		/* Split into two runs either side of s */
+		if (ext_open(m, i + 1) < 0)
+			return;
+
+		e = &m->index.extents[i];
+		r = e + 1;
+
+		r->sector = s + 1;
+		r->page = sector_add(m, e->page, s + 1 - e->sector);
+		r->length = end - r->sector;
+		e->length = s - e->sector;
 	}
 }
 
-dhara_sector_t dhara_map_capacity(const struct dhara_map *m)
+/* Insert a sector which isn't currently in the index */
+static void ext_insert(struct dhara_map *m, dhara_sector_t s,
+		       dhara_page_t p)
 {
-	const dhara_sector_t cap = dhara_journal_capacity(&m->journal);
-	const dhara_sector_t reserve = cap / (m->gc_ratio + 1);
-	const dhara_sector_t safety_margin =
-		DHARA_MAX_RETRIES << m->journal.nand->log2_ppb;
+	struct dhara_map_extent *ext = m->index.extents;
+	const int i = ext_search(m, s);
+	const int join_left = (i >= 0) &&
+		(ext[i].sector + ext[i].length == s) &&
+		(sector_add(m, ext[i].page, ext[i].length) == p);
+	const int join_right = (i + 1 < (int)m->index.used) &&
+		(ext[i + 1].sector == s + 1) &&
+		(ext[i + 1].page == sector_add(m, p, 1));
+
+	if (join_left && join_right) {
+		ext[i].length += ext[i + 1].length + 1;
+		ext_close(m, i + 1);
+	} else if (join_left) {
+		ext[i].length++;
+	} else if (join_right) {
+		ext[i + 1].sector = s;
+		ext[i + 1].page = p;
+		ext[i + 1].length++;
+	} else if (!ext_open(m, i + 1)) {
+		ext[i + 1].sector = s;
+		ext[i + 1].page = p;
+		ext[i + 1].length = 1;
+	}
+}
 
-	if (reserve + safety_margin >= cap)
-		return 0;
+static dhara_page_t idx_get(const struct dhara_map *m, dhara_sector_t s)
+{
+	const struct dhara_map_extent *e;
+	int i;
 
-	return cap - reserve - safety_margin;
+	if (m->index.type == DHARA_MAP_INDEX_FLAT)
+		return m->index.flat[s];
+
+	i = ext_search(m, s);
+	if (i < 0)
+		return DHARA_PAGE_NONE;
+
+	e = &m->index.extents[i];
+	if (!ext_contains(e, s))
+		return DHARA_PAGE_NONE;
+
+	return sector_add(m, e->page, s - e->sector);
 }
 
-/* Trace the path from the root to the given sector, emitting
- * alt-pointers and alt-full bits in the given metadata buffer. This
- * also returns the physical page containing the given sector, if it
- * exists.
- *
- * If the page can't be found, a suitable path will be constructed
- * (containing PAGE_NONE alt-pointers), and DHARA_E_NOT_FOUND will be
- * returned.
+/* Record the current location of a sector (DHARA_PAGE_NONE if it's
+ * not mapped).
  */
-static int trace_path(struct dhara_map *m, dhara_sector_t target,
-		      dhara_page_t *loc, uint8_t *new_meta,
-		      dhara_error_t *err)
+static void idx_put(struct dhara_map *m, dhara_sector_t s, dhara_page_t p)
 {
-	uint8_t meta[DHARA_META_SIZE];
-	int depth = 0;
-	dhara_page_t p = dhara_journal_root(&m->journal);
+	if (!idx_covers(m, s) || (s == DHARA_SECTOR_NONE))
+		return;
 
-	if (new_meta)
-		meta_set_id(new_meta, target);
+	if (m->index.type == DHARA_MAP_INDEX_FLAT) {
+		m->index.flat[s] = p;
+		return;
+	}
 
-	if (p == DHARA_PAGE_NONE)
-		goto not_found;
+	ext_remove(m, s);
+	if ((p != DHARA_PAGE_NONE) && m->index.valid)
+		ext_insert(m, s, p);
+}
 
-	if (dhara_journal_read_meta(&m->journal, p, meta, err) < 0)
-		return -1;
+/* Reset the index to describe an empty map */
+static void idx_clear(struct dhara_map *m)
+{
+	dhara_sector_t i;
 
-	while (depth < DHARA_RADIX_DEPTH) {
-		const dhara_sector_t id = meta_get_id(meta);
+	if (m->index.type == DHARA_MAP_INDEX_NONE)
+		return;
 
-		if (id == DHARA_SECTOR_NONE)
-			goto not_found;
+	if (m->index.type == DHARA_MAP_INDEX_FLAT)
+		for (i = 0; i < m->index.size; i++)
+			m->index.flat[i] = DHARA_PAGE_NONE;
 
-		if ((target ^ id) & d_bit(depth)) {
-			if (new_meta)
-				meta_set_alt(new_meta, depth, p);
+	m->index.used = 0;
+	m->index.valid = 1;
+}
 
-			p = meta_get_alt(meta, depth);
-			if (p == DHARA_PAGE_NONE) {
-				depth++;
-				goto not_found;
-			}
+/* Remove a range of sectors from the extent table */
+static void ext_remove_range(struct dhara_map *m, dhara_sector_t first,
+			     dhara_sector_t last)
+{
+	int i = ext_search(m, last);
 
-			if (dhara_journal_read_meta(&m->journal, p,
-						    meta, err) < 0)
-				return -1;
+	while ((i >= 0) && m->index.valid) {
+		struct dhara_map_extent *e = &m->index.extents[i];
+		const dhara_sector_t end = e->sector + e->length - 1;
+
+		if (end < first)
+			break;
+
+		if ((e->sector < first) && (end > last)) {
+			struct dhara_map_extent *r;
+
+			if (ext_open(m, i + 1) < 0)
+				return;
+
+			e = &m->index.extents[i];
+			r = e + 1;
+
+			r->sector = last + 1;
+			r->page = sector_add(m, e->page, last + 1 - e->sector);
+			r->length = end - last;
+			e->length = first - e->sector;
+		} else if (e->sector < first) {
+			e->length = first - e->sector;
+		} else if (end > last) {
+			e->page = sector_add(m, e->page, last + 1 - e->sector);
+			e->length = end - last;
+			e->sector = last + 1;
 		} else {
-			if (new_meta)
-				meta_set_alt(new_meta, depth,
-					meta_get_alt(meta, depth));
+			ext_close(m, i);
 		}
 
-		depth++;
-	}
+		i--;
+	}
+}
+
+static void idx_remove_range(struct dhara_map *m, dhara_sector_t first,
+			     dhara_sector_t last)
+{
+	dhara_sector_t i;
+
+	if (!m->index.valid)
+		return;
+
+	if (m->index.type == DHARA_MAP_INDEX_EXTENT) {
+		ext_remove_range(m, first, last);
+		return;
+	}
+
+	for (i = first; (i <= last) && (i < m->index.size); i++)
+		m->index.flat[i] = DHARA_PAGE_NONE;
+}
+
+static void scache_remove_range(struct dhara_map *m, dhara_sector_t first,
+				dhara_sector_t last)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->scache_size; i++) {
+		struct dhara_map_cache_slot *c = &m->scache[i];
+
+		if ((c->sector != DHARA_SECTOR_NONE) &&
+		    (c->sector >= first) && (c->sector <= last))
+			c->page = DHARA_PAGE_NONE;
+	}
+}
+
+/* Update all lookup structures with the new location of a sector */
+static void track(struct dhara_map *m, dhara_sector_t s, dhara_page_t p)
+{
+	scache_put(m, s, p);
+	idx_put(m, s, p);
+}
+
+/* Record that a range of sectors is no longer mapped */
+static void untrack_range(struct dhara_map *m, dhara_sector_t first,
+			  dhara_sector_t last)
+{
+	scache_remove_range(m, first, last);
+	idx_remove_range(m, first, last);
+}
+
+/************************************************************************
+ * Page liveness bitmap
+ */
+
+static inline size_t live_bytes(const struct dhara_nand *n)
+{
+	return (((size_t)n->num_blocks << n->log2_ppb) + 7) >> 3;
+}
+
+static inline int live_get(const struct dhara_map *m, dhara_page_t p)
+{
+	return (m->live.bits[p >> 3] >> (p & 7)) & 1;
+}
+
+/* Record whether a page holds a sector's current node or data */
+static void live_put(struct dhara_map *m, dhara_page_t p, int live)
+{
+	if (!m->live.bits || (p == DHARA_PAGE_NONE))
+		return;
+
+	if (live)
+		m->live.bits[p >> 3] |= 1 << (p & 7);
+	else
+		m->live.bits[p >> 3] &= ~(1 << (p & 7));
+}
+
+/* Forget everything. If the map is known to be empty, the bitmap is
+ * immediately valid. Otherwise, it needs to be rebuilt.
+ */
+static void live_reset(struct dhara_map *m, int empty)
+{
+	if (!m->live.bits)
+		return;
+
+	memset(m->live.bits, 0, live_bytes(m->journal.nand));
+	m->live.valid = empty;
+	m->live.next = 0;
+}
+
+/************************************************************************
+ * Public interface
+ */
+
+void dhara_map_init(struct dhara_map *m, const struct dhara_nand *n,
+		    uint8_t *page_buf, uint8_t gc_ratio)
+{
+	if (!gc_ratio)
+		gc_ratio = 1;
+
+	dhara_journal_init(&m->journal, n, page_buf);
+	m->gc_ratio = gc_ratio;
+	m->gc_window = 0;
+	m->gc_credit = 0;
+	m->snapshots = 0;
+
+	m->fast_sync = 0;
+	m->tombstones = 0;
+	m->run_order = 0;
+	m->log2_pps = 0;
+	m->sync_ticket = 0;
+	m->sync_durable = 0;
+	m->sync_owed = 0;
+	m->sync_mark = 0;
+	m->sync_requests = 0;
+	m->sync_padded = 0;
+	m->sync_saved = 0;
+
+	m->scache = NULL;
+	m->scache_size = 0;
+	m->scache_hits = 0;
+	m->scache_misses = 0;
+
+	memset(&m->index, 0, sizeof(m->index));
+	memset(&m->live, 0, sizeof(m->live));
+}
+
+void dhara_map_set_cache(struct dhara_map *m,
+			 struct dhara_map_cache_slot *slots,
+			 unsigned int count)
+{
+	m->scache = slots;
+	m->scache_size = slots ? count : 0;
+	m->scache_hits = 0;
+	m->scache_misses = 0;
+
+	scache_clear(m);
+}
+
+static void set_index(struct dhara_map *m, uint8_t type,
+		      dhara_page_t *flat, struct dhara_map_extent *extents,
+		      dhara_sector_t size)
+{
+	memset(&m->index, 0, sizeof(m->index));
+
+	m->index.type = type;
+	m->index.flat = flat;
+	m->index.extents = extents;
+	m->index.size = size;
+}
+
+void dhara_map_set_flat_index(struct dhara_map *m,
+			      dhara_page_t *table, dhara_sector_t size)
+{
+	set_index(m, table ? DHARA_MAP_INDEX_FLAT : DHARA_MAP_INDEX_NONE,
+		  table, NULL, size);
+}
+
+void dhara_map_set_extent_index(struct dhara_map *m,
+				struct dhara_map_extent *table,
+				dhara_sector_t size)
+{
+	set_index(m, table ? DHARA_MAP_INDEX_EXTENT : DHARA_MAP_INDEX_NONE,
+		  NULL, table, size);
+}
+
+size_t dhara_map_index_bytes(const struct dhara_map *m)
+{
+	switch (m->index.type) {
+	case DHARA_MAP_INDEX_FLAT:
+		return m->index.size * sizeof(m->index.flat[0]);
+
+	case DHARA_MAP_INDEX_EXTENT:
+		return m->index.used * sizeof(m->index.extents[0]);
+	}
+
+	return 0;
+}
+
+void dhara_map_set_gc_pacing(struct dhara_map *m, dhara_sector_t window)
+{
+	m->gc_window = window;
+	m->gc_credit = 0;
+}
+
+void dhara_map_set_runs(struct dhara_map *m, unsigned int max_order)
+{
+	if (max_order > DHARA_SECTOR_BITS)
+		max_order = DHARA_SECTOR_BITS;
+
+	m->run_order = max_order;
+}
+
+/* Can page numbers be tagged as tombstone data pages? */
+static inline int can_tombstone(const struct dhara_map *m)
+{
+	const struct dhara_nand *n = m->journal.nand;
+
+	return m->tombstones &&
+		(n->num_blocks <= ((~DHARA_TOMBSTONE_FLAG) >> n->log2_ppb));
+}
+
+/* Can run records be tagged? See tag_mask(). Taking a run apart
+ * relies on tombstones.
+ */
+static inline int can_run(const struct dhara_map *m)
+{
+	return can_tombstone(m) &&
+		(tag_mask(m->journal.nand) == DHARA_RUN_FLAG);
+}
+
+int dhara_map_set_sector_size(struct dhara_map *m, unsigned int log2_pps,
+			      dhara_error_t *err)
+{
+	/* Padding and relocation both depend on tombstones */
+	if ((log2_pps > 15) || (log2_pps && !can_tombstone(m)) ||
+	    ((((dhara_page_t)1) << log2_pps) >
+	     dhara_journal_run_max(&m->journal))) {
+		dhara_set_error(err, DHARA_E_BAD_FORMAT);
+		return -1;
+	}
+
+	m->log2_pps = log2_pps;
+	return 0;
+}
+
+size_t dhara_map_live_bytes(const struct dhara_nand *n)
+{
+	return live_bytes(n);
+}
+
+void dhara_map_set_live_map(struct dhara_map *m, uint8_t *bits)
+{
+	m->live.bits = bits;
+	m->live.skipped = 0;
+	live_reset(m, 0);
+}
+
+static int snap_check(struct dhara_map *m, dhara_error_t *err);
+static int snap_room(const struct dhara_map *m, dhara_error_t *err);
+
+int dhara_map_resume(struct dhara_map *m, dhara_error_t *err)
+{
+	scache_clear(m);
+
+	if (dhara_journal_resume(&m->journal, err) < 0) {
+		m->count = 0;
+		m->snapshots = 0;
+		idx_clear(m);
+		live_reset(m, 1);
+		return -1;
+	}
+
+	/* A chip written with another sector size is treated as blank */
+	if (ck_get_pps(dhara_journal_cookie(&m->journal)) != m->log2_pps) {
+		m->count = 0;
+		m->snapshots = 0;
+		dhara_journal_clear(&m->journal);
+		idx_clear(m);
+		live_reset(m, 1);
+		dhara_set_error(err, DHARA_E_BAD_FORMAT);
+		return -1;
+	}
+
+	m->count = ck_get_count(dhara_journal_cookie(&m->journal));
+	live_reset(m, !m->count);
+
+	if (snap_check(m, err) < 0)
+		return -1;
+
+	/* Failure to build the index isn't fatal. We'll do without. */
+	if (m->index.type != DHARA_MAP_INDEX_NONE)
+		dhara_map_build_index(m, NULL);
+
+	return 0;
+}
+
+void dhara_map_clear(struct dhara_map *m)
+{
+	scache_clear(m);
+	idx_clear(m);
+	live_reset(m, 1);
+	dhara_journal_hold_tail(&m->journal, 0);
+	m->snapshots = 0;
+
+	if (m->count) {
+		m->count = 0;
+		dhara_journal_clear(&m->journal);
+	}
+}
+
+/* The journal size, in pages, beyond which garbage collection runs at
+ * the full ratio.
+ */
+static dhara_sector_t page_capacity(const struct dhara_map *m)
+{
+	const dhara_sector_t cap = dhara_journal_capacity(&m->journal);
+	const dhara_sector_t reserve = cap / (m->gc_ratio + 1);
+	const dhara_sector_t safety_margin =
+		DHARA_MAX_RETRIES << m->journal.nand->log2_ppb;
+
+	if (reserve + safety_margin >= cap)
+		return 0;
+
+	return cap - reserve - safety_margin;
+}
+
+/* The number of sectors which fit in the given number of pages. A
+ * sector can't straddle two checkpoint groups, so the end of each group
+ * which is too short to hold one is wasted. No more than the cookie can
+ * count ever fit.
+ */
+static dhara_sector_t pages_to_sectors(const struct dhara_map *m,
+				       dhara_sector_t pages)
+{
+	const dhara_page_t per_group = (1 << m->journal.log2_ppc) - 1;
+	dhara_sector_t n = pages;
+
+	if (m->log2_pps)
+		n = (pages / per_group) * (per_group >> m->log2_pps);
+
+	return (n > DHARA_MAP_COUNT_MAX) ? DHARA_MAP_COUNT_MAX : n;
+}
+
+/* Pages taken up by each sector written, including its share of the
+ * waste at the end of each group (rounded up).
+ */
+static unsigned int sector_cost(const struct dhara_map *m)
+{
+	const dhara_page_t per_group = (1 << m->journal.log2_ppc) - 1;
+	const dhara_page_t fit = per_group >> m->log2_pps;
+
+	return (per_group + fit - 1) / fit;
+}
+
+dhara_sector_t dhara_map_capacity(const struct dhara_map *m)
+{
+	return pages_to_sectors(m, page_capacity(m));
+}
+
+/* Trace the path from the root to the given sector, emitting
+ * alt-pointers and alt-full bits in the given metadata buffer. This
+ * also returns the physical page containing the given sector's data,
+ * if it exists, and optionally the page holding its node (these differ
+ * for tombstones). A member of a run has no node of its own, and this
+ * is returned as DHARA_PAGE_NONE.
+ *
+ * If the page can't be found, a suitable path will be constructed
+ * (containing PAGE_NONE alt-pointers), and DHARA_E_NOT_FOUND will be
+ * returned.
+ *
+ * If the caller already has a copy of the root's metadata, it can be
+ * supplied to save reading it again.
+ */
+static int trace_path_hint(struct dhara_map *m, dhara_sector_t target,
+			   dhara_page_t *loc, dhara_page_t *node,
+			   uint8_t *new_meta, const uint8_t *root_meta,
+			   dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	uint8_t meta[DHARA_META_SIZE];
+	int depth = 0;
+	dhara_page_t p = dhara_journal_root(&m->journal);
+
+	if (new_meta)
+		meta_set_id(new_meta, target);
+
+	if ((p == DHARA_PAGE_NONE) || !sector_valid(target))
+		goto not_found;
+
+	if (root_meta)
+		memcpy(meta, root_meta, DHARA_META_SIZE);
+	else if (dhara_journal_read_meta(&m->journal, p, meta, err) < 0)
+		return -1;
+
+	while (depth < DHARA_RADIX_DEPTH) {
+		const dhara_sector_t id = meta_get_id(meta);
+		const int d = digit(target, depth);
+
+		if (id == DHARA_SECTOR_NONE)
+			goto not_found;
+
+		if (new_meta)
+			path_level(new_meta, meta, p, depth, tags);
+
+		if (!meta_has(meta, depth, d, tags)) {
+			p = meta_get_alt(meta, depth, d);
+			if (p == DHARA_PAGE_NONE) {
+				depth++;
+				goto not_found;
+			}
+
+			if (dhara_journal_read_meta(&m->journal, p,
+						    meta, err) < 0)
+				return -1;
+		}
+
+		depth++;
+	}
+
+	if (loc)
+		*loc = meta_sector_page(meta, p, target, m->log2_pps, tags);
+	if (node)
+		*node = meta_sector_node(meta, p, target);
+
+	return 0;
+
+not_found:
+	if (new_meta)
+		path_clear(new_meta, depth);
+
+	dhara_set_error(err, DHARA_E_NOT_FOUND);
+	return -1;
+}
+
+static int trace_path(struct dhara_map *m, dhara_sector_t target,
+		      dhara_page_t *loc, uint8_t *new_meta,
+		      dhara_error_t *err)
+{
+	return trace_path_hint(m, target, loc, NULL, new_meta, NULL, err);
+}
+
+/* Trace the path of a sector through the first few levels of the tree,
+ * producing the alt-pointers for those levels only. On success, the
+ * page found is the root of the subtree holding every sector which
+ * shares these leading digits with the target.
+ */
+static int trace_group(struct dhara_map *m, dhara_sector_t target,
+		       int levels, dhara_page_t *loc, uint8_t *new_meta,
+		       uint8_t *group_meta, dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	uint8_t meta[DHARA_META_SIZE];
+	int depth = 0;
+	dhara_page_t p = dhara_journal_root(&m->journal);
+
+	meta_set_id(new_meta, target);
+
+	if ((p == DHARA_PAGE_NONE) || !sector_valid(target))
+		goto not_found;
+
+	if (dhara_journal_read_meta(&m->journal, p, meta, err) < 0)
+		return -1;
+
+	for (;;) {
+		const dhara_sector_t id = meta_get_id(meta);
+
+		if (id == DHARA_SECTOR_NONE)
+			goto not_found;
+
+		if (depth >= levels)
+			break;
+
+		path_level(new_meta, meta, p, depth, tags);
+
+		if (!meta_has(meta, depth, digit(target, depth), tags)) {
+			p = meta_get_alt(meta, depth, digit(target, depth));
+			if (p == DHARA_PAGE_NONE) {
+				depth++;
+				goto not_found;
+			}
+
+			if (dhara_journal_read_meta(&m->journal, p,
+						    meta, err) < 0)
+				return -1;
+		}
+
+		depth++;
+	}
+
+	*loc = p;
+	if (group_meta)
+		memcpy(group_meta, meta, DHARA_META_SIZE);
+
+	return 0;
+
+not_found:
+	path_clear(new_meta, depth);
+	dhara_set_error(err, DHARA_E_NOT_FOUND);
+	return -1;
+}
+
+/* In-order traversal of the radix tree. The subtree below a page p at
+ * depth d contains p's own sector, and the subtrees of each of its
+ * alt-pointers at levels d and below. The pointers at level d lead to
+ * the sectors which differ from p's in digit d -- each of these comes
+ * entirely before or entirely after everything else in the subtree.
+ *
+ * A run record holds every digit below its run's level, so it stands
+ * for a subtree of its own for each of them. We keep track of the
+ * leading digits shared by the sectors of the subtree being visited
+ * (the base), which for a run are the only way of telling which of
+ * them we're looking at.
+ *
+ * We keep a stack of subtrees still to be visited. At most one fewer
+ * than the fanout are pushed at each depth, and these depths strictly
+ * increase, so the stack never holds more than DHARA_MAP_ALTS entries.
+ * The traversal state is exported as struct dhara_map_iter.
+ */
+static void walk_push(struct dhara_map_iter *w, dhara_page_t p,
+		      dhara_sector_t base)
+{
+	w->stack_page[w->sp] = p;
+	w->stack_base[w->sp] = base;
+	w->stack_depth[w->sp] = w->depth;
+	w->sp++;
+}
+
+/* A run record is pushed once for each of its subtrees, so its
+ * metadata is often still at hand when it's popped.
+ */
+static int walk_load(struct dhara_map *m, struct dhara_map_iter *w,
+		     dhara_page_t p, dhara_error_t *err)
+{
+	w->page = p;
+	if (p == w->loaded)
+		return 0;
+
+	w->loaded = DHARA_PAGE_NONE;
+	w->reads++;
+	if (dhara_journal_read_meta(&m->journal, p, w->meta, err) < 0)
+		return -1;
+
+	w->loaded = p;
+	return 0;
+}
+
+/* Begin a traversal of the subtree below the given page and depth. The
+ * subtree holds the sectors which share their first depth digits with
+ * the given base.
+ */
+static int walk_begin_at(struct dhara_map *m, struct dhara_map_iter *w,
+			 dhara_page_t p, int depth, dhara_sector_t base,
+			 dhara_error_t *err)
+{
+	w->page = DHARA_PAGE_NONE;
+	w->loaded = DHARA_PAGE_NONE;
+	w->base = base;
+	w->depth = depth;
+	w->sp = 0;
+	w->reads = 0;
+
+	if (p == DHARA_PAGE_NONE)
+		return 0;
+
+	if (walk_load(m, w, p, err) < 0)
+		return -1;
+
+	/* The root of an empty map may be a filler page */
+	if (meta_get_id(w->meta) == DHARA_SECTOR_NONE)
+		w->page = DHARA_PAGE_NONE;
+
+	return 0;
+}
+
+static int walk_begin(struct dhara_map *m, struct dhara_map_iter *w,
+		      dhara_error_t *err)
+{
+	return walk_begin_at(m, w, dhara_journal_root(&m->journal), 0, 0,
+			     err);
+}
+
+/* Fetch the next sector in order. Returns 1 if a sector was found, 0
+ * if the traversal is complete, or -1 on error.
+ */
+static int walk_next(struct dhara_map *m, struct dhara_map_iter *w,
+		     dhara_sector_t *sector, dhara_page_t *page,
+		     dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+
+	for (;;) {
+		dhara_page_t first = DHARA_PAGE_NONE;
+		int level;
+		int lo;
+		int d;
+
+		if (w->page == DHARA_PAGE_NONE) {
+			if (!w->sp)
+				return 0;
+
+			w->sp--;
+			w->depth = w->stack_depth[w->sp];
+			w->base = w->stack_base[w->sp];
+			if (walk_load(m, w, w->stack_page[w->sp], err) < 0)
+				return -1;
+		}
+
+		if (w->depth >= DHARA_RADIX_DEPTH) {
+			*sector = w->base;
+			*page = meta_sector_page(w->meta, w->page, w->base,
+						 m->log2_pps, tags);
+			w->node = meta_sector_node(w->meta, w->page, w->base);
+			w->page = DHARA_PAGE_NONE;
+			return 1;
+		}
+
+		/* Visit the least subtree at this level first, and stack
+		 * the rest in descending order.
+		 */
+		level = w->depth++;
+
+		for (lo = 0; lo < DHARA_RADIX_FANOUT; lo++) {
+			first = meta_child(w->meta, w->page, level, lo, tags);
+			if (first != DHARA_PAGE_NONE)
+				break;
+		}
+
+		for (d = DHARA_RADIX_FANOUT - 1; d > lo; d--) {
+			const dhara_page_t q =
+				meta_child(w->meta, w->page, level, d, tags);
+
+			if (q != DHARA_PAGE_NONE)
+				walk_push(w, q, set_digit(w->base, level, d));
+		}
+
+		w->base = set_digit(w->base, level, lo);
+		if ((first != w->page) && (walk_load(m, w, first, err) < 0))
+			return -1;
+	}
+}
+
+int dhara_map_build_index(struct dhara_map *m, dhara_error_t *err)
+{
+	struct dhara_map_iter w;
+	dhara_sector_t s;
+	dhara_page_t p;
+	int r;
+
+	if (m->index.type == DHARA_MAP_INDEX_NONE)
+		return 0;
+
+	idx_clear(m);
+	m->index.build_sectors = 0;
+
+	if (walk_begin(m, &w, err) < 0)
+		goto fail;
+
+	while ((r = walk_next(m, &w, &s, &p, err)) > 0) {
+		idx_put(m, s, p);
+		m->index.build_sectors++;
+	}
+
+	if (r < 0)
+		goto fail;
+
+	m->index.build_reads = w.reads;
+	return 0;
+
+fail:
+	m->index.build_reads = w.reads;
+	m->index.valid = 0;
+	return -1;
+}
+
+int dhara_map_iter_begin(struct dhara_map *m, struct dhara_map_iter *it,
+			 dhara_error_t *err)
+{
+	return walk_begin(m, it, err);
+}
+
+int dhara_map_iter_next(struct dhara_map *m, struct dhara_map_iter *it,
+			dhara_sector_t *sector, dhara_page_t *loc,
+			dhara_error_t *err)
+{
+	dhara_sector_t s;
+	dhara_page_t p;
+	const int r = walk_next(m, it, &s, &p, err);
+
+	if (r <= 0)
+		return r;
+
+	/* Snapshot records come last, and aren't user data */
+	if (s >= DHARA_MAP_SNAPSHOT_BASE) {
+		it->page = DHARA_PAGE_NONE;
+		it->sp = 0;
+		return 0;
+	}
+
+	*sector = s;
+	if (loc)
+		*loc = sector_start(p, m->log2_pps);
+
+	return 1;
+}
+
+/* Find the first mapped sector at or after the target. Returns 1 if
+ * one is found, 0 if there are none, or -1 on error.
+ *
+ * We trace the target's path, and remember the deepest subtree along
+ * the way which holds only greater sectors (the least such at its
+ * level). If the target isn't present, the answer is the least sector
+ * in that subtree.
+ */
+static int find_next(struct dhara_map *m, dhara_sector_t target,
+		     dhara_sector_t *sector, dhara_page_t *node,
+		     dhara_page_t *data, dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	uint8_t meta[DHARA_META_SIZE];
+	dhara_page_t p = dhara_journal_root(&m->journal);
+	dhara_page_t next = DHARA_PAGE_NONE;
+	dhara_sector_t next_base = 0;
+	int next_depth = 0;
+	int depth;
+
+	if (p == DHARA_PAGE_NONE)
+		return 0;
+
+	if (dhara_journal_read_meta(&m->journal, p, meta, err) < 0)
+		return -1;
+
+	if (meta_get_id(meta) == DHARA_SECTOR_NONE)
+		return 0;
+
+	for (depth = 0; depth < DHARA_RADIX_DEPTH; depth++) {
+		const int t = digit(target, depth);
+		int d;
+
+		for (d = t + 1; d < DHARA_RADIX_FANOUT; d++) {
+			const dhara_page_t q =
+				meta_child(meta, p, depth, d, tags);
+
+			if (q != DHARA_PAGE_NONE) {
+				next = q;
+				next_base = set_digit(target, depth, d);
+				next_depth = depth + 1;
+				break;
+			}
+		}
+
+		if (!meta_has(meta, depth, t, tags)) {
+			p = meta_get_alt(meta, depth, t);
+			if (p == DHARA_PAGE_NONE)
+				goto not_found;
+
+			if (dhara_journal_read_meta(&m->journal, p,
+						    meta, err) < 0)
+				return -1;
+		}
+	}
+
+	*sector = target;
+	*node = meta_sector_node(meta, p, target);
+	*data = meta_sector_page(meta, p, target, m->log2_pps, tags);
+	return 1;
+
+not_found:
+	if (next == DHARA_PAGE_NONE)
+		return 0;
+
+	/* Descend to the least sector of the subtree */
+	p = next;
+	if (dhara_journal_read_meta(&m->journal, p, meta, err) < 0)
+		return -1;
+
+	for (depth = next_depth; depth < DHARA_RADIX_DEPTH; depth++) {
+		int d;
+
+		for (d = 0; d < DHARA_RADIX_FANOUT; d++) {
+			const dhara_page_t q =
+				meta_child(meta, p, depth, d, tags);
+
+			if (q != DHARA_PAGE_NONE) {
+				next_base = set_digit(next_base, depth, d);
+				if (q == p)
+					break;
+
+				p = q;
+				if (dhara_journal_read_meta(&m->journal, p,
+							    meta, err) < 0)
+					return -1;
+				break;
+			}
+		}
+	}
+
+	*sector = next_base;
+	*node = meta_sector_node(meta, p, next_base);
+	*data = meta_sector_page(meta, p, next_base, m->log2_pps, tags);
+	return 1;
+}
+
+/* Visit the next sector while rebuilding the liveness bitmap. Each
+ * visit starts afresh from the root, so the map may be modified in
+ * between.
+ */
+static int live_step(struct dhara_map *m, dhara_error_t *err)
+{
+	dhara_sector_t s;
+	dhara_page_t node;
+	dhara_page_t data;
+	int r;
+
+	r = find_next(m, m->live.next, &s, &node, &data, err);
+	if (r < 0)
+		return -1;
+
+	if (!r) {
+		m->live.valid = 1;
+		return 0;
+	}
+
+	live_put(m, node, 1);
+	live_put(m, data, 1);
+
+	m->live.next = s + 1;
+	if (m->live.next == DHARA_SECTOR_NONE)
+		m->live.valid = 1;
+
+	return 0;
+}
+
+int dhara_map_build_live(struct dhara_map *m, dhara_error_t *err)
+{
+	if (!m->live.bits)
+		return 0;
+
+	while (!m->live.valid)
+		if (live_step(m, err) < 0)
+			return -1;
+
+	return 0;
+}
+
+/* Try to locate a sector without tracing its path. Returns non-zero if
+ * the location is known (it may be DHARA_PAGE_NONE).
+ */
+static int find_fast(struct dhara_map *m, dhara_sector_t target,
+		     dhara_page_t *p)
+{
+	if (idx_covers(m, target)) {
+		*p = idx_get(m, target);
+		return 1;
+	}
+
+	if (scache_get(m, target, p)) {
+		m->scache_hits++;
+		return 1;
+	}
+
+	if (m->scache_size)
+		m->scache_misses++;
+
+	return 0;
+}
+
+/* Find the last page of a sector, which holds its record */
+static int find_page(struct dhara_map *m, dhara_sector_t target,
+		     dhara_page_t *loc, dhara_error_t *err)
+{
+	dhara_error_t my_err;
+	dhara_page_t p;
+
+	if (!find_fast(m, target, &p)) {
+		if (trace_path(m, target, &p, NULL, &my_err) < 0) {
+			if (my_err != DHARA_E_NOT_FOUND) {
+				dhara_set_error(err, my_err);
+				return -1;
+			}
+
+			p = DHARA_PAGE_NONE;
+		}
+
+		scache_put(m, target, p);
+	}
+
+	if (p == DHARA_PAGE_NONE) {
+		dhara_set_error(err, DHARA_E_NOT_FOUND);
+		return -1;
+	}
+
+	*loc = p;
+	return 0;
+}
+
+int dhara_map_find(struct dhara_map *m, dhara_sector_t target,
+		   dhara_page_t *loc, dhara_error_t *err)
+{
+	dhara_page_t p;
+
+	if (find_page(m, target, &p, err) < 0)
+		return -1;
+
+	if (loc)
+		*loc = sector_start(p, m->log2_pps);
+
+	return 0;
+}
+
+/* Read a whole sector, given its first page. An unmapped sector reads
+ * as blank.
+ */
+static int read_sector(const struct dhara_nand *n, dhara_page_t p,
+		       int log2_pps, uint8_t *data, dhara_error_t *err)
+{
+	const size_t page_size = ((size_t)1) << n->log2_page_size;
+	int i;
+
+	if (p == DHARA_PAGE_NONE) {
+		memset(data, 0xff, page_size << log2_pps);
+		return 0;
+	}
+
+	for (i = 0; i < (1 << log2_pps); i++)
+		if (dhara_nand_read(n, p + i, 0, page_size,
+				    data + i * page_size, err) < 0)
+			return -1;
+
+	return 0;
+}
+
+int dhara_map_read(struct dhara_map *m, dhara_sector_t s,
+		   uint8_t *data, dhara_error_t *err)
+{
+	dhara_error_t my_err;
+	dhara_page_t p;
+
+	if (dhara_map_find(m, s, &p, &my_err) < 0) {
+		if (my_err != DHARA_E_NOT_FOUND) {
+			dhara_set_error(err, my_err);
+			return -1;
+		}
+
+		p = DHARA_PAGE_NONE;
+	}
+
+	return read_sector(m->journal.nand, p, m->log2_pps, data, err);
+}
+
+int dhara_map_view_capture(struct dhara_map *m,
+			   struct dhara_journal_view *v,
+			   uint8_t *page_buf, dhara_error_t *err)
+{
+	return dhara_journal_view_capture(&m->journal, v, page_buf, err);
+}
+
+/* This is trace_path(), reading metadata from a view, without producing
+ * a new path.
+ */
+int dhara_map_view_find(const struct dhara_journal_view *v,
+			dhara_sector_t target, dhara_page_t *loc,
+			dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(v->nand);
+	const int log2_pps = ck_get_pps(dhara_journal_view_cookie(v));
+	uint8_t meta[DHARA_META_SIZE];
+	int depth;
+	dhara_page_t p = v->root;
+
+	if ((p == DHARA_PAGE_NONE) || !sector_valid(target))
+		goto not_found;
+
+	if (dhara_journal_view_read_meta(v, p, meta, err) < 0)
+		return -1;
+
+	for (depth = 0; depth < DHARA_RADIX_DEPTH; depth++) {
+		const dhara_sector_t id = meta_get_id(meta);
+
+		if (id == DHARA_SECTOR_NONE)
+			goto not_found;
+
+		if (!meta_has(meta, depth, digit(target, depth), tags)) {
+			p = meta_get_alt(meta, depth, digit(target, depth));
+			if (p == DHARA_PAGE_NONE)
+				goto not_found;
+
+			if (dhara_journal_view_read_meta(v, p, meta, err) < 0)
+				return -1;
+		}
+	}
+
+	*loc = sector_start(meta_sector_page(meta, p, target, log2_pps, tags),
+			    log2_pps);
+	return 0;
+
+not_found:
+	dhara_set_error(err, DHARA_E_NOT_FOUND);
+	return -1;
+}
+
+int dhara_map_view_read(const struct dhara_journal_view *v,
+			dhara_sector_t s, uint8_t *data,
+			dhara_error_t *err)
+{
+	dhara_error_t my_err;
+	dhara_page_t p;
+
+	if (dhara_map_view_find(v, s, &p, &my_err) < 0) {
+		if (my_err != DHARA_E_NOT_FOUND) {
+			dhara_set_error(err, my_err);
+			return -1;
+		}
+
+		p = DHARA_PAGE_NONE;
+	}
+
+	return read_sector(v->nand, p,
+			   ck_get_pps(dhara_journal_view_cookie(v)), data, err);
+}
+
+/* Lookup cursor for a sequence of sectors in ascending order. We record
+ * the page in effect at each depth of the last path traced. The next
+ * path shares every decision up to the first digit in which the two
+ * sectors differ, so it can be resumed from there.
+ */
+struct cursor {
+	dhara_sector_t		last;
+
+	/* Number of leading levels which decided that the last sector
+	 * wasn't found, or a value greater than the radix depth if it
+	 * was.
+	 */
+	int			fail_levels;
+
+	dhara_page_t		path[DHARA_RADIX_DEPTH + 1];
+
+	/* Page whose metadata we hold */
+	dhara_page_t		page;
+	uint8_t			meta[DHARA_META_SIZE];
+};
+
+static void cursor_init(struct cursor *c)
+{
+	c->last = DHARA_SECTOR_NONE;
+	c->fail_levels = DHARA_RADIX_DEPTH + 1;
+	c->page = DHARA_PAGE_NONE;
+}
+
+static int cursor_find(struct dhara_map *m, struct cursor *c,
+		       dhara_sector_t target, dhara_page_t *loc,
+		       dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	int depth = 0;
+	dhara_page_t p;
+
+	if (!sector_valid(target)) {
+		*loc = DHARA_PAGE_NONE;
+		return 0;
+	}
+
+	/* Find the number of leading digits shared with the last sector */
+	if (c->last != DHARA_SECTOR_NONE)
+		while ((depth < DHARA_RADIX_DEPTH) &&
+		       (digit(target, depth) == digit(c->last, depth)))
+			depth++;
+
+	if ((c->last != DHARA_SECTOR_NONE) && (depth >= c->fail_levels)) {
+		c->last = target;
+		*loc = DHARA_PAGE_NONE;
+		return 0;
+	}
+
+	c->last = DHARA_SECTOR_NONE;
+	p = depth ? c->path[depth] : dhara_journal_root(&m->journal);
+
+	if (p == DHARA_PAGE_NONE)
+		goto not_found;
+
+	if (p != c->page) {
+		c->page = DHARA_PAGE_NONE;
+		if (dhara_journal_read_meta(&m->journal, p, c->meta, err) < 0)
+			return -1;
+		c->page = p;
+	}
+
+	while (depth < DHARA_RADIX_DEPTH) {
+		const dhara_sector_t id = meta_get_id(c->meta);
+
+		c->path[depth] = p;
+
+		if (id == DHARA_SECTOR_NONE)
+			goto not_found;
+
+		if (!meta_has(c->meta, depth, digit(target, depth), tags)) {
+			p = meta_get_alt(c->meta, depth,
+					 digit(target, depth));
+			if (p == DHARA_PAGE_NONE) {
+				depth++;
+				goto not_found;
+			}
+
+			c->page = DHARA_PAGE_NONE;
+			if (dhara_journal_read_meta(&m->journal, p,
+						    c->meta, err) < 0)
+				return -1;
+			c->page = p;
+		}
+
+		depth++;
+	}
+
+	c->path[depth] = p;
+	c->last = target;
+	c->fail_levels = DHARA_RADIX_DEPTH + 1;
+	*loc = meta_sector_page(c->meta, p, target, m->log2_pps, tags);
+	return 0;
+
+not_found:
+	c->last = target;
+	c->fail_levels = depth;
+	*loc = DHARA_PAGE_NONE;
+	return 0;
+}
+
+/* Sort read requests, either by sector or by page. This is a Shell
+ * sort, which needs no extra memory.
+ */
+static inline uint32_t req_key(const struct dhara_map_read_req *r,
+			       int by_page)
+{
+	return by_page ? r->page : r->sector;
+}
+
+static void sort_reqs(struct dhara_map_read_req *reqs, size_t count,
+		      int by_page)
+{
+	size_t gap = 1;
+
+	while (gap < count / 3)
+		gap = gap * 3 + 1;
+
+	for (; gap; gap /= 3) {
+		size_t i;
+
+		for (i = gap; i < count; i++) {
+			const struct dhara_map_read_req tmp = reqs[i];
+			const uint32_t key = req_key(&tmp, by_page);
+			size_t j = i;
+
+			while ((j >= gap) &&
+			       (req_key(&reqs[j - gap], by_page) > key)) {
+				reqs[j] = reqs[j - gap];
+				j -= gap;
+			}
+
+			reqs[j] = tmp;
+		}
+	}
+}
+
+int dhara_map_read_multi(struct dhara_map *m,
+			 struct dhara_map_read_req *reqs, size_t count,
+			 dhara_error_t *err)
+{
+	struct cursor c;
+	size_t i;
+
+	/* Resolve all sectors in order, sharing path prefixes */
+	sort_reqs(reqs, count, 0);
+	cursor_init(&c);
+
+	for (i = 0; i < count; i++) {
+		struct dhara_map_read_req *r = &reqs[i];
+
+		if (!find_fast(m, r->sector, &r->page)) {
+			if (cursor_find(m, &c, r->sector, &r->page, err) < 0)
+				return -1;
+
+			scache_put(m, r->sector, r->page);
+		}
+
+		r->page = sector_start(r->page, m->log2_pps);
+	}
+
+	/* Read pages in physical order. Unmapped sectors sort last. */
+	sort_reqs(reqs, count, 1);
+
+	for (i = 0; i < count; i++) {
+		struct dhara_map_read_req *r = &reqs[i];
+
+		if (read_sector(m->journal.nand, r->page, m->log2_pps,
+				r->data, err) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Enqueue a sector's data. All of its pages but the last are members,
+ * with blank metadata. The last carries the given metadata, and becomes
+ * the root only if is_root is set.
+ */
+static int enqueue_data(struct dhara_map *m, const uint8_t *data,
+			const uint8_t *meta, int is_root, dhara_error_t *err)
+{
+	const size_t page_size =
+		((size_t)1) << m->journal.nand->log2_page_size;
+	const dhara_page_t n = ((dhara_page_t)1) << m->log2_pps;
+	uint8_t member[DHARA_META_SIZE];
+	dhara_page_t i;
+
+	meta_clear(member);
+
+	for (i = 0; i + 1 < n; i++)
+		if (dhara_journal_enqueue_member(&m->journal,
+				data + i * page_size, member, err) < 0)
+			return -1;
+
+	data += i * page_size;
+
+	if (!is_root)
+		return dhara_journal_enqueue_member(&m->journal, data, meta,
+						    err);
+
+	return dhara_journal_enqueue(&m->journal, data, meta, err);
+}
+
+/* Copy a sector to the front of the journal, given the page holding its
+ * record, in the same way. The group must have room for all of it,
+ * which callers ensure using sector_room() before tracing the new path.
+ * Only a copy made because a tombstone couldn't be (which needs a node
+ * with a non-empty subtree at every level) may find otherwise.
+ */
+static int copy_data(struct dhara_map *m, dhara_page_t src,
+		     const uint8_t *meta, dhara_error_t *err)
+{
+	const dhara_page_t n = ((dhara_page_t)1) << m->log2_pps;
+	uint8_t member[DHARA_META_SIZE];
+	dhara_page_t i;
+
+	if (m->log2_pps && (dhara_journal_run_room(&m->journal) < n)) {
+		dhara_set_error(err, DHARA_E_MAP_FULL);
+		return -1;
+	}
+
+	meta_clear(member);
+
+	for (i = n - 1; i; i--)
+		if (dhara_journal_copy_member(&m->journal, src - i,
+					      member, err) < 0)
+			return -1;
+
+	return dhara_journal_copy(&m->journal, src, meta, err);
+}
+
+/* Add a new node for a sector whose data is held in the given page. If
+ * possible, this is a tombstone which refers to the existing data.
+ * Otherwise, the data is copied.
+ */
+static int enqueue_node(struct dhara_map *m, uint8_t *meta,
+			dhara_page_t data, dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	const dhara_sector_t id = meta_get_id(meta);
+
+	if ((id != DHARA_SECTOR_NONE) && can_tombstone(m) &&
+	    !meta_set_tombstone(meta, data, tags)) {
+		if (dhara_journal_enqueue(&m->journal, NULL, meta, err) < 0)
+			return -1;
+
+		track(m, id, data);
+		live_put(m, dhara_journal_root(&m->journal), 1);
+		return 0;
+	}
+
+	if (copy_data(m, data, meta, err) < 0)
+		return -1;
+
+	track(m, id, dhara_journal_root(&m->journal));
+	live_put(m, data, 0);
+	live_put(m, dhara_journal_root(&m->journal), 1);
+	return 0;
+}
+
+/* A tombstone for a run record may be relocated during recovery while
+ * the run's members are still in place, in an older block. If so, the
+ * new path goes through the old node at every level below the run's
+ * level, and the new node must be made into a run record again.
+ */
+static void keep_run(uint8_t *new_meta, int order, dhara_page_t old)
+{
+	const int term = DHARA_RADIX_DEPTH - order / DHARA_RADIX_BITS;
+	int i;
+
+	if (!order)
+		return;
+
+	for (i = term * (DHARA_RADIX_FANOUT - 1); i < DHARA_MAP_ALTS; i++)
+		if (slot_get(new_meta, i) != old)
+			return;
+
+	path_clear(new_meta, term);
+	meta_set_run(new_meta, order);
+}
+
+static int sector_room(struct dhara_map *m, dhara_error_t *err);
+
+/* Check the given page. If it's garbage, do nothing. Otherwise, rewrite
+ * it at the front of the map. Return raw errors from the journal (do
+ * not perform recovery).
+ *
+ * The members of a run come before its record, so by the time the
+ * record reaches the tail, they've all been relocated or replaced, and
+ * it holds nothing but its own sector. Only a tombstone can be asked to
+ * move sooner (see keep_run()).
+ */
+static int raw_gc(struct dhara_map *m, dhara_page_t src,
+		  dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	dhara_sector_t target;
+	dhara_page_t current;
+	dhara_page_t node;
+	dhara_error_t my_err;
+	uint8_t meta[DHARA_META_SIZE];
+	int tombstone;
+	int order;
+
+	if (dhara_journal_read_meta(&m->journal, src, meta, err) < 0)
+		return -1;
+
+	/* Is the page just filler/garbage? */
+	target = meta_get_id(meta);
+	if (target == DHARA_SECTOR_NONE)
+		return 0;
+
+	/* A tombstone holds no data. It's current only if it's still
+	 * the sector's node in the tree.
+	 */
+	tombstone = meta_get_tombstone(meta, tags) != DHARA_PAGE_NONE;
+	order = meta_run_order(meta, tags);
+
+	/* If the cache or index knows that the sector's data lives
+	 * elsewhere, there's no need to trace the path. The index may
+	 * be stale during recovery, because the journal can roll back.
+	 */
+	if (!tombstone && scache_get(m, target, &current) && (current != src))
+		return 0;
+
+	if (!tombstone && idx_covers(m, target) &&
+	    !dhara_journal_in_recovery(&m->journal) &&
+	    (idx_get(m, target) != src))
+		return 0;
+
+	/* Data may need to be copied as a whole sector. Making room
+	 * for it can move the root, so it's done before tracing.
+	 */
+	if (!tombstone && (sector_room(m, err) < 0))
+		return -1;
+
+	/* Find out where the sector once represented by this page
+	 * currently resides (if anywhere).
+	 */
+	if (trace_path_hint(m, target, &current, &node, meta, NULL,
+			    &my_err) < 0) {
+		if (my_err == DHARA_E_NOT_FOUND)
+			return 0;
+
+		dhara_set_error(err, my_err);
+		return -1;
+	}
+
+	/* Is this page still the most current representative? If not,
+	 * do nothing.
+	 */
+	if ((tombstone ? node : current) != src)
+		return 0;
+
+	/* Rewrite it at the front of the journal with updated metadata.
+	 * A live tombstone's data is always older than the tombstone,
+	 * so it has already been moved out of the way of the tail.
+	 */
+	ck_set_count(m, m->count);
+	if (tombstone) {
+		keep_run(meta, order, src);
+		if (enqueue_node(m, meta, current, err) < 0)
+			return -1;
+
+		live_put(m, src, 0);
+		return 0;
+	}
+
+	if (copy_data(m, src, meta, err) < 0)
+		return -1;
+
+	track(m, target, dhara_journal_root(&m->journal));
+	live_put(m, node, 0);
+	live_put(m, src, 0);
+	live_put(m, dhara_journal_root(&m->journal), 1);
+	return 0;
+}
+
+static int pad_queue(struct dhara_map *m, dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	dhara_page_t p = dhara_journal_root(&m->journal);
+	uint8_t root_meta[DHARA_META_SIZE];
+	dhara_page_t data;
+
+	ck_set_count(m, m->count);
+
+	if (p == DHARA_PAGE_NONE)
+		return dhara_journal_enqueue(&m->journal, NULL, NULL, err);
+
+	if (dhara_journal_read_meta(&m->journal, p, root_meta, err) < 0)
+		return -1;
+
+	/* During recovery, the root may be in the block we're trying
+	 * to abandon, so its data must be copied. A tombstone's data is
+	 * older, and has been moved already if necessary.
+	 *
+	 * A sector of several pages won't fit in what's left of the
+	 * group, so it gets a tombstone instead. If its data is in the
+	 * abandoned block, the root hasn't been reached yet, and the
+	 * data will be copied when it is.
+	 */
+	if (dhara_journal_in_recovery(&m->journal) &&
+	    (meta_get_tombstone(root_meta, tags) == DHARA_PAGE_NONE) &&
+	    (!m->log2_pps ||
+	     (meta_get_id(root_meta) == DHARA_SECTOR_NONE))) {
+		if (dhara_journal_copy(&m->journal, p, root_meta, err) < 0)
+			return -1;
+
+		track(m, meta_get_id(root_meta),
+		      dhara_journal_root(&m->journal));
+		live_put(m, p, 0);
+		live_put(m, dhara_journal_root(&m->journal),
+			 meta_get_id(root_meta) != DHARA_SECTOR_NONE);
+		return 0;
+	}
+
+	data = meta_data_page(root_meta, p, tags);
+	if (enqueue_node(m, root_meta, data, err) < 0)
+		return -1;
+
+	if (data != p)
+		live_put(m, p, 0);
+
+	return 0;
+}
+
+/* Make sure that the current checkpoint group has room for a whole
+ * sector. If not, it's closed early where possible, which leaves the
+ * tree as it is. Otherwise, it's padded, which rewrites the root, so
+ * this must be done before tracing any path which is to be written.
+ */
+static int sector_room(struct dhara_map *m, dhara_error_t *err)
+{
+	const dhara_page_t n = ((dhara_page_t)1) << m->log2_pps;
+
+	if (!m->log2_pps)
+		return 0;
+
+	while (dhara_journal_run_room(&m->journal) < n) {
+		ck_set_count(m, m->count);
+
+		if (dhara_journal_flush(&m->journal, err) < 0)
+			return -1;
+
+		if ((dhara_journal_run_room(&m->journal) < n) &&
+		    (pad_queue(m, err) < 0))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Recover one page (or pad the queue once all pages are recovered).
+ * The number of times recovery has been restarted is counted in
+ * restarts.
+ *
+ * Room for a sector is made first. Padding can finish recovery, which
+ * must not happen part-way through copying a sector from the block
+ * being abandoned.
+ */
+static int recover_step(struct dhara_map *m, uint8_t *restarts,
+			dhara_error_t *err)
+{
+	dhara_error_t my_err;
+	int ret = sector_room(m, &my_err);
+
+	if (!ret && dhara_journal_in_recovery(&m->journal)) {
+		const dhara_page_t p =
+			dhara_journal_next_recoverable(&m->journal);
+
+		if (p == DHARA_PAGE_NONE)
+			ret = pad_queue(m, &my_err);
+		else
+			ret = raw_gc(m, p, &my_err);
+	}
+
+	if (ret < 0) {
+		if (my_err != DHARA_E_RECOVER) {
+			dhara_set_error(err, my_err);
+			return -1;
+		}
+
+		if (*restarts >= DHARA_MAX_RETRIES) {
+			dhara_set_error(err, DHARA_E_TOO_BAD);
+			return -1;
+		}
+
+		/* The journal has rolled back to the start of
+		 * recovery, so relocations we've recorded in the
+		 * cache and bitmap since then have been undone.
+		 */
+		scache_clear(m);
+		live_reset(m, 0);
+		(*restarts)++;
+	}
+
+	return 0;
+}
+
+/* Attempt to recover the journal */
+static int try_recover(struct dhara_map *m, dhara_error_t cause,
+		       dhara_error_t *err)
+{
+	uint8_t restarts = 0;
+
+	if (cause != DHARA_E_RECOVER) {
+		dhara_set_error(err, cause);
+		return -1;
+	}
+
+	while (dhara_journal_in_recovery(&m->journal))
+		if (recover_step(m, &restarts, err) < 0)
+			return -1;
+
+	return 0;
+}
+
+/* Work out how many garbage collection steps are owed before the next
+ * write, and take them out of the pacing credit. The steps are owed for
+ * every page the write takes up.
+ */
+static unsigned int gc_owed(struct dhara_map *m, dhara_sector_t capacity)
+{
+	const dhara_sector_t size = dhara_journal_size(&m->journal);
+	const dhara_sector_t window = m->gc_window;
+	dhara_sector_t start;
+	unsigned int n = 0;
+
+	if (size >= capacity)
+		return m->gc_ratio * sector_cost(m);
+
+	/* Within the pacing window, we owe gc_ratio steps per write at
+	 * the threshold, and proportionally fewer below it. Fractions
+	 * of a step are carried over to the next write.
+	 */
+	start = (capacity > window) ? capacity - window : 0;
+	if (!window || (size < start))
+		return 0;
+
+	m->gc_credit += (size - start) * m->gc_ratio;
+	while (m->gc_credit >= window) {
+		m->gc_credit -= window;
+		n++;
+	}
+
+	return n * sector_cost(m);
+}
+
+static int auto_gc(struct dhara_map *m, dhara_sector_t capacity,
+		   dhara_error_t *err)
+{
+	unsigned int n = gc_owed(m, capacity);
+
+	while (n--)
+		if (dhara_map_gc(m, err) < 0)
+			return -1;
+
+	return 0;
+}
+
+/* State carried from one write to the next in a batch. We remember the
+ * map's capacity (which changes only when the bad block estimates do),
+ * and the metadata of the page we last wrote. Provided that nothing
+ * else has been written since, that page is the root, and the next
+ * path can be traced without reading the root's metadata back.
+ */
+struct batch {
+	dhara_sector_t		capacity;
+	dhara_block_t		bb_current;
+	uint8_t			epoch;
+
+	dhara_page_t		root;
+	uint8_t			root_meta[DHARA_META_SIZE];
+};
+
+static void batch_init(struct dhara_map *m, struct batch *b)
+{
+	b->capacity = page_capacity(m);
+	b->bb_current = m->journal.bb_current;
+	b->epoch = m->journal.epoch;
+	b->root = DHARA_PAGE_NONE;
+}
+
+static dhara_sector_t batch_capacity(struct dhara_map *m, struct batch *b)
+{
+	if (!b)
+		return page_capacity(m);
+
+	if ((b->bb_current != m->journal.bb_current) ||
+	    (b->epoch != m->journal.epoch))
+		batch_init(m, b);
+
+	return b->capacity;
+}
+
+static const uint8_t *batch_root_meta(const struct dhara_map *m,
+				      const struct batch *b)
+{
+	if (!b || (b->root == DHARA_PAGE_NONE) ||
+	    (b->root != dhara_journal_root(&m->journal)))
+		return NULL;
+
+	return b->root_meta;
+}
+
+/* Get ready to write a sector. We trace its path, and return the pages
+ * holding its current data and node (if any). Garbage collection must
+ * already have been done.
+ */
+static int prepare_write(struct dhara_map *m, dhara_sector_t dst,
+			 dhara_sector_t capacity, uint8_t *meta,
+			 struct batch *b,
+			 dhara_page_t *old_data, dhara_page_t *old_node,
+			 dhara_error_t *err)
+{
+	dhara_error_t my_err;
+
+	*old_data = DHARA_PAGE_NONE;
+	*old_node = DHARA_PAGE_NONE;
+
+	if (trace_path_hint(m, dst, old_data, old_node, meta,
+			    batch_root_meta(m, b), &my_err) < 0) {
+		if (my_err != DHARA_E_NOT_FOUND) {
+			dhara_set_error(err, my_err);
+			return -1;
+		}
+
+		if (m->count >= pages_to_sectors(m, capacity)) {
+			dhara_set_error(err, DHARA_E_MAP_FULL);
+			return -1;
+		}
+
+		m->count++;
+	}
+
+	ck_set_count(m, m->count);
+	return 0;
+}
+
+/* Trace and enqueue a single write, without collecting garbage or
+ * attempting recovery.
+ */
+static int try_write(struct dhara_map *m, dhara_sector_t dst,
+		     const uint8_t *data, dhara_sector_t capacity,
+		     struct batch *b, dhara_error_t *err)
+{
+	uint8_t meta[DHARA_META_SIZE];
+	const dhara_sector_t old_count = m->count;
+	dhara_page_t old_data;
+	dhara_page_t old_node;
+	dhara_page_t p;
+
+	if (sector_reserved(dst)) {
+		dhara_set_error(err, DHARA_E_SECTOR_RANGE);
+		return -1;
+	}
+
+	if ((sector_room(m, err) < 0) ||
+	    (prepare_write(m, dst, capacity, meta, b, &old_data, &old_node,
+			   err) < 0))
+		return -1;
+
+	if (enqueue_data(m, data, meta, 1, err) < 0) {
+		m->count = old_count;
+		return -1;
+	}
+
+	p = dhara_journal_root(&m->journal);
+	track(m, dst, p);
+	live_put(m, old_data, 0);
+	live_put(m, old_node, 0);
+	live_put(m, p, 1);
+	if (b) {
+		b->root = p;
+		memcpy(b->root_meta, meta, DHARA_META_SIZE);
+	}
+
+	return 0;
+}
+
+static int write_one(struct dhara_map *m, dhara_sector_t dst,
+		     const uint8_t *data, struct batch *b,
+		     dhara_error_t *err)
+{
+	for (;;) {
+		const dhara_sector_t capacity = batch_capacity(m, b);
+		dhara_error_t my_err;
+
+		if (snap_room(m, err) < 0)
+			return -1;
+
+		if (auto_gc(m, capacity, err) < 0)
+			return -1;
+
+		if (!try_write(m, dst, data, capacity, b, &my_err))
+			break;
+
+		if (try_recover(m, my_err, err) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int count_group(struct dhara_map *m, dhara_page_t p, int depth,
+		       dhara_sector_t base, dhara_sector_t *count,
+		       dhara_error_t *err);
+
+/* Find the order of the longest run which can be written now, starting
+ * at the first of the given sectors. Returns 0 if there's none.
+ */
+static int run_fits(struct dhara_map *m, dhara_sector_t first,
+		    dhara_sector_t count)
+{
+	const dhara_page_t room =
+		dhara_journal_run_room(&m->journal) >> m->log2_pps;
+	int order = m->run_order - m->run_order % DHARA_RADIX_BITS;
+
+	if (!can_run(m) || dhara_journal_in_recovery(&m->journal))
+		return 0;
+
+	for (; order >= DHARA_MAP_RUN_MIN; order -= DHARA_RADIX_BITS) {
+		const dhara_sector_t n = ((dhara_sector_t)1) << order;
+
+		if ((n <= count) && (n <= room) && !(first & (n - 1)) &&
+		    !sector_reserved(first + n - 1))
+			return order;
+	}
+
+	return 0;
+}
+
+/* Trace and enqueue a run, without collecting garbage or attempting
+ * recovery. Whatever was in the run's subtree is replaced: the members
+ * are enqueued first, followed by the record, which is the last sector.
+ */
+static int try_write_run(struct dhara_map *m, dhara_sector_t first,
+			 int order, const uint8_t *data,
+			 dhara_sector_t capacity, struct batch *b,
+			 dhara_error_t *err)
+{
+	const size_t sector_size = dhara_map_sector_size(m);
+	const int levels = DHARA_RADIX_DEPTH - order / DHARA_RADIX_BITS;
+	const dhara_sector_t n = ((dhara_sector_t)1) << order;
+	const dhara_sector_t last = first + n - 1;
+	const dhara_sector_t old_count = m->count;
+	uint8_t meta[DHARA_META_SIZE];
+	uint8_t member[DHARA_META_SIZE];
+	dhara_sector_t removed = 0;
+	dhara_error_t my_err;
+	dhara_page_t group;
+	dhara_page_t p;
+	dhara_sector_t i;
+
+	if (trace_group(m, last, levels, &group, meta, NULL, &my_err) < 0) {
+		if (my_err != DHARA_E_NOT_FOUND) {
+			dhara_set_error(err, my_err);
+			return -1;
+		}
+	} else if (count_group(m, group, levels, last, &removed, err) < 0) {
+		goto fail;
+	}
+
+	if (m->count - removed + n > pages_to_sectors(m, capacity)) {
+		dhara_set_error(err, DHARA_E_MAP_FULL);
+		goto fail;
+	}
+
+	m->count = m->count - removed + n;
+	ck_set_count(m, m->count);
+
+	path_clear(meta, levels);
+	meta_set_run(meta, order);
+
+	for (i = 0; i + 1 < n; i++) {
+		meta_clear(member);
+		meta_set_id(member, first + i);
+
+		if (enqueue_data(m, data + i * sector_size, member, 0,
+				 err) < 0)
+			goto fail;
+	}
+
+	if (enqueue_data(m, data + i * sector_size, meta, 1, err) < 0)
+		goto fail;
+
+	p = dhara_journal_root(&m->journal);
+	for (i = 0; i < n; i++) {
+		const dhara_page_t q =
+			p - ((dhara_page_t)(n - 1 - i) << m->log2_pps);
+
+		track(m, first + i, q);
+		live_put(m, q, 1);
+	}
+
+	if (b) {
+		b->root = p;
+		memcpy(b->root_meta, meta, DHARA_META_SIZE);
+	}
+
+	return 0;
+
+fail:
+	/* The subtree's pages may have been marked dead already */
+	m->count = old_count;
+	if (removed)
+		live_reset(m, 0);
+
+	return -1;
+}
+
+/* Write the longest run possible from the start of the given sectors.
+ * Returns its order, or 0 if no run could be written, in which case the
+ * first sector must be written singly.
+ */
+static int write_run(struct dhara_map *m, dhara_sector_t first,
+		     dhara_sector_t count, const uint8_t *data,
+		     struct batch *b, dhara_error_t *err)
+{
+	dhara_sector_t collected = 0;
+
+	for (;;) {
+		const dhara_sector_t capacity = batch_capacity(m, b);
+		dhara_error_t my_err;
+		int order;
+
+		if (snap_room(m, err) < 0)
+			return -1;
+
+		/* Collection may leave less room in the group than
+		 * there was, so check again after each step.
+		 */
+		order = run_fits(m, first, count);
+		if (!order)
+			return 0;
+
+		if (collected < (((dhara_sector_t)1) << order)) {
+			if (auto_gc(m, capacity, err) < 0)
+				return -1;
+
+			collected++;
+			continue;
+		}
+
+		if (!try_write_run(m, first, order, data, capacity, b,
+				   &my_err))
+			return order;
+
+		if (try_recover(m, my_err, err) < 0)
+			return -1;
+	}
+}
+
+int dhara_map_write(struct dhara_map *m, dhara_sector_t dst,
+		    const uint8_t *data, dhara_error_t *err)
+{
+	return write_one(m, dst, data, NULL, err);
+}
+
+int dhara_map_write_multi(struct dhara_map *m, dhara_sector_t first,
+			  dhara_sector_t count, const uint8_t *data,
+			  dhara_error_t *err)
+{
+	const size_t sector_size = dhara_map_sector_size(m);
+	struct batch b;
+	dhara_sector_t i = 0;
+
+	batch_init(m, &b);
+
+	while (i < count) {
+		const uint8_t *d = data + i * sector_size;
+		int order = 0;
+
+		if (m->run_order) {
+			order = write_run(m, first + i, count - i, d, &b, err);
+			if (order < 0)
+				return -1;
+		}
+
+		if (order) {
+			i += ((dhara_sector_t)1) << order;
+			continue;
+		}
+
+		if (write_one(m, first + i, d, &b, err) < 0)
+			return -1;
+
+		i++;
+	}
+
+	return 0;
+}
+
+int dhara_map_write_scatter(struct dhara_map *m,
+			    const dhara_sector_t *sectors,
+			    const uint8_t *const *data, size_t count,
+			    dhara_error_t *err)
+{
+	struct batch b;
+	size_t i;
+
+	batch_init(m, &b);
+
+	for (i = 0; i < count; i++)
+		if (write_one(m, sectors[i], data[i], &b, err) < 0)
+			return -1;
+
+	return 0;
+}
+
+int dhara_map_copy_page(struct dhara_map *m, dhara_page_t src,
+			dhara_sector_t dst, dhara_error_t *err)
+{
+	const dhara_page_t last = (((dhara_page_t)1) << m->log2_pps) - 1;
+
+	if (sector_reserved(dst)) {
+		dhara_set_error(err, DHARA_E_SECTOR_RANGE);
+		return -1;
+	}
+
+	for (;;) {
+		const dhara_sector_t capacity = page_capacity(m);
+		uint8_t meta[DHARA_META_SIZE];
+		dhara_error_t my_err;
+		const dhara_sector_t old_count = m->count;
+		dhara_page_t old_data;
+		dhara_page_t old_node;
+
+		if (snap_room(m, err) < 0)
+			return -1;
+
+		if (auto_gc(m, capacity, err) < 0)
+			return -1;
+
+		if (sector_room(m, &my_err) < 0) {
+			if (try_recover(m, my_err, err) < 0)
+				return -1;
+
+			continue;
+		}
+
+		if (prepare_write(m, dst, capacity, meta, NULL,
+				  &old_data, &old_node, err) < 0)
+			return -1;
+
+		if (!copy_data(m, src + last, meta, &my_err)) {
+			const dhara_page_t p = dhara_journal_root(&m->journal);
+
+			track(m, dst, p);
+			live_put(m, old_data, 0);
+			live_put(m, old_node, 0);
+			live_put(m, p, 1);
+			break;
+		}
+
+		m->count = old_count;
+
+		if (try_recover(m, my_err, err) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int dhara_map_copy_sector(struct dhara_map *m, dhara_sector_t src,
+			  dhara_sector_t dst, dhara_error_t *err)
+{
+	dhara_error_t my_err;
+	dhara_page_t p;
+
+	if (dhara_map_find(m, src, &p, &my_err) < 0) {
+		if (my_err == DHARA_E_NOT_FOUND)
+			return dhara_map_trim(m, dst, err);
+
+		dhara_set_error(err, my_err);
+		return -1;
+	}
+
+	return dhara_map_copy_page(m, p, dst, err);
+}
+
+/* Count the sectors in the subtree below the given page and depth
+ * (which share their leading digits with base), and mark their pages
+ * as dead in the liveness bitmap. The caller must reset the bitmap if
+ * the subtree isn't then removed.
+ */
+static int count_group(struct dhara_map *m, dhara_page_t p, int depth,
+		       dhara_sector_t base, dhara_sector_t *count,
+		       dhara_error_t *err)
+{
+	struct dhara_map_iter w;
+	dhara_sector_t s;
+	dhara_page_t loc;
+	int r;
+
+	*count = 0;
+
+	if (walk_begin_at(m, &w, p, depth, base, err) < 0)
+		return -1;
+
+	while ((r = walk_next(m, &w, &s, &loc, err)) > 0) {
+		live_put(m, loc, 0);
+		live_put(m, w.node, 0);
+		(*count)++;
+	}
+
+	return r;
+}
+
+/* A group whose order isn't a whole number of digits is not a single
+ * subtree. It's deleted as several subtrees of the next lower order,
+ * one at a time, starting from the base of the group.
+ */
+static inline int subgroup_order(unsigned int order)
+{
+	return order - order % DHARA_RADIX_BITS;
+}
+
+/* The last sector of the group containing s. A full-width group is the
+ * whole sector space, and can't be masked with a shift.
+ */
+static inline dhara_sector_t group_last(dhara_sector_t s,
+					unsigned int order)
+{
+	if (order >= DHARA_SECTOR_BITS)
+		return (dhara_sector_t)~(dhara_sector_t)0;
+
+	return s | ((((dhara_sector_t)1) << order) - 1);
+}
+
+static inline dhara_sector_t group_base(dhara_sector_t s,
+					unsigned int order)
+{
+	return s & ~group_last(0, order);
+}
+
+/* Advance to the next subtree of a group. Returns 0 if there are no
+ * more.
+ */
+static int next_subgroup(dhara_sector_t *s, unsigned int order)
+{
+	const int sub = subgroup_order(order);
+	dhara_sector_t last;
+
+	if (sub == (int)order)
+		return 0;
+
+	last = (((dhara_sector_t)1) << (order - sub)) - 1;
+	if (((*s >> sub) & last) == last)
+		return 0;
+
+	*s += ((dhara_sector_t)1) << sub;
+	return 1;
+}
+
+/* Give every sector still held by a run record a node of its own (a
+ * tombstone, if possible), so that the run can be taken apart. They're
+ * visited in ascending order, which leaves the record's own sector
+ * until last, when the run no longer holds anything else.
+ */
+static int dissolve_run(struct dhara_map *m, dhara_page_t run,
+			const uint8_t *run_meta, dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	const dhara_sector_t n =
+		((dhara_sector_t)1) << meta_run_order(run_meta, tags);
+	const dhara_sector_t first = meta_get_id(run_meta) - (n - 1);
+	dhara_sector_t i;
+
+	ck_set_count(m, m->count);
+
+	for (i = 0; i < n; i++) {
+		uint8_t meta[DHARA_META_SIZE];
+		dhara_error_t my_err;
+		dhara_page_t loc;
+		dhara_page_t node;
+
+		if (trace_path_hint(m, first + i, &loc, &node, meta, NULL,
+				    &my_err) < 0) {
+			if (my_err == DHARA_E_NOT_FOUND)
+				continue;
+
+			dhara_set_error(err, my_err);
+			return -1;
+		}
+
+		/* Skip sectors which have moved on since */
+		if ((loc != meta_sector_page(run_meta, run, first + i,
+					     m->log2_pps, tags)) ||
+		    ((node != DHARA_PAGE_NONE) && (node != run)))
+			continue;
+
+		if (enqueue_node(m, meta, loc, err) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Delete the subtree of the given group which holds s. Returns 0 once
+ * this is done, or 1 if a run had to be taken apart first, in which
+ * case it must be called again.
+ */
+static int try_delete(struct dhara_map *m, dhara_sector_t s,
+		      int order, dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	const int sub = subgroup_order(order);
+	const int levels = (DHARA_SECTOR_BITS - sub) / DHARA_RADIX_BITS;
+	dhara_error_t my_err;
+	uint8_t meta[DHARA_META_SIZE];
+	dhara_page_t group;
+	dhara_sector_t removed = 1;
+	dhara_page_t alt_page = DHARA_PAGE_NONE;
+	dhara_page_t alt_data;
+	uint8_t alt_meta[DHARA_META_SIZE];
+	dhara_page_t keep[DHARA_RADIX_FANOUT];
+	int level = levels - 1;
+	int cousin;
+	int d;
+	int i;
+
+	if (trace_group(m, s, levels, &group, meta, alt_meta, &my_err) < 0) {
+		if (my_err == DHARA_E_NOT_FOUND)
+			return 0;
+
+		dhara_set_error(err, my_err);
+		return -1;
+	}
+
+	/* A run holding more than the group can't be partly removed */
+	if (meta_term(alt_meta, tags) < levels)
+		return (dissolve_run(m, group, alt_meta, err) < 0) ? -1 : 1;
+
+	/* Select any of the closest cousins of this node which are
+	 * subtrees of at least the requested order.
+	 */
+	while (level >= 0) {
+		for (d = 0; d < DHARA_RADIX_FANOUT; d++) {
+			if (d == digit(s, level))
+				continue;
+
+			alt_page = meta_get_alt(meta, level, d);
+			if (alt_page != DHARA_PAGE_NONE)
+				break;
+		}
+
+		if (alt_page != DHARA_PAGE_NONE)
+			break;
+		level--;
+	}
+
+	/* Special case: deletion of last sector (or group) */
+	if (level < 0) {
+		m->count = 0;
+		dhara_journal_clear(&m->journal);
+		scache_clear(m);
+		idx_clear(m);
+		live_reset(m, 1);
+		return 0;
+	}
+
+	/* Rewrite the cousin with an up-to-date path which doesn't
+	 * point to the original node. Below the selected level, the
+	 * original side of the tree holds nothing but the group being
+	 * deleted. At the selected level, the cousin keeps the other
+	 * alt-pointers of the original path. A run can't be rewritten
+	 * with a different path, so it's taken apart instead.
+	 */
+	if (dhara_journal_read_meta(&m->journal, alt_page, alt_meta, err) < 0)
+		return -1;
+
+	if (meta_run_order(alt_meta, tags))
+		return (dissolve_run(m, alt_page, alt_meta, err) < 0) ? -1 : 1;
+
+	if ((sub || m->live.bits) &&
+	    (count_group(m, group, levels, s, &removed, err) < 0)) {
+		live_reset(m, 0);
+		return -1;
+	}
+
+	alt_data = meta_data_page(alt_meta, alt_page, tags);
+	cousin = digit(meta_get_id(alt_meta), level);
+
+	for (d = 0; d < DHARA_RADIX_FANOUT; d++)
+		keep[d] = (d == digit(s, level)) ? DHARA_PAGE_NONE :
+			meta_get_alt(meta, level, d);
+
+	meta_set_id(meta, meta_get_id(alt_meta));
+
+	for (d = 0; d < DHARA_RADIX_FANOUT; d++)
+		if (d != cousin)
+			meta_set_alt(meta, level, d, keep[d]);
+
+	for (i = (level + 1) * (DHARA_RADIX_FANOUT - 1);
+	     i < DHARA_MAP_ALTS; i++)
+		slot_set(meta, i, slot_get(alt_meta, i));
+
+	ck_set_count(m, m->count - removed);
+	if (enqueue_node(m, meta, alt_data, err) < 0) {
+		live_reset(m, 0);
+		return -1;
+	}
+
+	if (alt_data != alt_page)
+		live_put(m, alt_page, 0);
+
+	if (sub) {
+		const dhara_sector_t mask = (1ul << sub) - 1;
+
+		untrack_range(m, s & ~mask, s | mask);
+	} else {
+		track(m, s, DHARA_PAGE_NONE);
+	}
+
+	m->count -= removed;
+	return 0;
+}
+
+/* While the tail is held, there may be snapshot records, and a trim
+ * which reaches the reserved sectors is clipped short of them. The rest
+ * of the group is deleted as the largest aligned subtrees that fit, in
+ * ascending order.
+ */
+static int trim_clipped(const struct dhara_map *m, dhara_sector_t s,
+			unsigned int order)
+{
+	return (m->journal.flags & DHARA_JOURNAL_F_HOLD) &&
+		sector_reserved(group_last(s, order));
+}
+
+/* The order of the group to pass to try_delete() next, starting at s */
+static unsigned int trim_piece(const struct dhara_map *m, dhara_sector_t s,
+			       unsigned int order)
+{
+	unsigned int k = 0;
+
+	if (!trim_clipped(m, s, order))
+		return order;
+
+	while (k + DHARA_RADIX_BITS < DHARA_SECTOR_BITS) {
+		const dhara_sector_t mask =
+			group_last(0, k + DHARA_RADIX_BITS);
+
+		if ((s & mask) || sector_reserved(s | mask))
+			break;
+
+		k += DHARA_RADIX_BITS;
+	}
+
+	return k;
+}
+
+/* Advance a trim to its next subtree. Returns 0 if there are no more. */
+static int next_piece(const struct dhara_map *m, dhara_sector_t *s,
+		      unsigned int order)
+{
+	if (!trim_clipped(m, *s, order))
+		return next_subgroup(s, order);
+
+	*s += ((dhara_sector_t)1) << trim_piece(m, *s, order);
+	return !sector_reserved(*s);
+}
+
+/* Delete the subtree of the given group which holds s, collecting
+ * garbage and recovering as necessary. Snapshot records are deleted
+ * with the reserve disabled, so that they can still be released once
+ * ordinary writes have filled the journal.
+ */
+static int delete_group(struct dhara_map *m, dhara_sector_t s,
+			unsigned int order, int reserve, dhara_error_t *err)
+{
+	for (;;) {
+		dhara_error_t my_err;
+		int r;
+
+		if (reserve && snap_room(m, err) < 0)
+			return -1;
+
+		if (auto_gc(m, page_capacity(m), err) < 0)
+			return -1;
+
+		r = try_delete(m, s, order, &my_err);
+		if (!r)
+			return 0;
+
+		if ((r < 0) && (try_recover(m, my_err, err) < 0))
+			return -1;
+	}
+}
+
+int dhara_map_trim_group(struct dhara_map *m, dhara_sector_t s,
+			 unsigned int order, dhara_error_t *err)
+{
+	if (order > DHARA_SECTOR_BITS)
+		order = DHARA_SECTOR_BITS;
+
+	s = group_base(s, order);
+	if (sector_reserved(s)) {
+		dhara_set_error(err, DHARA_E_SECTOR_RANGE);
+		return -1;
+	}
+
+	do {
+		if (delete_group(m, s, trim_piece(m, s, order), 1, err) < 0)
+			return -1;
+	} while (next_piece(m, &s, order));
+
+	return 0;
+}
+
+int dhara_map_trim(struct dhara_map *m, dhara_sector_t s, dhara_error_t *err)
+{
+	return dhara_map_trim_group(m, s, 0, err);
+}
+
+/* Collect the page at the tail of the journal. Once the liveness
+ * bitmap is complete, dead pages can be skipped without reading them.
+ * Until then, each page collected advances the rebuild by one sector.
+ */
+static int gc_tail(struct dhara_map *m, dhara_page_t p, dhara_error_t *err)
+{
+	if (m->live.bits && !dhara_journal_in_recovery(&m->journal)) {
+		if (!m->live.valid) {
+			if (live_step(m, err) < 0)
+				return -1;
+		} else if (!live_get(m, p)) {
+			m->live.skipped++;
+			return 0;
+		}
+	}
+
+	return raw_gc(m, p, err);
+}
+
+/* Move the journal one page closer to a checkpoint, collecting from
+ * the tail if possible.
+ */
+static int sync_once(struct dhara_map *m, dhara_error_t *err)
+{
+	dhara_page_t p;
+	int ret;
+
+	/* An early checkpoint isn't always possible. If not, we pad as
+	 * usual, which will usually make it possible next time.
+	 */
+	if (m->fast_sync) {
+		ck_set_count(m, m->count);
+
+		if (dhara_journal_flush(&m->journal, err) < 0)
+			return -1;
+
+		if (dhara_journal_is_clean(&m->journal)) {
+			m->sync_padded++;
+			return 0;
+		}
+	}
+
+	/* Once a whole sector won't fit, collecting from the tail would
+	 * only pad the group before copying more data into it. It's
+	 * finished off instead.
+	 */
+	p = dhara_journal_peek(&m->journal);
+	if (m->log2_pps &&
+	    (dhara_journal_run_room(&m->journal) < (1u << m->log2_pps)))
+		ret = sector_room(m, err);
+	else if (p == DHARA_PAGE_NONE)
+		ret = pad_queue(m, err);
+	else {
+		/* A failed copy leaves the page in use */
+		ret = gc_tail(m, p, err);
+		if (!ret)
+			dhara_journal_dequeue(&m->journal);
+	}
+
+	if (!ret)
+		m->sync_padded++;
+
+	return ret;
+}
+
+/* The journal is clean, so every outstanding request is satisfied.
+ * Whatever they would have cost beyond the padding actually done since
+ * the last time was saved.
+ */
+static void sync_settle(struct dhara_map *m)
+{
+	const uint32_t padded = m->sync_padded - m->sync_mark;
+
+	if (m->sync_owed > padded)
+		m->sync_saved += m->sync_owed - padded;
+
+	m->sync_owed = 0;
+	m->sync_mark = m->sync_padded;
+	m->sync_durable = m->sync_ticket;
+}
+
+int dhara_map_sync(struct dhara_map *m, dhara_error_t *err)
+{
+	while (!dhara_journal_is_clean(&m->journal)) {
+		dhara_error_t my_err;
+
+		if ((sync_once(m, &my_err) < 0) &&
+		    (try_recover(m, my_err, err) < 0))
+			return -1;
+	}
+
+	sync_settle(m);
+	return 0;
+}
+
+uint32_t dhara_map_sync_request(struct dhara_map *m)
+{
+	const struct dhara_journal *j = &m->journal;
+	const dhara_page_t mask = (1 << j->log2_ppc) - 1;
+
+	m->sync_requests++;
+
+	if (dhara_journal_is_clean(j)) {
+		sync_settle(m);
+		return m->sync_ticket;
+	}
+
+	/* A sync now would fill the rest of the checkpoint group, or
+	 * write a single early checkpoint.
+	 */
+	m->sync_owed += m->fast_sync ? 1 : mask - (j->head & mask);
+	return ++m->sync_ticket;
+}
+
+/* Collect the page at the tail, if there is one. The page is dequeued
+ * only if this succeeds.
+ */
+static int gc_once(struct dhara_map *m, dhara_error_t *err)
+{
+	dhara_page_t tail = dhara_journal_peek(&m->journal);
+
+	if (tail == DHARA_PAGE_NONE)
+		return 0;
+
+	if (gc_tail(m, tail, err) < 0)
+		return -1;
+
+	dhara_journal_dequeue(&m->journal);
+	return 0;
+}
+
+int dhara_map_gc(struct dhara_map *m, dhara_error_t *err)
+{
+	if (!m->count)
+		return 0;
+
+	for (;;) {
+		dhara_error_t my_err;
+
+		if (!gc_once(m, &my_err))
+			break;
+
+		if (try_recover(m, my_err, err) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+dhara_sector_t dhara_map_gc_debt(const struct dhara_map *m,
+				 dhara_sector_t headroom)
+{
+	const dhara_sector_t size = dhara_journal_size(&m->journal) -
+		dhara_journal_dequeued(&m->journal);
+	const dhara_sector_t threshold = page_capacity(m);
+
+	if (!m->count || (size + headroom < threshold))
+		return 0;
+
+	return size + headroom + 1 - threshold;
+}
+
+int dhara_map_gc_budget(struct dhara_map *m, unsigned int budget,
+			dhara_sector_t headroom, dhara_sector_t *debt,
+			dhara_error_t *err)
+{
+	while (budget && dhara_map_gc_debt(m, headroom) &&
+	       (dhara_journal_peek(&m->journal) != DHARA_PAGE_NONE)) {
+		const uint32_t skipped = m->live.skipped;
+
+		if (dhara_map_gc(m, err) < 0)
+			return -1;
+
+		/* Pages skipped using the liveness bitmap are free */
+		if (m->live.skipped == skipped)
+			budget--;
+	}
+
+	if (debt)
+		*debt = dhara_map_gc_debt(m, headroom);
+
+	return 0;
+}
+
+int dhara_map_pre_erase(struct dhara_map *m, dhara_error_t *err)
+{
+	return dhara_journal_pre_erase(&m->journal, err);
+}
+
+/************************************************************************
+ * Resumable operations
+ */
+
+#define OP_START		0
+#define OP_GC			1
+#define OP_MAIN			2
+#define OP_RECOVER		3
+#define OP_DONE			4
+
+static void op_begin(struct dhara_map_op *op, uint8_t type,
+		     dhara_sector_t s, unsigned int order,
+		     const uint8_t *data)
+{
+	op->type = type;
+	op->phase = OP_START;
+	op->resume = OP_START;
+	op->restarts = 0;
+	op->sector = s;
+	op->order = (order > DHARA_SECTOR_BITS) ? DHARA_SECTOR_BITS : order;
+	op->sector = group_base(s, op->order);
+	op->data = data;
+	op->capacity = 0;
+	op->gc_left = 0;
+}
+
+void dhara_map_begin_write(struct dhara_map_op *op, dhara_sector_t s,
+			   const uint8_t *data)
+{
+	op_begin(op, DHARA_MAP_OP_WRITE, s, 0, data);
+}
+
+void dhara_map_begin_trim(struct dhara_map_op *op, dhara_sector_t s,
+			  unsigned int order)
+{
+	op_begin(op, DHARA_MAP_OP_TRIM, s, order, NULL);
+}
+
+void dhara_map_begin_sync(struct dhara_map_op *op)
+{
+	op_begin(op, DHARA_MAP_OP_SYNC, DHARA_SECTOR_NONE, 0, NULL);
+}
+
+void dhara_map_begin_gc(struct dhara_map_op *op)
+{
+	op_begin(op, DHARA_MAP_OP_GC, DHARA_SECTOR_NONE, 0, NULL);
+}
+
+/* Handle a failed step. This is the same as try_recover(), except that
+ * recovery proceeds one page per step. Once it's done, we carry on
+ * from the given phase.
+ */
+static int op_fail(struct dhara_map_op *op, uint8_t resume,
+		   dhara_error_t cause, dhara_error_t *err)
+{
+	if (cause != DHARA_E_RECOVER) {
+		dhara_set_error(err, cause);
+		op->phase = OP_DONE;
+		return -1;
+	}
+
+	op->phase = OP_RECOVER;
+	op->resume = resume;
+	op->restarts = 0;
+	return 1;
+}
+
+/* Perform the operation itself, once any garbage collection it owes is
+ * done.
+ */
+static int op_main(struct dhara_map *m, struct dhara_map_op *op,
+		   dhara_error_t *err)
+{
+	dhara_error_t my_err;
+
+	switch (op->type) {
+	case DHARA_MAP_OP_WRITE:
+		if (try_write(m, op->sector, op->data, op->capacity,
+			      NULL, &my_err) < 0)
+			return op_fail(op, OP_START, my_err, err);
+		break;
+
+	case DHARA_MAP_OP_TRIM:
+		if (sector_reserved(op->sector))
+			return op_fail(op, OP_START, DHARA_E_SECTOR_RANGE, err);
+
+		switch (try_delete(m, op->sector,
+				   trim_piece(m, op->sector, op->order),
+				   &my_err)) {
+		case -1:
+			return op_fail(op, OP_START, my_err, err);
+
+		case 1:
+			/* A run was taken apart. Try again. */
+			op->phase = OP_START;
+			return 1;
+		}
+
+		/* Each further subtree is a step of its own */
+		if (next_piece(m, &op->sector, op->order)) {
+			op->phase = OP_START;
+			return 1;
+		}
+		break;
+
+	case DHARA_MAP_OP_SYNC:
+		if (dhara_journal_is_clean(&m->journal)) {
+			sync_settle(m);
+			break;
+		}
+
+		if (sync_once(m, &my_err) < 0)
+			return op_fail(op, OP_MAIN, my_err, err);
+		return 1;
+	}
+
+	op->phase = OP_DONE;
+	return 0;
+}
+
+int dhara_map_step(struct dhara_map *m, struct dhara_map_op *op,
+		   dhara_error_t *err)
+{
+	dhara_error_t my_err;
+
+	for (;;) {
+		switch (op->phase) {
+		case OP_START:
+			if ((op->type == DHARA_MAP_OP_WRITE ||
+			     op->type == DHARA_MAP_OP_TRIM) &&
+			    snap_room(m, err) < 0) {
+				op->phase = OP_DONE;
+				return -1;
+			}
+
+			op->capacity = page_capacity(m);
+
+			if (op->type == DHARA_MAP_OP_GC)
+				op->gc_left = 1;
+			else if (op->type == DHARA_MAP_OP_SYNC)
+				op->gc_left = 0;
+			else
+				op->gc_left = gc_owed(m, op->capacity);
+
+			op->phase = OP_GC;
+			break;
+
+		case OP_GC:
+			if (!op->gc_left || !m->count) {
+				op->phase = OP_MAIN;
+				break;
+			}
+
+			if (gc_once(m, &my_err) < 0)
+				return op_fail(op, OP_GC, my_err, err);
+
+			op->gc_left--;
+			return 1;
+
+		case OP_MAIN:
+			return op_main(m, op, err);
+
+		case OP_RECOVER:
+			if (!dhara_journal_in_recovery(&m->journal)) {
+				op->phase = op->resume;
+				break;
+			}
+
+			if (recover_step(m, &op->restarts, err) < 0) {
+				op->phase = OP_DONE;
+				return -1;
+			}
+
+			return 1;
+
+		default:
+			return 0;
+		}
+	}
+}
+
+/************************************************************************
+ * Snapshots
+ */
+
+static inline dhara_sector_t snap_sector(unsigned int id)
+{
+	return DHARA_MAP_SNAPSHOT_BASE + id;
+}
+
+/* Trace a sector through the tree below an arbitrary root. */
+static int find_from(struct dhara_map *m, dhara_page_t p,
+		     dhara_sector_t target, dhara_page_t *loc,
+		     dhara_error_t *err)
+{
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	uint8_t meta[DHARA_META_SIZE];
+	int depth;
+
+	if (p == DHARA_PAGE_NONE)
+		goto not_found;
+
+	if (dhara_journal_read_meta(&m->journal, p, meta, err) < 0)
+		return -1;
+
+	for (depth = 0; depth < DHARA_RADIX_DEPTH; depth++) {
+		const dhara_sector_t id = meta_get_id(meta);
+
+		if (id == DHARA_SECTOR_NONE)
+			goto not_found;
+
+		if (!meta_has(meta, depth, digit(target, depth), tags)) {
+			p = meta_get_alt(meta, depth, digit(target, depth));
+			if (p == DHARA_PAGE_NONE)
+				goto not_found;
+
+			if (dhara_journal_read_meta(&m->journal, p,
+						    meta, err) < 0)
+				return -1;
+		}
+	}
+
+	*loc = meta_sector_page(meta, p, target, m->log2_pps, tags);
+	return 0;
+
+not_found:
+	dhara_set_error(err, DHARA_E_NOT_FOUND);
+	return -1;
+}
+
+/* While the tail is held, nothing is ever reclaimed. Ordinary
+ * modifications stop this many blocks short of a full journal, so that
+ * there's always room left to roll back or release a snapshot.
+ */
+#define SNAP_RESERVE_BLOCKS		4
+
+static int snap_room(const struct dhara_map *m, dhara_error_t *err)
+{
+	const struct dhara_journal *j = &m->journal;
+	const dhara_page_t reserve =
+		((dhara_page_t)SNAP_RESERVE_BLOCKS) << j->nand->log2_ppb;
+
+	if (!(j->flags & DHARA_JOURNAL_F_HOLD) ||
+	    dhara_journal_size(j) + reserve < dhara_journal_capacity(j))
+		return 0;
+
+	dhara_set_error(err, DHARA_E_JOURNAL_FULL);
+	return -1;
+}
+
+/* Count the snapshot records, and hold the tail if, and only if, there
+ * are any. If we can't tell, the tail is held.
+ */
+static int snap_check(struct dhara_map *m, dhara_error_t *err)
+{
+	unsigned int i;
+
+	dhara_journal_hold_tail(&m->journal, 1);
+	m->snapshots = 0;
 
-	if (loc)
-		*loc = p;
+	for (i = 0; i < DHARA_MAP_SNAPSHOTS; i++) {
+		dhara_error_t my_err;
 
-	return 0;
+		if (!trace_path(m, snap_sector(i), NULL, NULL, &my_err)) {
+			m->snapshots++;
+			continue;
+		}
 
-not_found:
-	if (new_meta) {
-		while (depth < DHARA_RADIX_DEPTH)
-			meta_set_alt(new_meta, depth++, DHARA_SECTOR_NONE);
+		if (my_err != DHARA_E_NOT_FOUND) {
+			dhara_set_error(err, my_err);
+			return -1;
+		}
 	}
 
-	dhara_set_error(err, DHARA_E_NOT_FOUND);
-	return -1;
-}
+	if (!m->snapshots)
+		dhara_journal_hold_tail(&m->journal, 0);
 
-int dhara_map_find(struct dhara_map *m, dhara_sector_t target,
-		   dhara_page_t *loc, dhara_error_t *err)
-{
-	return trace_path(m, target, loc, NULL, err);
+	return 0;
 }
 
-int dhara_map_read(struct dhara_map *m, dhara_sector_t s,
-		   uint8_t *data, dhara_error_t *err)
+/* Pad the journal out to the start of the next block, so that the root
+ * and every page it refers to are in complete blocks. Recovery only
+ * relocates pages from the block being written, and pages which are
+ * live only in a snapshot are then never part of it.
+ */
+static int pad_block(struct dhara_map *m, dhara_error_t *err)
 {
-	const struct dhara_nand *n = m->journal.nand;
-	dhara_error_t my_err;
-	dhara_page_t p;
+	const dhara_page_t mask = (1 << m->journal.nand->log2_ppb) - 1;
 
-	if (dhara_map_find(m, s, &p, &my_err) < 0) {
-		if (my_err == DHARA_E_NOT_FOUND) {
-			memset(data, 0xff, 1 << n->log2_page_size);
-			return 0;
-		}
+	while ((m->journal.head & mask) ||
+	       (dhara_journal_root(&m->journal) == DHARA_PAGE_NONE)) {
+		dhara_error_t my_err;
 
-		dhara_set_error(err, my_err);
-		return -1;
+		if ((pad_queue(m, &my_err) < 0) &&
+		    (try_recover(m, my_err, err) < 0))
+			return -1;
 	}
 
-	return dhara_nand_read(n, p, 0, 1 << n->log2_page_size, data, err);
+	return 0;
 }
 
-/* Check the given page. If it's garbage, do nothing. Otherwise, rewrite
- * it at the front of the map. Return raw errors from the journal (do
- * not perform recovery).
+/* Write a snapshot record. This is a tombstone whose data page is the
+ * snapshot's root, so looking up the record gives the root.
  */
-static int raw_gc(struct dhara_map *m, dhara_page_t src,
-		  dhara_error_t *err)
+static int snap_put(struct dhara_map *m, unsigned int id,
+		    dhara_page_t root, dhara_error_t *err)
 {
-	dhara_sector_t target;
-	dhara_page_t current;
-	dhara_error_t my_err;
-	uint8_t meta[DHARA_META_SIZE];
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	const dhara_sector_t s = snap_sector(id);
 
-	if (dhara_journal_read_meta(&m->journal, src, meta, err) < 0)
-		return -1;
+	for (;;) {
+		const dhara_sector_t capacity = page_capacity(m);
+		uint8_t meta[DHARA_META_SIZE];
+		dhara_error_t my_err;
+		const dhara_sector_t old_count = m->count;
+		dhara_page_t old_data;
+		dhara_page_t old_node;
 
-	/* Is the page just filler/garbage? */
-	target = meta_get_id(meta);
-	if (target == DHARA_SECTOR_NONE)
-		return 0;
+		if (auto_gc(m, capacity, err) < 0)
+			return -1;
 
-	/* Find out where the sector once represented by this page
-	 * currently resides (if anywhere).
-	 */
-	if (trace_path(m, target, &current, meta, &my_err) < 0) {
-		if (my_err == DHARA_E_NOT_FOUND)
-			return 0;
+		if (prepare_write(m, s, capacity, meta, NULL,
+				  &old_data, &old_node, err) < 0)
+			return -1;
 
-		dhara_set_error(err, my_err);
-		return -1;
-	}
+		if (!can_tombstone(m) || meta_set_tombstone(meta, root, tags)) {
+			m->count = old_count;
+			dhara_set_error(err, DHARA_E_MAP_FULL);
+			return -1;
+		}
 
-	/* Is this page still the most current representative? If not,
-	 * do nothing.
-	 */
-	if (current != src)
-		return 0;
+		/* The old root may well be live, so only the old node
+		 * is garbage.
+		 */
+		if (!dhara_journal_enqueue(&m->journal, NULL, meta, &my_err)) {
+			track(m, s, root);
+			live_put(m, old_node, 0);
+			live_put(m, dhara_journal_root(&m->journal), 1);
+			break;
+		}
 
-	/* Rewrite it at the front of the journal with updated metadata */
-	ck_set_count(dhara_journal_cookie(&m->journal), m->count);
-	if (dhara_journal_copy(&m->journal, src, meta, err) < 0)
-		return -1;
+		m->count = old_count;
+
+		if (try_recover(m, my_err, err) < 0)
+			return -1;
+	}
 
 	return 0;
 }
 
-static int pad_queue(struct dhara_map *m, dhara_error_t *err)
+static int snap_root(struct dhara_map *m, unsigned int id,
+		     dhara_page_t *root, dhara_error_t *err)
 {
-	dhara_page_t p = dhara_journal_root(&m->journal);
-	uint8_t root_meta[DHARA_META_SIZE];
-
-	ck_set_count(dhara_journal_cookie(&m->journal), m->count);
+	if (id >= DHARA_MAP_SNAPSHOTS) {
+		dhara_set_error(err, DHARA_E_NOT_FOUND);
+		return -1;
+	}
 
-	if (p == DHARA_PAGE_NONE)
-		return dhara_journal_enqueue(&m->journal, NULL, NULL, err);
+	return find_page(m, snap_sector(id), root, err);
+}
 
-	if (dhara_journal_read_meta(&m->journal, p, root_meta, err) < 0)
-		return -1;
+/* Deleting a record (or the data page of any tombstone) clears its
+ * data page in the liveness bitmap. For a record, the root may still be
+ * live, so the bitmap must be rebuilt. This is done once, after any
+ * records have been deleted with snap_delete().
+ */
+static void snap_trimmed(struct dhara_map *m)
+{
+	live_reset(m, 0);
+	snap_check(m, NULL);
+}
 
-	return dhara_journal_copy(&m->journal, p, root_meta, err);
+static int snap_delete(struct dhara_map *m, unsigned int id,
+		       dhara_error_t *err)
+{
+	return delete_group(m, snap_sector(id), 0, 0, err);
 }
 
-/* Attempt to recover the journal */
-static int try_recover(struct dhara_map *m, dhara_error_t cause,
+int dhara_map_snapshot(struct dhara_map *m, unsigned int id,
 		       dhara_error_t *err)
 {
-	int restart_count = 0;
+	int r;
 
-	if (cause != DHARA_E_RECOVER) {
-		dhara_set_error(err, cause);
+	if (id >= DHARA_MAP_SNAPSHOTS) {
+		dhara_set_error(err, DHARA_E_NOT_FOUND);
 		return -1;
 	}
 
-	while (dhara_journal_in_recovery(&m->journal)) {
-		dhara_page_t p = dhara_journal_next_recoverable(&m->journal);
-		dhara_error_t my_err;
-		int ret;
+	if (!can_tombstone(m)) {
+		dhara_set_error(err, DHARA_E_BAD_FORMAT);
+		return -1;
+	}
 
-		if (p == DHARA_PAGE_NONE)
-			ret = pad_queue(m, &my_err);
-		else
-			ret = raw_gc(m, p, &my_err);
+	if (pad_block(m, err) < 0)
+		return -1;
 
-		if (ret < 0) {
-			if (my_err != DHARA_E_RECOVER) {
-				dhara_set_error(err, my_err);
-				return -1;
-			}
+	dhara_journal_hold_tail(&m->journal, 1);
 
-			if (restart_count >= DHARA_MAX_RETRIES) {
-				dhara_set_error(err, DHARA_E_TOO_BAD);
-				return -1;
-			}
+	r = snap_put(m, id, dhara_journal_root(&m->journal), err);
+	snap_check(m, NULL);
 
-			restart_count++;
-		}
-	}
+	if (r < 0)
+		return -1;
 
-	return 0;
+	return dhara_map_sync(m, err);
 }
 
-static int auto_gc(struct dhara_map *m, dhara_error_t *err)
+int dhara_map_snapshot_release(struct dhara_map *m, unsigned int id,
+			       dhara_error_t *err)
 {
-	int i;
-
-	if (dhara_journal_size(&m->journal) < dhara_map_capacity(m))
+	if (id >= DHARA_MAP_SNAPSHOTS)
 		return 0;
 
-	for (i = 0; i < m->gc_ratio; i++)
-		if (dhara_map_gc(m, err) < 0)
-			return -1;
+	if (snap_delete(m, id, err) < 0)
+		return -1;
 
-	return 0;
+	snap_trimmed(m);
+	return dhara_map_sync(m, err);
 }
 
-static int prepare_write(struct dhara_map *m, dhara_sector_t dst,
-			 uint8_t *meta, dhara_error_t *err)
+/* Count the sectors in the tree below the given root */
+static int count_tree(struct dhara_map *m, dhara_page_t root,
+		      dhara_sector_t *count, dhara_error_t *err)
 {
-	dhara_error_t my_err;
-
-	if (auto_gc(m, err) < 0)
-		return -1;
+	struct dhara_map_iter w;
+	dhara_sector_t s;
+	dhara_page_t loc;
+	int r;
 
-	if (trace_path(m, dst, NULL, meta, &my_err) < 0) {
-		if (my_err != DHARA_E_NOT_FOUND) {
-			dhara_set_error(err, my_err);
-			return -1;
-		}
+	*count = 0;
 
-		if (m->count >= dhara_map_capacity(m)) {
-			dhara_set_error(err, DHARA_E_MAP_FULL);
-			return -1;
-		}
+	if (walk_begin_at(m, &w, root, 0, 0, err) < 0)
+		return -1;
 
-		m->count++;
-	}
+	while ((r = walk_next(m, &w, &s, &loc, err)) > 0)
+		(*count)++;
 
-	ck_set_count(dhara_journal_cookie(&m->journal), m->count);
-	return 0;
+	return r;
 }
 
-int dhara_map_write(struct dhara_map *m, dhara_sector_t dst,
-		    const uint8_t *data, dhara_error_t *err)
+int dhara_map_snapshot_rollback(struct dhara_map *m, unsigned int id,
+				dhara_error_t *err)
 {
+	const dhara_page_t tags = tag_mask(m->journal.nand);
+	dhara_page_t root;
+	dhara_page_t old_root;
+	dhara_sector_t count;
+	unsigned int i;
+
+	if ((snap_root(m, id, &root, err) < 0) ||
+	    (count_tree(m, root, &count, err) < 0) ||
+	    (pad_block(m, err) < 0))
+		return -1;
+
+	/* The current tree is now in complete blocks, and we'll need
+	 * it to find the other snapshots once the new root is in place.
+	 */
+	old_root = dhara_journal_root(&m->journal);
+
 	for (;;) {
 		uint8_t meta[DHARA_META_SIZE];
 		dhara_error_t my_err;
 		const dhara_sector_t old_count = m->count;
 
-		if (prepare_write(m, dst, meta, err) < 0)
+		if (dhara_journal_read_meta(&m->journal, root, meta, err) < 0)
 			return -1;
 
-		if (!dhara_journal_enqueue(&m->journal, data, meta, &my_err))
+		m->count = count;
+		ck_set_count(m, count);
+
+		if (!enqueue_node(m, meta, meta_data_page(meta, root, tags),
+				  &my_err))
 			break;
 
 		m->count = old_count;
@@ -365,165 +3608,229 @@ int dhara_map_write(struct dhara_map *m, dhara_sector_t dst,
 			return -1;
 	}
 
-	return 0;
-}
+	/* Everything we know about the old tree is wrong */
+	scache_clear(m);
+	m->index.valid = 0;
+	live_reset(m, 0);
 
-int dhara_map_copy_page(struct dhara_map *m, dhara_page_t src,
-			dhara_sector_t dst, dhara_error_t *err)
-{
-	for (;;) {
-		uint8_t meta[DHARA_META_SIZE];
+	/* Bring the snapshot records up to date */
+	for (i = 0; i < DHARA_MAP_SNAPSHOTS; i++) {
 		dhara_error_t my_err;
-		const dhara_sector_t old_count = m->count;
+		dhara_page_t p;
 
-		if (prepare_write(m, dst, meta, err) < 0)
+		if (!find_from(m, old_root, snap_sector(i), &p, &my_err)) {
+			if (snap_put(m, i, p, err) < 0)
+				return -1;
+		} else if (my_err != DHARA_E_NOT_FOUND) {
+			dhara_set_error(err, my_err);
 			return -1;
-
-		if (!dhara_journal_copy(&m->journal, src, meta, &my_err))
-			break;
-
-		m->count = old_count;
-
-		if (try_recover(m, my_err, err) < 0)
+		} else if (snap_delete(m, i, err) < 0) {
 			return -1;
+		}
 	}
 
-	return 0;
+	snap_trimmed(m);
+
+	if (m->index.type != DHARA_MAP_INDEX_NONE)
+		dhara_map_build_index(m, NULL);
+
+	return dhara_map_sync(m, err);
 }
 
-int dhara_map_copy_sector(struct dhara_map *m, dhara_sector_t src,
-			  dhara_sector_t dst, dhara_error_t *err)
+int dhara_map_snapshot_find(struct dhara_map *m, unsigned int id,
+			    dhara_sector_t s, dhara_page_t *loc,
+			    dhara_error_t *err)
 {
-	dhara_error_t my_err;
+	dhara_page_t root;
 	dhara_page_t p;
 
-	if (dhara_map_find(m, src, &p, &my_err) < 0) {
-		if (my_err == DHARA_E_NOT_FOUND)
-			return dhara_map_trim(m, dst, err);
-
-		dhara_set_error(err, my_err);
+	if ((snap_root(m, id, &root, err) < 0) ||
+	    (find_from(m, root, s, &p, err) < 0))
 		return -1;
-	}
 
-	return dhara_map_copy_page(m, p, dst, err);
+	*loc = sector_start(p, m->log2_pps);
+	return 0;
 }
 
-static int try_delete(struct dhara_map *m, dhara_sector_t s,
-		      dhara_error_t *err)
+int dhara_map_snapshot_read(struct dhara_map *m, unsigned int id,
+			    dhara_sector_t s, uint8_t *data,
+			    dhara_error_t *err)
 {
 	dhara_error_t my_err;
-	uint8_t meta[DHARA_META_SIZE];
-	dhara_page_t alt_page;
-	uint8_t alt_meta[DHARA_META_SIZE];
-	int level = DHARA_RADIX_DEPTH - 1;
-	int i;
-
-	if (trace_path(m, s, NULL, meta, &my_err) < 0) {
-		if (my_err == DHARA_E_NOT_FOUND)
-			return 0;
+	dhara_page_t root;
+	dhara_page_t p;
 
-		dhara_set_error(err, my_err);
+	if (snap_root(m, id, &root, err) < 0)
 		return -1;
-	}
 
-	/* Select any of the closest cousins of this node which are
-	 * subtrees of at least the requested order.
-	 */
-	while (level >= 0) {
-		alt_page = meta_get_alt(meta, level);
-		if (alt_page != DHARA_PAGE_NONE)
-			break;
-		level--;
-	}
+	if (find_from(m, root, s, &p, &my_err) < 0) {
+		if (my_err != DHARA_E_NOT_FOUND) {
+			dhara_set_error(err, my_err);
+			return -1;
+		}
 
-	/* Special case: deletion of last sector */
-	if (level < 0) {
-		m->count = 0;
-		dhara_journal_clear(&m->journal);
-		return 0;
+		p = DHARA_PAGE_NONE;
 	}
 
-	/* Rewrite the cousin with an up-to-date path which doesn't
-	 * point to the original node.
-	 */
-	if (dhara_journal_read_meta(&m->journal, alt_page, alt_meta, err) < 0)
-		return -1;
+	return read_sector(m->journal.nand, sector_start(p, m->log2_pps),
+			   m->log2_pps, data, err);
+}
 
-	meta_set_id(meta, meta_get_id(alt_meta));
+int dhara_map_snapshot_root(struct dhara_map *m, unsigned int id,
+			    dhara_page_t *root, dhara_error_t *err)
+{
+	return snap_root(m, id, root, err);
+}
+
+/************************************************************************
+ * Differences between trees
+ *
+ * Each side of the comparison is a subtree: a page p at depth d holds
+ * every sector which shares its first d digits with p's own sector. It
+ * splits at digit d: p itself (at depth d + 1) covers the part
+ * containing p's sector, and p's alt-pointers at level d cover the
+ * others.
+ *
+ * We split both sides in step. Since the trees are functional, a pair
+ * of subtrees rooted at the same page are identical, and can be skipped
+ * without looking inside them.
+ */
 
-	meta_set_alt(meta, level, DHARA_PAGE_NONE);
-	for (i = level + 1; i < DHARA_RADIX_DEPTH; i++)
-		meta_set_alt(meta, i, meta_get_alt(alt_meta, i));
+static int diff_load(struct dhara_map *m, struct dhara_map_diff *d,
+		     int side, dhara_error_t *err)
+{
+	const dhara_page_t p = d->page[side];
 
-	meta_set_alt(meta, level, DHARA_PAGE_NONE);
+	if ((p == DHARA_PAGE_NONE) || (p == d->loaded[side]))
+		return 0;
 
-	ck_set_count(dhara_journal_cookie(&m->journal), m->count - 1);
-	if (dhara_journal_copy(&m->journal, alt_page, meta, err) < 0)
+	d->reads++;
+	if (dhara_journal_read_meta(&m->journal, p, d->meta[side], err) < 0)
 		return -1;
 
-	m->count--;
+	d->loaded[side] = p;
 	return 0;
 }
 
-int dhara_map_trim(struct dhara_map *m, dhara_sector_t s, dhara_error_t *err)
+int dhara_map_diff_begin(struct dhara_map *m, struct dhara_map_diff *d,
+			 dhara_page_t old_root, dhara_page_t new_root,
+			 dhara_error_t *err)
 {
-	for (;;) {
-		dhara_error_t my_err;
+	int i;
 
-		if (auto_gc(m, err) < 0)
-			return -1;
+	d->page[0] = old_root;
+	d->page[1] = new_root;
+	d->base = 0;
+	d->depth = 0;
+	d->sp = 0;
+	d->reads = 0;
 
-		if (!try_delete(m, s, &my_err))
-			break;
+	for (i = 0; i < 2; i++) {
+		d->loaded[i] = DHARA_PAGE_NONE;
 
-		if (try_recover(m, my_err, err) < 0)
+		if (diff_load(m, d, i, err) < 0)
 			return -1;
+
+		/* The root of an empty map may be a filler page */
+		if ((d->page[i] != DHARA_PAGE_NONE) &&
+		    (meta_get_id(d->meta[i]) == DHARA_SECTOR_NONE))
+			d->page[i] = DHARA_PAGE_NONE;
 	}
 
 	return 0;
 }
 
-int dhara_map_sync(struct dhara_map *m, dhara_error_t *err)
+int dhara_map_diff_next(struct dhara_map *m, struct dhara_map_diff *d,
+			dhara_sector_t *sector, dhara_page_t *old_loc,
+			dhara_page_t *new_loc, dhara_error_t *err)
 {
-	while (!dhara_journal_is_clean(&m->journal)) {
-		dhara_page_t p = dhara_journal_peek(&m->journal);
-		dhara_error_t my_err;
-		int ret;
+	const dhara_page_t tags = tag_mask(m->journal.nand);
 
-		if (p == DHARA_PAGE_NONE) {
-			ret = pad_queue(m, &my_err);
-		} else {
-			ret = raw_gc(m, p, &my_err);
-			dhara_journal_dequeue(&m->journal);
+	for (;;) {
+		dhara_page_t part[2][DHARA_RADIX_FANOUT];
+		dhara_page_t loc[2];
+		int lo;
+		int i;
+
+		if (d->page[0] == d->page[1]) {
+			if (!d->sp)
+				return 0;
+
+			d->sp--;
+			d->page[0] = d->stack_page[d->sp][0];
+			d->page[1] = d->stack_page[d->sp][1];
+			d->base = d->stack_base[d->sp];
+			d->depth = d->stack_depth[d->sp];
 		}
 
-		if ((ret < 0) && (try_recover(m, my_err, err) < 0))
-			return -1;
-	}
+		for (i = 0; i < 2; i++)
+			if (diff_load(m, d, i, err) < 0)
+				return -1;
 
-	return 0;
-}
+		if (d->depth >= DHARA_RADIX_DEPTH) {
+			for (i = 0; i < 2; i++)
+				loc[i] = (d->page[i] == DHARA_PAGE_NONE) ?
+					DHARA_PAGE_NONE :
+					meta_sector_page(d->meta[i],
+							 d->page[i], d->base,
+							 m->log2_pps, tags);
+
+			d->page[0] = d->page[1] = DHARA_PAGE_NONE;
+
+			/* A new node may still refer to the same data, and
+			 * snapshot records aren't user data.
+			 */
+			if ((loc[0] == loc[1]) ||
+			    (d->base >= DHARA_MAP_SNAPSHOT_BASE))
+				continue;
+
+			*sector = d->base;
+			if (old_loc)
+				*old_loc = sector_start(loc[0], m->log2_pps);
+			if (new_loc)
+				*new_loc = sector_start(loc[1], m->log2_pps);
+			return 1;
+		}
 
-int dhara_map_gc(struct dhara_map *m, dhara_error_t *err)
-{
-	if (!m->count)
-		return 0;
+		for (i = 0; i < 2; i++) {
+			const dhara_page_t p = d->page[i];
+			int k;
 
-	for (;;) {
-		dhara_page_t tail = dhara_journal_peek(&m->journal);
-		dhara_error_t my_err;
+			for (k = 0; k < DHARA_RADIX_FANOUT; k++)
+				part[i][k] = (p == DHARA_PAGE_NONE) ?
+					DHARA_PAGE_NONE :
+					meta_child(d->meta[i], p, d->depth,
+						   k, tags);
+		}
 
-		if (tail == DHARA_PAGE_NONE)
-			break;
+		/* Visit the least part which differs first, and stack the
+		 * others which also need visiting.
+		 */
+		for (lo = 0; lo < DHARA_RADIX_FANOUT; lo++)
+			if (part[0][lo] != part[1][lo])
+				break;
 
-		if (!raw_gc(m, tail, &my_err)) {
-			dhara_journal_dequeue(&m->journal);
-			break;
+		if (lo >= DHARA_RADIX_FANOUT) {
+			d->page[0] = d->page[1] = DHARA_PAGE_NONE;
+			continue;
 		}
 
-		if (try_recover(m, my_err, err) < 0)
-			return -1;
-	}
+		d->depth++;
 
-	return 0;
+		for (i = DHARA_RADIX_FANOUT - 1; i > lo; i--) {
+			if (part[0][i] == part[1][i])
+				continue;
+
+			d->stack_page[d->sp][0] = part[0][i];
+			d->stack_page[d->sp][1] = part[1][i];
+			d->stack_base[d->sp] =
+				set_digit(d->base, d->depth - 1, i);
+			d->stack_depth[d->sp] = d->depth;
+			d->sp++;
+		}
+
+		d->base = set_digit(d->base, d->depth - 1, lo);
+		d->page[0] = part[0][lo];
+		d->page[1] = part[1][lo];
+	}
 }
@@ -27,11 +27,157 @@ typedef uint32_t dhara_sector_t;
 /* This sector value is reserved */
 #define DHARA_SECTOR_NONE	0xffffffff
 
+/* Highest valid sector number. Sector numbers are DHARA_SECTOR_BITS
+ * wide (see journal.h). Lookups of sectors beyond this fail with
+ * E_NOT_FOUND, and attempts to write them with E_SECTOR_RANGE. The
+ * same goes for writes and trims of the sectors reserved for snapshots
+ * (see DHARA_MAP_SNAPSHOT_BASE).
+ */
+#define DHARA_SECTOR_MAX	\
+	((dhara_sector_t)(0xffffffff >> (32 - DHARA_SECTOR_BITS)))
+
+/* Depth of the radix tree: one level for each digit of a sector number,
+ * where each digit is DHARA_RADIX_BITS wide.
+ */
+#define DHARA_RADIX_DEPTH	(DHARA_SECTOR_BITS / DHARA_RADIX_BITS)
+#define DHARA_RADIX_FANOUT	(1 << DHARA_RADIX_BITS)
+
+/* Cached result of a sector lookup. A page of DHARA_PAGE_NONE records
+ * that the sector is known to be unmapped. Unused slots have a sector
+ * of DHARA_SECTOR_NONE.
+ */
+struct dhara_map_cache_slot {
+	dhara_sector_t		sector;
+	dhara_page_t		page;
+};
+
+/* A run of consecutive sectors, stored in consecutive user pages of the
+ * journal (checkpoint pages are skipped over).
+ */
+struct dhara_map_extent {
+	dhara_sector_t		sector;
+	dhara_page_t		page;
+	dhara_sector_t		length;
+};
+
+/* Index types */
+#define DHARA_MAP_INDEX_NONE	0
+#define DHARA_MAP_INDEX_FLAT	1
+#define DHARA_MAP_INDEX_EXTENT	2
+
+/* Optional in-RAM logical-to-physical index. A flat index is a table of
+ * pages, indexed by sector, and covers only sectors below its size. An
+ * extent index is a sorted table of runs, and covers all sectors, but
+ * gives up (becomes invalid) if the map fragments into more runs than
+ * it can hold.
+ */
+struct dhara_map_index {
+	uint8_t			type;
+	uint8_t			valid;
+
+	dhara_page_t		*flat;
+	struct dhara_map_extent	*extents;
+
+	/* Table capacity and usage, in entries */
+	dhara_sector_t		size;
+	dhara_sector_t		used;
+
+	/* Statistics for the most recent build: the number of metadata
+	 * reads required, and the number of sectors found.
+	 */
+	uint32_t		build_reads;
+	dhara_sector_t		build_sectors;
+};
+
+/* Optional page liveness bitmap. This has one bit for each raw page,
+ * which is set if the page holds the current node or data of a sector.
+ * After the map is resumed, it's rebuilt one sector at a time, in
+ * sector order, as garbage collection proceeds. Once it's complete,
+ * garbage collection skips dead pages without reading them.
+ */
+struct dhara_map_live {
+	uint8_t			*bits;
+	uint8_t			valid;
+
+	/* Next sector to visit while rebuilding */
+	dhara_sector_t		next;
+
+	/* Number of pages collected without being read */
+	uint32_t		skipped;
+};
+
 struct dhara_map {
 	struct dhara_journal	journal;
 
 	uint8_t			gc_ratio;
 	dhara_sector_t		count;
+
+	/* Number of snapshot records. These are included in count, but
+	 * aren't part of the map's size.
+	 */
+	dhara_sector_t		snapshots;
+
+	/* Optional GC pacing. If the window is non-zero, collection
+	 * starts this many pages before the threshold, and the credit
+	 * accumulates fractional steps owed.
+	 */
+	dhara_sector_t		gc_window;
+	dhara_sector_t		gc_credit;
+
+	/* Group commit. Sync requests are numbered, and every request up
+	 * to sync_durable has been satisfied. The padding which the
+	 * outstanding requests would have cost, had each been synced
+	 * immediately, is accumulated in sync_owed.
+	 */
+	uint32_t		sync_ticket;
+	uint32_t		sync_durable;
+	uint32_t		sync_owed;
+	uint32_t		sync_mark;
+
+	/* If set, syncs write an early checkpoint rather than filling
+	 * the rest of the checkpoint group (see dhara_journal_flush()).
+	 */
+	uint8_t			fast_sync;
+
+	/* If set, nodes may be written as tombstones (see
+	 * dhara_map_set_tombstones()).
+	 */
+	uint8_t			tombstones;
+
+	/* Largest run record to write, as log2 of the number of sectors,
+	 * or 0 if runs are disabled (see dhara_map_set_runs()).
+	 */
+	uint8_t			run_order;
+
+	/* Pages per logical sector, as log2 (see
+	 * dhara_map_set_sector_size()).
+	 */
+	uint8_t			log2_pps;
+
+	/* Sync statistics: requests made, pages written to complete
+	 * checkpoints, and an estimate of the padding avoided by
+	 * combining requests.
+	 */
+	uint32_t		sync_requests;
+	uint32_t		sync_padded;
+	uint32_t		sync_saved;
+
+	/* Optional sector lookup cache. This is a direct-mapped table,
+	 * indexed by sector number, which is kept coherent as sectors
+	 * are written, trimmed and relocated.
+	 */
+	struct dhara_map_cache_slot	*scache;
+	unsigned int		scache_size;
+
+	/* Lookup statistics for dhara_map_find() */
+	uint32_t		scache_hits;
+	uint32_t		scache_misses;
+
+	/* Optional logical-to-physical index */
+	struct dhara_map_index	index;
+
+	/* Optional page liveness bitmap */
+	struct dhara_map_live	live;
 };
 
 /* Initialize a map. You need to supply a buffer for page metadata, and
@@ -45,6 +191,149 @@ struct dhara_map {
 void dhara_map_init(struct dhara_map *m, const struct dhara_nand *n,
 		    uint8_t *page_buf, uint8_t gc_ratio);
 
+/* Supply an array of sector lookup cache slots. This is optional, and
+ * may be done at any time (the cache and its statistics are reset).
+ * Pass NULL or a zero count to disable caching.
+ *
+ * Sectors found in the cache are located without any NAND reads.
+ */
+void dhara_map_set_cache(struct dhara_map *m,
+			 struct dhara_map_cache_slot *slots,
+			 unsigned int count);
+
+/* Supply a table for a full logical-to-physical index. This is
+ * optional, and replaces any previously supplied index. The index is
+ * built by dhara_map_resume() (or dhara_map_build_index()), after which
+ * lookups of indexed sectors require no NAND reads, and garbage
+ * collection can skip obsolete pages without tracing their paths.
+ *
+ * A flat table requires one entry for every sector which is to be
+ * indexed. An extent table needs only one entry for each run of
+ * sequentially written sectors.
+ */
+void dhara_map_set_flat_index(struct dhara_map *m,
+			      dhara_page_t *table, dhara_sector_t size);
+void dhara_map_set_extent_index(struct dhara_map *m,
+				struct dhara_map_extent *table,
+				dhara_sector_t size);
+
+/* Build the index by walking the whole map. This is done automatically
+ * by dhara_map_resume(), and is O(n) in the number of sectors mapped.
+ * Statistics for the build are recorded in m->index.
+ */
+int dhara_map_build_index(struct dhara_map *m, dhara_error_t *err);
+
+/* Obtain the number of bytes of the index table currently in use */
+size_t dhara_map_index_bytes(const struct dhara_map *m);
+
+/* Obtain the size, in bytes, of a liveness bitmap for the given chip */
+size_t dhara_map_live_bytes(const struct dhara_nand *n);
+
+/* Supply a liveness bitmap of dhara_map_live_bytes() bytes, or NULL to
+ * stop using one. The bitmap is rebuilt gradually during garbage
+ * collection, and until this is complete, pages are checked by tracing
+ * their paths as usual.
+ */
+void dhara_map_set_live_map(struct dhara_map *m, uint8_t *bits);
+
+/* Finish rebuilding the liveness bitmap now, rather than waiting for
+ * garbage collection to do it. This is O(n log n) in the number of
+ * sectors mapped.
+ */
+int dhara_map_build_live(struct dhara_map *m, dhara_error_t *err);
+
+/* Collect garbage gradually, rather than in bursts. Normally, no
+ * collection is done until the journal reaches its threshold, after
+ * which every write performs gc_ratio steps. With pacing, collection
+ * starts when the journal comes within the given number of pages of
+ * the threshold, and the steps per write ramp up in proportion to how
+ * far into the window the journal has grown. A window of 0 (the
+ * default) disables pacing.
+ */
+void dhara_map_set_gc_pacing(struct dhara_map *m, dhara_sector_t window);
+
+/* Allow the map to write tombstones. A tombstone is a metadata-only
+ * node which refers to a page already holding the sector's data,
+ * rather than a copy of it. A trim then costs no data page program, and
+ * neither does rewriting a node whose data hasn't moved (when padding
+ * the root, or collecting a tombstone).
+ *
+ * Tombstones are off by default. Once they're enabled, checkpoints in
+ * the fixed format carry a marker in their header which earlier
+ * versions of this library don't recognise: they find no checkpoints,
+ * and see a blank chip rather than misreading the image. Tombstones
+ * already on the chip remain readable either way.
+ *
+ * Runs, sectors of more than one page and snapshots all depend on
+ * tombstones. Tombstones require that page numbers fit in 31 bits, and
+ * are never written on larger chips.
+ */
+static inline void dhara_map_set_tombstones(struct dhara_map *m,
+					    int enable)
+{
+	m->tombstones = !!enable;
+
+	if (enable)
+		dhara_journal_mark_extended(&m->journal);
+}
+
+/* Allow dhara_map_write_multi() to write run records. A run is an
+ * aligned block of 2**k consecutive sectors, written to consecutive
+ * pages in a single checkpoint group, and given one node in the tree
+ * rather than one per sector. This saves the metadata and the path
+ * tracing for all but the last sector of the run, and a lookup of any
+ * of them finds the whole run.
+ *
+ * Runs of up to 2**max_order sectors are written, where the checkpoint
+ * group has room for them. The order of a run is a multiple of
+ * DHARA_RADIX_BITS, and at least DHARA_MAP_RUN_MIN (which leaves a run
+ * record room to become a tombstone). Pass 0 to disable runs (the
+ * default). Runs already written remain readable either way, and a chip
+ * with runs on it can't be read by earlier versions.
+ *
+ * Runs require tombstones (see dhara_map_set_tombstones()), and that
+ * page numbers fit in 30 bits. Trimming part of a run first gives each
+ * of its sectors a node of its own.
+ */
+#if DHARA_RADIX_BITS == 1
+#define DHARA_MAP_RUN_MIN	2
+#else
+#define DHARA_MAP_RUN_MIN	DHARA_RADIX_BITS
+#endif
+
+void dhara_map_set_runs(struct dhara_map *m, unsigned int max_order);
+
+/* Make each logical sector 2**log2_pps pages long, rather than one. A
+ * sector is stored in consecutive pages of a single checkpoint group,
+ * with one record for the whole sector, so the map needs a node, a
+ * lookup and a metadata slot per sector rather than per page. Where
+ * the current group is too short to hold a sector, the rest of it is
+ * padded first.
+ *
+ * This must be called before dhara_map_resume(), and after choosing
+ * the metadata format, and after enabling tombstones. If log2_pps is
+ * more than 15, if a sector won't fit in a checkpoint group, or if
+ * tombstones can't be written (see dhara_map_set_tombstones()), this
+ * fails with E_BAD_FORMAT and the size is unchanged.
+ *
+ * The sector size is recorded on the chip. Resuming with a different
+ * one fails with E_BAD_FORMAT, leaving the map empty. Nothing is erased
+ * until the map is next written.
+ *
+ * Every data buffer passed to or returned by the map then holds
+ * dhara_map_sector_size() bytes, and the location of a sector (as
+ * returned by dhara_map_find() and friends, or passed to
+ * dhara_map_copy_page()) is its first page.
+ */
+int dhara_map_set_sector_size(struct dhara_map *m, unsigned int log2_pps,
+			      dhara_error_t *err);
+
+/* Size of a logical sector, in bytes */
+static inline size_t dhara_map_sector_size(const struct dhara_map *m)
+{
+	return ((size_t)1) << (m->journal.nand->log2_page_size + m->log2_pps);
+}
+
 /* Recover stored state, if possible. If there is no valid stored state
  * on the chip, -1 is returned, and an empty map is initialized.
  */
@@ -53,13 +342,21 @@ int dhara_map_resume(struct dhara_map *m, dhara_error_t *err);
 /* Clear the map (delete all sectors). */
 void dhara_map_clear(struct dhara_map *m);
 
-/* Obtain the maximum capacity of the map. */
+/* The number of sectors in the map is recorded in 28 bits, alongside
+ * the sector size. This limits the capacity of very large chips.
+ */
+#define DHARA_MAP_COUNT_MAX	((dhara_sector_t)0x0fffffff)
+
+/* Obtain the maximum capacity of the map. This is never more than
+ * DHARA_MAP_COUNT_MAX. Once the map is full, writes to new sectors fail
+ * with E_MAP_FULL.
+ */
 dhara_sector_t dhara_map_capacity(const struct dhara_map *m);
 
 /* Obtain the current number of allocated sectors. */
 static inline dhara_sector_t dhara_map_size(const struct dhara_map *m)
 {
-	return m->count;
+	return m->count - m->snapshots;
 }
 
 /* Find the physical page which holds the current data for this sector.
@@ -75,10 +372,113 @@ int dhara_map_find(struct dhara_map *m, dhara_sector_t s,
 int dhara_map_read(struct dhara_map *m, dhara_sector_t s,
 		   uint8_t *data, dhara_error_t *err);
 
+/* One element of a vectored read. The caller fills in the sector and
+ * data buffer, and the page the data was read from is returned (or
+ * DHARA_PAGE_NONE, if the sector is unmapped).
+ */
+struct dhara_map_read_req {
+	dhara_sector_t		sector;
+	uint8_t			*data;
+	dhara_page_t		page;
+};
+
+/* Read a batch of logical sectors. The sectors are located together,
+ * in ascending order, so that the parts of their paths which they have
+ * in common are traced only once. The pages are then read in physical
+ * order.
+ *
+ * The request array is sorted in place, so its order is not preserved.
+ */
+int dhara_map_read_multi(struct dhara_map *m,
+			 struct dhara_map_read_req *reqs, size_t count,
+			 dhara_error_t *err);
+
+/* Enumerate all mapped sectors, in ascending order, along with the
+ * pages holding their data. This is an in-order traversal of the radix
+ * tree, costing typically one or two metadata reads per sector, and it
+ * needs no more than the fixed-size state below, however large the map
+ * is.
+ *
+ * The map mustn't be modified while an enumeration is in progress.
+ */
+struct dhara_map_iter {
+	dhara_page_t		page;
+
+	/* Node page of the last sector returned (DHARA_PAGE_NONE for a
+	 * member of a run)
+	 */
+	dhara_page_t		node;
+
+	/* Leading digits of the current subtree's sectors */
+	dhara_sector_t		base;
+	int			depth;
+	int			sp;
+
+	/* Subtrees still to be visited */
+	dhara_page_t		stack_page[DHARA_MAP_ALTS];
+	dhara_sector_t		stack_base[DHARA_MAP_ALTS];
+	uint8_t			stack_depth[DHARA_MAP_ALTS];
+
+	/* Metadata for the last page loaded */
+	dhara_page_t		loaded;
+	uint8_t			meta[DHARA_META_SIZE];
+	uint32_t		reads;
+};
+
+int dhara_map_iter_begin(struct dhara_map *m, struct dhara_map_iter *it,
+			 dhara_error_t *err);
+
+/* Fetch the next sector. Returns 1 if a sector was found, 0 if there
+ * are no more, or -1 on error. The data page is returned via loc, if
+ * it's not NULL. Snapshot records aren't included.
+ */
+int dhara_map_iter_next(struct dhara_map *m, struct dhara_map_iter *it,
+			dhara_sector_t *sector, dhara_page_t *loc,
+			dhara_error_t *err);
+
+/* Lookups against a captured view of the map (see journal.h). These
+ * read only from the view and the NAND chip, so they may run in other
+ * threads while the map is modified, subject to the conditions
+ * described for journal views. They see the map as it was when the
+ * view was captured. Capturing the view itself is an ordinary
+ * operation on the map.
+ */
+int dhara_map_view_capture(struct dhara_map *m,
+			   struct dhara_journal_view *v,
+			   uint8_t *page_buf, dhara_error_t *err);
+
+int dhara_map_view_find(const struct dhara_journal_view *v,
+			dhara_sector_t s, dhara_page_t *loc,
+			dhara_error_t *err);
+
+int dhara_map_view_read(const struct dhara_journal_view *v,
+			dhara_sector_t s, uint8_t *data,
+			dhara_error_t *err);
+
 /* Write data to a logical sector. */
 int dhara_map_write(struct dhara_map *m, dhara_sector_t s,
 		    const uint8_t *data, dhara_error_t *err);
 
+/* Write data to a run of consecutive logical sectors. The data buffer
+ * holds count sectors, one after another. This is equivalent to a
+ * sequence of calls to dhara_map_write(), but avoids some of the
+ * per-call overhead, and aligned blocks of sectors may be written as
+ * run records (see dhara_map_set_runs()). If an error occurs, the
+ * sectors preceding the failed one (or its run) will have been
+ * written.
+ */
+int dhara_map_write_multi(struct dhara_map *m, dhara_sector_t first,
+			  dhara_sector_t count, const uint8_t *data,
+			  dhara_error_t *err);
+
+/* As above, but for an arbitrary list of sectors, each with its own
+ * data buffer.
+ */
+int dhara_map_write_scatter(struct dhara_map *m,
+			    const dhara_sector_t *sectors,
+			    const uint8_t *const *data, size_t count,
+			    dhara_error_t *err);
+
 /* Copy any flash page to a logical sector. */
 int dhara_map_copy_page(struct dhara_map *m, dhara_page_t src,
 			dhara_sector_t dst, dhara_error_t *err);
@@ -92,23 +492,281 @@ int dhara_map_copy_sector(struct dhara_map *m, dhara_sector_t src,
 /* Delete a logical sector. You don't necessarily need to do this, but
  * it's a useful hint if you no longer require the sector's data to be
  * kept.
- *
- * If order is non-zero, it specifies that all sectors in the
- * (2**order)-aligned group of s are to be deleted.
  */
 int dhara_map_trim(struct dhara_map *m, dhara_sector_t s,
 		   dhara_error_t *err);
 
+/* Delete a group of logical sectors. The order specifies that all
+ * sectors in the (2**order)-aligned group of s are to be deleted, so
+ * an order of zero is equivalent to dhara_map_trim().
+ *
+ * The group is removed from the tree as a whole, which costs at most
+ * one page copy, no matter how many sectors it contains. The sectors
+ * are counted first, which requires a metadata read for each one.
+ * While a snapshot is held, a group which reaches the reserved sectors
+ * is deleted piecewise, up to the start of the reserved range.
+ */
+int dhara_map_trim_group(struct dhara_map *m, dhara_sector_t s,
+			 unsigned int order, dhara_error_t *err);
+
 /* Synchronize the map. Once this returns successfully, all changes to
  * date are persistent and durable. Conversely, there is no guarantee
  * that unsynchronized changes will be persistent.
  */
 int dhara_map_sync(struct dhara_map *m, dhara_error_t *err);
 
+/* Enable or disable fast sync. Normally, a sync fills the rest of the
+ * current checkpoint group, which can take up to 2**log2_ppc - 2 page
+ * copies on chips with large pages. With fast sync, the checkpoint is
+ * written early and the rest of the group is skipped, so a sync costs
+ * one page program however full the group was. The skipped pages are
+ * wasted until garbage collection reaches them.
+ *
+ * Fast sync is off by default because it trades space for latency. The
+ * map skips pages in other cases too (see nand.h), so it asks nothing
+ * more of the NAND layer. Checkpoints in the fixed format carry a
+ * marker in their header which older versions of this library don't
+ * recognise: they find no checkpoints, and see a blank chip rather than
+ * misreading the image.
+ */
+static inline void dhara_map_set_fast_sync(struct dhara_map *m, int enable)
+{
+	m->fast_sync = !!enable;
+}
+
+/* Group commit. Each sync pads the current checkpoint group out to its
+ * end, and if several clients each sync after small writes, they pay
+ * for that padding over and over. Instead, a client can request a sync
+ * and wait for somebody to call dhara_map_sync(), which completes all
+ * requests made so far with a single checkpoint.
+ *
+ * A request returns a ticket, which is satisfied by the next
+ * dhara_map_sync(), once the changes made before it are durable.
+ * Checkpoints written in the course of ordinary writes don't count,
+ * although any ticket is reported as satisfied while the journal has no
+ * unsynchronized changes. The map isn't thread-safe, so deciding how
+ * long to wait for other requests is left to the caller (see
+ * examples/gcommit.c for an example).
+ */
+uint32_t dhara_map_sync_request(struct dhara_map *m);
+
+static inline int dhara_map_sync_done(const struct dhara_map *m,
+				      uint32_t ticket)
+{
+	return dhara_journal_is_clean(&m->journal) ||
+		((int32_t)(m->sync_durable - ticket) >= 0);
+}
+
 /* Perform one garbage collection step. You can do this whenever you
  * like, but it's not necessary -- garbage collection happens
  * automatically and is interleaved with other operations.
  */
 int dhara_map_gc(struct dhara_map *m, dhara_error_t *err);
 
+/* Obtain the garbage collection debt. This is the number of pages which
+ * would need to be freed before the next write can proceed without
+ * automatic collection, with the given number of pages to spare.
+ *
+ * Freed pages are counted immediately, but their space isn't actually
+ * reclaimed until the next checkpoint, so a little headroom is
+ * advisable.
+ */
+dhara_sector_t dhara_map_gc_debt(const struct dhara_map *m,
+				 dhara_sector_t headroom);
+
+/* Perform garbage collection steps until there's no debt (relative to
+ * the given headroom), or until the budget runs out. Each step which
+ * examines a page costs one unit of the budget. Pages which the liveness
+ * bitmap shows to be dead are collected for free.
+ *
+ * This is intended to be called from an idle loop, or a background
+ * thread, with a budget small enough to keep each call short. The
+ * remaining debt is returned via debt, if it's not NULL.
+ */
+int dhara_map_gc_budget(struct dhara_map *m, unsigned int budget,
+			dhara_sector_t headroom, dhara_sector_t *debt,
+			dhara_error_t *err);
+
+/* Erase the next block the journal will write to, if it isn't already
+ * erased. Block erases are by far the slowest NAND operation, and doing
+ * this from an idle loop takes them off the write path. This costs at
+ * most one erase per call, and nothing if there's no work to do.
+ */
+int dhara_map_pre_erase(struct dhara_map *m, dhara_error_t *err);
+
+/* Resumable operations. Instead of blocking until a write, trim, sync
+ * or garbage collection step is complete, you can start one with one of the
+ * dhara_map_begin_*() functions and then call dhara_map_step() until it
+ * finishes. Each step performs a bounded amount of work: a single page
+ * of garbage collection or recovery, or the write itself. In between
+ * steps, you may do other work, but you must not use the map for
+ * anything else until the operation is finished.
+ *
+ * The sequence of NAND operations, and so the end result, is exactly
+ * the same as with the corresponding blocking call.
+ */
+#define DHARA_MAP_OP_WRITE	0
+#define DHARA_MAP_OP_TRIM	1
+#define DHARA_MAP_OP_SYNC	2
+#define DHARA_MAP_OP_GC		3
+
+struct dhara_map_op {
+	uint8_t			type;
+	uint8_t			phase;
+	uint8_t			resume;
+	uint8_t			restarts;
+
+	dhara_sector_t		sector;
+	unsigned int		order;
+	const uint8_t		*data;
+
+	/* Capacity at the start of the attempt, and the number of
+	 * garbage collection steps still owed before it.
+	 */
+	dhara_sector_t		capacity;
+	unsigned int		gc_left;
+};
+
+/* Prepare an operation. The data buffer given for a write must remain
+ * valid until the operation is finished.
+ */
+void dhara_map_begin_write(struct dhara_map_op *op, dhara_sector_t s,
+			   const uint8_t *data);
+void dhara_map_begin_trim(struct dhara_map_op *op, dhara_sector_t s,
+			  unsigned int order);
+void dhara_map_begin_sync(struct dhara_map_op *op);
+void dhara_map_begin_gc(struct dhara_map_op *op);
+
+/* Perform the next step of an operation. Returns 1 if the operation is
+ * still in progress, 0 if it's finished, or -1 if it has failed. Once
+ * an operation has finished or failed, further steps do nothing and
+ * return 0.
+ */
+int dhara_map_step(struct dhara_map *m, struct dhara_map_op *op,
+		   dhara_error_t *err);
+
+/* Snapshots. A snapshot records the state of the entire map. The
+ * radix tree is never modified in place, so any old root still
+ * describes a complete image, provided that the pages it refers to
+ * survive.
+ *
+ * To make sure they do, the journal's tail is held for as long as any
+ * snapshot exists (see dhara_journal_hold_tail()). This stops all
+ * garbage collection, not just that of pages the snapshot refers to:
+ * every write, trim and sync consumes fresh pages, and nothing is
+ * reclaimed until the last snapshot is released. The volume fills up
+ * while a snapshot is held, however much of it is garbage, and
+ * ordinary modifications then fail with E_JOURNAL_FULL. A reserve of a
+ * few blocks is kept back so that snapshots can still be released or
+ * rolled back to.
+ *
+ * Snapshots aren't free, either. Taking one, or rolling back to one,
+ * pads the journal to the end of the current block, so that no
+ * snapshot page is ever involved in recovery. Each can cost up to a
+ * block of space, and a rollback also reads the whole of the
+ * snapshot's tree.
+ *
+ * Snapshots are therefore meant to be few and short-lived: taken
+ * before a backup or an update, and then released or rolled back to.
+ *
+ * Snapshots are persistent. Each is recorded as a metadata-only sector
+ * at the top of the sector space, in the range starting at
+ * DHARA_MAP_SNAPSHOT_BASE. These sectors take up capacity, but aren't
+ * counted in the map's size. They're out of range for the user: writes
+ * to them fail with E_SECTOR_RANGE, and a trim which covers them stops
+ * short of them while any snapshot is held. Records are tombstones, so
+ * snapshots require them (see dhara_map_set_tombstones()). Without
+ * them, dhara_map_snapshot() fails with E_BAD_FORMAT.
+ */
+#define DHARA_MAP_SNAPSHOTS		4
+#define DHARA_MAP_SNAPSHOT_BASE		(DHARA_SECTOR_MAX - 15)
+
+/* Take a snapshot, replacing any existing snapshot with the same ID.
+ * The snapshot is durable once this returns.
+ */
+int dhara_map_snapshot(struct dhara_map *m, unsigned int id,
+		       dhara_error_t *err);
+
+/* Release a snapshot. If it was the last, space can be reclaimed
+ * again. Releasing a snapshot which doesn't exist isn't an error.
+ */
+int dhara_map_snapshot_release(struct dhara_map *m, unsigned int id,
+			       dhara_error_t *err);
+
+/* Return the map to the state recorded by a snapshot. The snapshot is
+ * kept, as are any others. This costs a traversal of the snapshot's
+ * tree, and is durable once it returns.
+ */
+int dhara_map_snapshot_rollback(struct dhara_map *m, unsigned int id,
+				dhara_error_t *err);
+
+/* Look up or read a sector as it was when the snapshot was taken. If
+ * the snapshot doesn't exist, or the sector didn't, the error is
+ * E_NOT_FOUND. Reading an unmapped sector gives a blank page.
+ */
+int dhara_map_snapshot_find(struct dhara_map *m, unsigned int id,
+			    dhara_sector_t s, dhara_page_t *loc,
+			    dhara_error_t *err);
+
+int dhara_map_snapshot_read(struct dhara_map *m, unsigned int id,
+			    dhara_sector_t s, uint8_t *data,
+			    dhara_error_t *err);
+
+/* Obtain the root page of a snapshot, for use with the differencing
+ * functions below. The current root is given by dhara_journal_root().
+ */
+int dhara_map_snapshot_root(struct dhara_map *m, unsigned int id,
+			    dhara_page_t *root, dhara_error_t *err);
+
+/* Differences between two versions of the map. Given two roots, such
+ * as a snapshot's and the current one, this finds the sectors which
+ * differ between them, in ascending order. Subtrees which the two
+ * versions share are skipped without being read, so the cost is
+ * proportional to the number of changes, rather than to the size of
+ * the map. This is intended for incremental backups.
+ *
+ * Both roots must remain valid while the differences are being found:
+ * they must be held by a snapshot or by a pin (see
+ * dhara_journal_pin()), and the map mustn't be modified in the
+ * meantime unless one of those protects the current root too.
+ */
+struct dhara_map_diff {
+	/* Pair of subtrees being compared, their depth, and the leading
+	 * digits of their sectors
+	 */
+	dhara_page_t		page[2];
+	int			depth;
+	dhara_sector_t		base;
+
+	/* Pairs still to be compared */
+	int			sp;
+	dhara_page_t		stack_page[DHARA_MAP_ALTS][2];
+	dhara_sector_t		stack_base[DHARA_MAP_ALTS];
+	uint8_t			stack_depth[DHARA_MAP_ALTS];
+
+	/* Metadata for the last page loaded on each side */
+	dhara_page_t		loaded[2];
+	uint8_t			meta[2][DHARA_META_SIZE];
+
+	/* Number of metadata reads so far */
+	uint32_t		reads;
+};
+
+/* Begin comparing two roots. Either may be DHARA_PAGE_NONE, which
+ * stands for an empty map.
+ */
+int dhara_map_diff_begin(struct dhara_map *m, struct dhara_map_diff *d,
+			 dhara_page_t old_root, dhara_page_t new_root,
+			 dhara_error_t *err);
+
+/* Find the next sector which differs. Returns 1 if one is found, 0 if
+ * there are no more, or -1 on error. The sector's data page in each
+ * version is returned, or DHARA_PAGE_NONE if it's unmapped in that
+ * version. A sector which is rewritten with the same data is reported
+ * as changed, as nothing but page numbers are compared.
+ */
+int dhara_map_diff_next(struct dhara_map *m, struct dhara_map_diff *d,
+			dhara_sector_t *sector, dhara_page_t *old_loc,
+			dhara_page_t *new_loc, dhara_error_t *err);
+
 #endif
@@ -75,8 +75,8 @@ int dhara_nand_erase(const struct dhara_nand *n, dhara_block_t b,
  * checked. If the operation fails, return -1 and set err to
  * E_BAD_BLOCK.
  *
- * Pages will be programmed sequentially within a block, and will not be
- * reprogrammed.
+ * Pages will be programmed in ascending order within a block, and will
+ * not be reprogrammed. Some pages may be skipped over and left erased.
  */
 int dhara_nand_prog(const struct dhara_nand *n, dhara_page_t p,
 		    const uint8_t *data,
@@ -0,0 +1,104 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <unistd.h>
+#include "gcommit.h"
+
+void gcommit_init(struct gcommit *g, struct rwmap *rw,
+		  unsigned int window)
+{
+	g->rw = rw;
+	g->window = window;
+
+	pthread_cond_init(&g->cond, NULL);
+	g->leader = 0;
+	g->round = 0;
+	g->err = DHARA_E_NONE;
+}
+
+void gcommit_destroy(struct gcommit *g)
+{
+	pthread_cond_destroy(&g->cond);
+}
+
+/* Sync on behalf of every client which has requested it so far. The
+ * write lock must be held.
+ */
+static int group_sync(struct gcommit *g, dhara_error_t *err)
+{
+	dhara_error_t my_err;
+	int ret;
+
+	ret = dhara_map_sync(g->rw->map, &my_err);
+
+	g->leader = 0;
+	g->round++;
+	g->err = ret < 0 ? my_err : DHARA_E_NONE;
+	pthread_cond_broadcast(&g->cond);
+
+	if (ret < 0)
+		dhara_set_error(err, my_err);
+
+	return ret;
+}
+
+int gcommit_sync(struct gcommit *g, dhara_error_t *err)
+{
+	struct rwmap *const rw = g->rw;
+	uint32_t ticket;
+	unsigned int round;
+	int ret = 0;
+
+	rwmap_begin_write(rw);
+	ticket = dhara_map_sync_request(rw->map);
+
+	if (dhara_map_sync_done(rw->map, ticket)) {
+		rwmap_end_write(rw);
+		return 0;
+	}
+
+	if (!g->window) {
+		ret = group_sync(g, err);
+		rwmap_end_write(rw);
+		return ret;
+	}
+
+	/* Lead this round, or wait for whoever is leading it */
+	if (!g->leader) {
+		g->leader = 1;
+		rwmap_end_write(rw);
+
+		usleep(g->window);
+
+		rwmap_begin_write(rw);
+		ret = group_sync(g, err);
+		rwmap_end_write(rw);
+		return ret;
+	}
+
+	round = g->round;
+	while (!dhara_map_sync_done(rw->map, ticket) &&
+	       (g->round == round))
+		pthread_cond_wait(&g->cond, &rw->write_lock);
+
+	if (!dhara_map_sync_done(rw->map, ticket)) {
+		dhara_set_error(err, g->err);
+		ret = -1;
+	}
+
+	rwmap_end_write(rw);
+	return ret;
+}
@@ -0,0 +1,59 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef EXAMPLES_GCOMMIT_H_
+#define EXAMPLES_GCOMMIT_H_
+
+#include "rwmap.h"
+
+/* Group commit for a map shared between threads (see rwmap.h). This is
+ * an example of how sync requests (see dhara_map_sync_request()) can be
+ * combined. It isn't part of the library.
+ *
+ * The first client to sync leads a round: it waits for the window (in
+ * microseconds) to let others join in, and then syncs on behalf of them
+ * all. The others wait for the leader's sync to finish, and share its
+ * outcome. With a window of zero, every client syncs for itself.
+ */
+struct gcommit {
+	struct rwmap			*rw;
+	unsigned int			window;
+
+	/* Signalled, with the write lock, at the end of each round */
+	pthread_cond_t			cond;
+
+	/* Protected by the write lock. Each round is numbered, and the
+	 * outcome of the last is recorded.
+	 */
+	int				leader;
+	unsigned int			round;
+	dhara_error_t			err;
+};
+
+/* Set up group commit for a wrapped map. This must be destroyed before
+ * the wrapper is.
+ */
+void gcommit_init(struct gcommit *g, struct rwmap *rw,
+		  unsigned int window);
+void gcommit_destroy(struct gcommit *g);
+
+/* Make everything written so far durable, returning once the changes
+ * made by this client before the call are. If a round's sync fails,
+ * every client waiting on it fails with the same error.
+ */
+int gcommit_sync(struct gcommit *g, dhara_error_t *err);
+
+#endif
@@ -0,0 +1,160 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include "rwmap.h"
+
+/* Pin the journal at the tail of the published view. A view of an
+ * empty map refers to no pages, and needs no pin.
+ */
+static void pin_view(struct rwmap *r)
+{
+	dhara_journal_pin(&r->map->journal,
+			  (r->view.root == DHARA_PAGE_NONE) ?
+			  DHARA_PAGE_NONE : r->view.tail);
+}
+
+/* Publish the state of the map after a modification. The view lock must
+ * be held. If there are no readers, nobody can be using an older view,
+ * so the pin moves up to the new one.
+ */
+static void publish(struct rwmap *r)
+{
+	uint8_t *const page_buf = r->view.page_buf;
+
+	/* This can't fail, since we never finish an operation in
+	 * recovery. If we do, the old view remains valid.
+	 */
+	if (dhara_map_view_capture(r->map, &r->view, page_buf, NULL) < 0)
+		return;
+
+	if (!r->readers)
+		pin_view(r);
+}
+
+void rwmap_init(struct rwmap *r, struct dhara_map *m, uint8_t *page_buf,
+		dhara_block_t margin)
+{
+	r->map = m;
+	r->margin = margin;
+
+	pthread_mutex_init(&r->write_lock, NULL);
+	pthread_mutex_init(&r->view_lock, NULL);
+	pthread_cond_init(&r->view_cond, NULL);
+
+	r->view.page_buf = page_buf;
+	r->readers = 0;
+	r->draining = 0;
+	r->drains = 0;
+
+	publish(r);
+}
+
+void rwmap_destroy(struct rwmap *r)
+{
+	dhara_journal_pin(&r->map->journal, DHARA_PAGE_NONE);
+
+	pthread_cond_destroy(&r->view_cond);
+	pthread_mutex_destroy(&r->view_lock);
+	pthread_mutex_destroy(&r->write_lock);
+}
+
+int rwmap_read(struct rwmap *r, dhara_sector_t s, uint8_t *data,
+	       uint8_t *page_buf, dhara_error_t *err)
+{
+	const size_t page_size = 1 << r->map->journal.nand->log2_page_size;
+	struct dhara_journal_view v;
+	int ret;
+
+	pthread_mutex_lock(&r->view_lock);
+	while (r->draining)
+		pthread_cond_wait(&r->view_cond, &r->view_lock);
+
+	v = r->view;
+	v.page_buf = page_buf;
+	memcpy(page_buf, r->view.page_buf, page_size);
+	r->readers++;
+	pthread_mutex_unlock(&r->view_lock);
+
+	ret = dhara_map_view_read(&v, s, data, err);
+
+	pthread_mutex_lock(&r->view_lock);
+	if (!--r->readers)
+		pthread_cond_broadcast(&r->view_cond);
+	pthread_mutex_unlock(&r->view_lock);
+
+	return ret;
+}
+
+/* Called by the writer before each modification. If the head is
+ * getting close to the pin, wait for readers to finish with their
+ * views. The published view is current, so the pin can then be moved up
+ * to it.
+ */
+static void make_room(struct rwmap *r)
+{
+	if (dhara_journal_pin_room(&r->map->journal) >= r->margin)
+		return;
+
+	pthread_mutex_lock(&r->view_lock);
+	r->draining = 1;
+	r->drains++;
+
+	while (r->readers)
+		pthread_cond_wait(&r->view_cond, &r->view_lock);
+
+	pin_view(r);
+	r->draining = 0;
+	pthread_cond_broadcast(&r->view_cond);
+	pthread_mutex_unlock(&r->view_lock);
+}
+
+void rwmap_begin_write(struct rwmap *r)
+{
+	pthread_mutex_lock(&r->write_lock);
+	make_room(r);
+}
+
+void rwmap_end_write(struct rwmap *r)
+{
+	pthread_mutex_lock(&r->view_lock);
+	publish(r);
+	pthread_mutex_unlock(&r->view_lock);
+	pthread_mutex_unlock(&r->write_lock);
+}
+
+int rwmap_write(struct rwmap *r, dhara_sector_t s, const uint8_t *data,
+		dhara_error_t *err)
+{
+	int ret;
+
+	rwmap_begin_write(r);
+	ret = dhara_map_write(r->map, s, data, err);
+	rwmap_end_write(r);
+
+	return ret;
+}
+
+int rwmap_sync(struct rwmap *r, dhara_error_t *err)
+{
+	int ret;
+
+	rwmap_begin_write(r);
+	ret = dhara_map_sync(r->map, err);
+	rwmap_end_write(r);
+
+	return ret;
+}
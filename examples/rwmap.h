@@ -0,0 +1,99 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef EXAMPLES_RWMAP_H_
+#define EXAMPLES_RWMAP_H_
+
+#include <pthread.h>
+#include "dhara/map.h"
+
+/* Thread-safe wrapper for a map, allowing any number of concurrent
+ * readers alongside a single writer. This is an example of how map
+ * views and journal pinning (see dhara_map_view_capture() and
+ * dhara_journal_pin()) can be used, built on POSIX threads. It isn't
+ * part of the library.
+ *
+ * Writers are serialized, but readers don't wait for them: each read
+ * is traced through a view of the map as it was after the last
+ * completed modification. The NAND driver must therefore permit reads
+ * concurrently with other operations.
+ *
+ * The journal is pinned at the tail of the oldest view which might
+ * still be in use. If the head gets within the given margin (in blocks)
+ * of the pin, the writer stops new reads starting and waits for the
+ * ones in progress, and then moves the pin up.
+ */
+struct rwmap {
+	struct dhara_map		*map;
+	dhara_block_t			margin;
+
+	/* Held by the writer for the duration of each modification (see
+	 * rwmap_begin_write()).
+	 */
+	pthread_mutex_t			write_lock;
+
+	/* Protects everything below */
+	pthread_mutex_t			view_lock;
+	pthread_cond_t			view_cond;
+
+	struct dhara_journal_view	view;
+	unsigned int			readers;
+	int				draining;
+
+	/* Number of times the writer had to wait for readers */
+	unsigned int			drains;
+};
+
+/* Set up a wrapper for a map which has already been resumed. The page
+ * buffer holds the published view, and must remain valid until the
+ * wrapper is destroyed. Nothing else may use the map in the meantime.
+ */
+void rwmap_init(struct rwmap *r, struct dhara_map *m, uint8_t *page_buf,
+		dhara_block_t margin);
+
+/* Destroy the wrapper and release the journal's pin. No other calls may
+ * be in progress.
+ */
+void rwmap_destroy(struct rwmap *r);
+
+/* Read a sector. The caller must supply a page buffer for the reader's
+ * private copy of the view. This never waits for the writer, except
+ * while it's moving the pin up.
+ */
+int rwmap_read(struct rwmap *r, dhara_sector_t s, uint8_t *data,
+	       uint8_t *page_buf, dhara_error_t *err);
+
+/* Modifications. These are serialized with respect to one another, and
+ * readers see their effects once each returns.
+ */
+int rwmap_write(struct rwmap *r, dhara_sector_t s, const uint8_t *data,
+		dhara_error_t *err);
+int rwmap_sync(struct rwmap *r, dhara_error_t *err);
+
+/* Any other modification can be made by calling the map's functions
+ * directly, between these two calls. rwmap_begin_write() takes the
+ * write lock, and makes sure that the head isn't too close to the pin.
+ * rwmap_end_write() publishes the state of the map to readers, and
+ * releases the lock.
+ *
+ * In between, the write lock may be used with a condition variable, to
+ * wait for other writers. The published view is unaffected by anything
+ * done in the meantime, so readers carry on.
+ */
+void rwmap_begin_write(struct rwmap *r);
+void rwmap_end_write(struct rwmap *r);
+
+#endif
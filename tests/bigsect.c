@@ -0,0 +1,497 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		64
+#define MAX_RUN_ORDER		2
+#define GC_RATIO		4
+#define NUM_ROUNDS		600
+#define FILL_PAGES		192
+
+/* Seed of each sector's payload, or -1 if it's unmapped */
+static int seeds[NUM_SECTORS];
+static int old_seeds[NUM_SECTORS];
+
+static void write_range(struct dhara_map *m, dhara_sector_t first,
+			dhara_sector_t count, int seed)
+{
+	const size_t sector_size = dhara_map_sector_size(m);
+	uint8_t buf[sector_size * count];
+	dhara_error_t err;
+	dhara_sector_t i;
+
+	for (i = 0; i < count; i++) {
+		seeds[first + i] = seed + i;
+		seq_gen(seed + i, buf + i * sector_size, sector_size);
+	}
+
+	if (dhara_map_write_multi(m, first, count, buf, &err) < 0)
+		dabort("write_multi", err);
+}
+
+static void trim_group(struct dhara_map *m, dhara_sector_t s, int order)
+{
+	dhara_error_t err;
+	int i;
+
+	if (dhara_map_trim_group(m, s, order, &err) < 0)
+		dabort("trim_group", err);
+
+	s &= ~((1 << order) - 1);
+	for (i = 0; i < (1 << order); i++)
+		if (s + i < NUM_SECTORS)
+			seeds[s + i] = -1;
+}
+
+/* Read a whole sector directly from the NAND, given its location */
+static void read_loc(const struct dhara_map *m, dhara_page_t loc,
+		     uint8_t *buf)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	dhara_error_t err;
+	int i;
+
+	for (i = 0; i < (1 << m->log2_pps); i++)
+		if (dhara_nand_read(&sim_nand, loc + i, 0, page_size,
+				    buf + i * page_size, &err) < 0)
+			dabort("nand_read", err);
+}
+
+static void assert_blank(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		assert(buf[i] == 0xff);
+}
+
+/* Every sector must read back as expected, and be found at the page
+ * where its data begins.
+ */
+static void check_all(struct dhara_map *m)
+{
+	const size_t sector_size = dhara_map_sector_size(m);
+	uint8_t buf[sector_size];
+	int i;
+
+	mt_check(m);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		dhara_error_t err;
+		dhara_page_t loc;
+
+		if (seeds[i] < 0) {
+			mt_assert_blank(m, i);
+
+			if (dhara_map_read(m, i, buf, &err) < 0)
+				dabort("map_read", err);
+
+			assert_blank(buf, sector_size);
+			continue;
+		}
+
+		mt_assert(m, i, seeds[i]);
+
+		if (dhara_map_find(m, i, &loc, &err) < 0)
+			dabort("map_find", err);
+
+		read_loc(m, loc, buf);
+		seq_assert(seeds[i], buf, sector_size);
+	}
+}
+
+/* Every mapped sector must be enumerated once, in order, along with
+ * the page where its data begins.
+ */
+static void check_iter(struct dhara_map *m)
+{
+	const size_t sector_size = dhara_map_sector_size(m);
+	uint8_t buf[sector_size];
+	struct dhara_map_iter it;
+	dhara_error_t err;
+	dhara_sector_t s;
+	dhara_page_t loc;
+	int expect = 0;
+	int r;
+
+	if (dhara_map_iter_begin(m, &it, &err) < 0)
+		dabort("iter_begin", err);
+
+	while ((r = dhara_map_iter_next(m, &it, &s, &loc, &err)) > 0) {
+		while ((expect < NUM_SECTORS) && (seeds[expect] < 0))
+			expect++;
+
+		assert((int)s == expect);
+		read_loc(m, loc, buf);
+		seq_assert(seeds[s], buf, sector_size);
+		expect++;
+	}
+
+	if (r < 0)
+		dabort("iter_next", err);
+
+	while ((expect < NUM_SECTORS) && (seeds[expect] < 0))
+		expect++;
+
+	assert(expect == NUM_SECTORS);
+}
+
+/* Batched reads, and reads from a view, must agree with the map */
+static void check_reads(struct dhara_map *m)
+{
+	const size_t sector_size = dhara_map_sector_size(m);
+	uint8_t view_buf[1 << sim_nand.log2_page_size];
+	struct dhara_map_read_req reqs[NUM_SECTORS];
+	uint8_t data[NUM_SECTORS][sector_size];
+	struct dhara_journal_view v;
+	dhara_error_t err;
+	int i;
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		reqs[i].sector = NUM_SECTORS - 1 - i;
+		reqs[i].data = data[i];
+	}
+
+	if (dhara_map_read_multi(m, reqs, NUM_SECTORS, &err) < 0)
+		dabort("read_multi", err);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		const int seed = seeds[reqs[i].sector];
+
+		if (seed < 0) {
+			assert(reqs[i].page == DHARA_PAGE_NONE);
+			assert_blank(reqs[i].data, sector_size);
+		} else {
+			seq_assert(seed, reqs[i].data, sector_size);
+		}
+	}
+
+	if (dhara_map_view_capture(m, &v, view_buf, &err) < 0)
+		dabort("view_capture", err);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (dhara_map_view_read(&v, i, data[0], &err) < 0)
+			dabort("view_read", err);
+
+		if (seeds[i] < 0)
+			assert_blank(data[0], sector_size);
+		else
+			seq_assert(seeds[i], data[0], sector_size);
+	}
+}
+
+/* Compare a snapshot with the current map. Exactly the sectors written
+ * or unmapped since should differ, and the snapshot must still read
+ * back as it was.
+ */
+static void check_snapshot(struct dhara_map *m, const char *written)
+{
+	const size_t sector_size = dhara_map_sector_size(m);
+	uint8_t buf[sector_size];
+	struct dhara_map_diff d;
+	dhara_error_t err;
+	dhara_page_t root;
+	dhara_sector_t s;
+	dhara_page_t old_loc;
+	dhara_page_t new_loc;
+	int expected = 0;
+	int found = 0;
+	int r;
+	int i;
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (dhara_map_snapshot_read(m, 0, i, buf, &err) < 0)
+			dabort("snapshot_read", err);
+
+		if (old_seeds[i] < 0)
+			assert_blank(buf, sector_size);
+		else
+			seq_assert(old_seeds[i], buf, sector_size);
+
+		if (((old_seeds[i] < 0) != (seeds[i] < 0)) ||
+		    ((seeds[i] >= 0) && written[i]))
+			expected++;
+	}
+
+	if (dhara_map_snapshot_root(m, 0, &root, &err) < 0)
+		dabort("snapshot_root", err);
+
+	if (dhara_map_diff_begin(m, &d, root,
+				 dhara_journal_root(&m->journal), &err) < 0)
+		dabort("diff_begin", err);
+
+	while ((r = dhara_map_diff_next(m, &d, &s, &old_loc, &new_loc,
+					&err)) > 0) {
+		assert(s < NUM_SECTORS);
+		assert(old_loc != new_loc);
+
+		if (old_loc != DHARA_PAGE_NONE) {
+			read_loc(m, old_loc, buf);
+			seq_assert(old_seeds[s], buf, sector_size);
+		}
+
+		if (new_loc != DHARA_PAGE_NONE) {
+			read_loc(m, new_loc, buf);
+			seq_assert(seeds[s], buf, sector_size);
+		}
+
+		found++;
+	}
+
+	if (r < 0)
+		dabort("diff_next", err);
+
+	assert(found == expected);
+}
+
+static void map_open(struct dhara_map *m, uint8_t *page_buf,
+		     uint8_t format, int log2_pps)
+{
+	dhara_error_t err;
+
+	dhara_map_init(m, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(m, 1);
+	dhara_journal_set_meta_format(&m->journal, format);
+
+	if (dhara_map_set_sector_size(m, log2_pps, &err) < 0)
+		dabort("set_sector_size", err);
+}
+
+/* Fill the same number of pages sequentially, as sectors of the given
+ * size, and return the number of metadata reads taken to look up every
+ * page's worth of data afterwards.
+ */
+static int measure(uint8_t format, int log2_pps)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	const int count = FILL_PAGES >> log2_pps;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	dhara_error_t err;
+	int find_reads;
+	int i;
+
+	sim_reset();
+	map_open(&map, page_buf, format, log2_pps);
+	dhara_map_resume(&map, NULL);
+
+	for (i = 0; i < count; i++)
+		mt_write(&map, i, i);
+
+	if (dhara_map_sync(&map, &err) < 0)
+		dabort("sync", err);
+
+	find_reads = sim_reads();
+	for (i = 0; i < count; i++) {
+		dhara_page_t loc;
+
+		if (dhara_map_find(&map, i, &loc, &err) < 0)
+			dabort("find", err);
+	}
+	find_reads = sim_reads() - find_reads;
+
+	printf("  %s, %d pages/sector: %d sectors, capacity %d, "
+	       "lookup reads = %d\n",
+	       (format == DHARA_META_COMPACT) ? "compact" : "fixed",
+	       1 << log2_pps, count, (int)dhara_map_capacity(&map),
+	       find_reads);
+
+	for (i = 0; i < count; i++)
+		mt_assert(&map, i, i);
+
+	mt_check(&map);
+	return find_reads;
+}
+
+/* Mixed writes, runs, copies and trims, with bad blocks, garbage
+ * collection, a snapshot and a resume along the way.
+ */
+static void stress(uint8_t format, int log2_pps)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	uint8_t *live = malloc(dhara_map_live_bytes(&sim_nand));
+	struct dhara_map_extent extents[NUM_SECTORS];
+	struct dhara_map_cache_slot cache[16];
+	char written[NUM_SECTORS];
+	struct dhara_map map;
+	dhara_error_t err;
+	dhara_sector_t span = NUM_SECTORS;
+	int seed = 0;
+	int round;
+	int i;
+
+	assert(live);
+
+	sim_reset();
+	sim_inject_bad(5);
+	sim_inject_timebombs(20, 30);
+	srandom(log2_pps);
+
+	map_open(&map, page_buf, format, log2_pps);
+	dhara_map_set_runs(&map, MAX_RUN_ORDER);
+	dhara_map_set_cache(&map, cache, 16);
+	dhara_map_set_extent_index(&map, extents, NUM_SECTORS);
+	dhara_map_set_live_map(&map, live);
+	dhara_map_resume(&map, NULL);
+
+	/* Keep well within capacity, allowing for blocks going bad */
+	while (span * 2 > dhara_map_capacity(&map))
+		span >>= 1;
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		seeds[i] = -1;
+
+	for (round = 0; round < NUM_ROUNDS; round++) {
+		const int op = random() % 20;
+		const dhara_sector_t s = random() % span;
+
+		if (op < 6) {
+			dhara_sector_t count = random() % 12 + 1;
+
+			if (s + count > span)
+				count = span - s;
+
+			write_range(&map, s, count, seed);
+			seed += count;
+		} else if (op < 12) {
+			seeds[s] = seed;
+			mt_write(&map, s, seed++);
+		} else if (op < 14) {
+			const dhara_sector_t dst = random() % span;
+
+			if (dhara_map_copy_sector(&map, s, dst, &err) < 0)
+				dabort("copy_sector", err);
+
+			seeds[dst] = seeds[s];
+		} else if (op < 17) {
+			mt_trim(&map, s);
+			seeds[s] = -1;
+		} else if (op < 19) {
+			trim_group(&map, s, random() % 4);
+		} else if (dhara_map_sync(&map, &err) < 0) {
+			dabort("sync", err);
+		}
+
+		if (!(round % 50))
+			check_all(&map);
+	}
+
+	check_all(&map);
+	check_iter(&map);
+	check_reads(&map);
+
+	printf("  %s, %d pages/sector: %d rounds, %d programs\n",
+	       (format == DHARA_META_COMPACT) ? "compact" : "fixed",
+	       1 << log2_pps, NUM_ROUNDS, sim_progs());
+
+	/* Changes seen from a snapshot. Holding the tail stops reclaim, so
+	 * clear out garbage first.
+	 */
+	while (dhara_journal_size(&map.journal) * 2 >
+	       dhara_journal_capacity(&map.journal))
+		if (dhara_map_gc(&map, &err) < 0)
+			dabort("gc", err);
+
+	if (dhara_map_snapshot(&map, 0, &err) < 0)
+		dabort("snapshot", err);
+
+	memcpy(old_seeds, seeds, sizeof(seeds));
+	memset(written, 0, sizeof(written));
+
+	for (i = 0; i < 4; i++) {
+		const dhara_sector_t s = i * span / 4;
+
+		write_range(&map, s, 4, seed);
+		seed += 4;
+		memset(written + s, 1, 4);
+
+		trim_group(&map, s + span / 8 + i, i & 1);
+	}
+
+	check_snapshot(&map, written);
+	check_all(&map);
+
+	if (dhara_map_snapshot_release(&map, 0, &err) < 0)
+		dabort("snapshot_release", err);
+
+	/* Everything must survive a resume */
+	if (dhara_map_sync(&map, &err) < 0)
+		dabort("sync", err);
+
+	map_open(&map, page_buf, format, log2_pps);
+	if (dhara_map_resume(&map, &err) < 0)
+		dabort("resume", err);
+
+	check_all(&map);
+	check_iter(&map);
+
+	/* ...but not with another sector size */
+	map_open(&map, page_buf, format, !log2_pps);
+	assert(dhara_map_resume(&map, &err) < 0);
+	assert(err == DHARA_E_BAD_FORMAT);
+	assert(!map.count);
+
+	free(live);
+}
+
+int main(void)
+{
+	struct dhara_map map;
+	struct dhara_nand big;
+	uint8_t page_buf[1 << sim_nand.log2_page_size];
+	dhara_error_t err;
+	int per_page;
+	int per_sector;
+
+	/* A sector must fit in a checkpoint group */
+	sim_reset();
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(&map, 1);
+	assert(dhara_map_set_sector_size(&map, sim_nand.log2_ppb, &err) < 0);
+	assert(err == DHARA_E_BAD_FORMAT);
+	assert(!map.log2_pps);
+
+	/* The count is limited by its field in the cookie */
+	big = sim_nand;
+	big.num_blocks = 1 << (29 - sim_nand.log2_ppb);
+	dhara_map_init(&map, &big, page_buf, GC_RATIO);
+	assert(dhara_map_capacity(&map) == DHARA_MAP_COUNT_MAX);
+
+	printf("Sequential fill of %d pages:\n", FILL_PAGES);
+	per_page = measure(DHARA_META_COMPACT, 0);
+	per_sector = measure(DHARA_META_COMPACT, 1);
+	assert(per_sector < per_page);
+	measure(DHARA_META_FIXED, 1);
+
+	printf("Random writes, runs, copies and trims:\n");
+	stress(DHARA_META_FIXED, 1);
+	stress(DHARA_META_COMPACT, 1);
+	stress(DHARA_META_COMPACT, 2);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
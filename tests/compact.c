@@ -0,0 +1,144 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define NUM_WRITES		2000
+#define GC_RATIO		4
+
+static int seeds[NUM_SECTORS];
+
+static void map_start(struct dhara_map *m, uint8_t *page_buf,
+		      uint8_t format, dhara_error_t *err)
+{
+	dhara_map_init(m, &sim_nand, page_buf, GC_RATIO);
+	dhara_journal_set_meta_format(&m->journal, format);
+	dhara_map_resume(m, err);
+}
+
+/* Write sectors to a blank chip, without wrapping, and count the raw
+ * pages (user and checkpoint) consumed by the journal.
+ */
+static dhara_page_t journal_usage(uint8_t format)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	dhara_page_t used;
+	int i;
+
+	sim_reset();
+	srandom(0);
+	map_start(&map, page_buf, format, NULL);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		mt_write(&map, random() % NUM_SECTORS, i);
+
+	used = map.journal.head;
+	printf("  %s: ppc = %d, %d pages\n",
+	       (format == DHARA_META_COMPACT) ? "compact" : "fixed",
+	       1 << map.journal.log2_ppc, used);
+	return used;
+}
+
+/* Check that everything synced survives a restart */
+static void check_resume(struct dhara_map *m)
+{
+	dhara_error_t err;
+	int i;
+
+	dhara_map_init(m, &sim_nand, m->journal.page_buf, GC_RATIO);
+	dhara_journal_set_meta_format(&m->journal, DHARA_META_COMPACT);
+	if (dhara_map_resume(m, &err) < 0)
+		dabort("resume", err);
+
+	mt_check(m);
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (seeds[i] < 0)
+			mt_assert_blank(m, i);
+		else
+			mt_assert(m, i, seeds[i]);
+	}
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	dhara_page_t fixed;
+	dhara_page_t compact;
+	dhara_error_t err;
+	int i;
+
+	printf("Journal usage...\n");
+	fixed = journal_usage(DHARA_META_FIXED);
+	compact = journal_usage(DHARA_META_COMPACT);
+	assert(compact < fixed);
+
+	printf("Random writes and trims...\n");
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(20, 30);
+	map_start(&map, page_buf, DHARA_META_COMPACT, NULL);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		seeds[i] = -1;
+
+	for (i = 0; i < NUM_WRITES; i++) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+
+		if (random() & 7) {
+			seeds[s] = i;
+			mt_write(&map, s, i);
+		} else {
+			seeds[s] = -1;
+			mt_trim(&map, s);
+		}
+
+		if (!(random() & 15)) {
+			dhara_error_t err;
+
+			if (dhara_map_sync(&map, &err) < 0)
+				dabort("sync", err);
+
+			if (!(random() & 7))
+				check_resume(&map);
+		}
+	}
+
+	if (dhara_map_sync(&map, NULL) < 0)
+		dabort("sync", DHARA_E_NONE);
+	check_resume(&map);
+
+	/* Checkpoints of one format aren't mistaken for the other */
+	printf("Format mismatch...\n");
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	assert(dhara_map_resume(&map, &err) < 0);
+	assert(err == DHARA_E_BAD_FORMAT);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
@@ -0,0 +1,199 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define NUM_CHANGES		40
+#define GC_RATIO		4
+
+/* State at the time of the snapshot, and now. Unmapped sectors have a
+ * seed of -1.
+ */
+static int before[NUM_SECTORS];
+static int after[NUM_SECTORS];
+static char written[NUM_SECTORS];
+
+static int is_changed(dhara_sector_t s)
+{
+	if ((before[s] < 0) != (after[s] < 0))
+		return 1;
+
+	return (after[s] >= 0) && written[s];
+}
+
+/* Compare two roots, and check the result against the expected set of
+ * changes. Returns the number of metadata reads.
+ */
+static int check_diff(struct dhara_map *m, dhara_page_t old_root,
+		      dhara_page_t new_root, int (*expect)(dhara_sector_t))
+{
+	struct dhara_map_diff d;
+	dhara_error_t err;
+	dhara_sector_t s;
+	dhara_sector_t last = 0;
+	dhara_page_t old_loc;
+	dhara_page_t new_loc;
+	int expected = 0;
+	int found = 0;
+	int r;
+	int i;
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		if (expect(i))
+			expected++;
+
+	if (dhara_map_diff_begin(m, &d, old_root, new_root, &err) < 0)
+		dabort("diff_begin", err);
+
+	while ((r = dhara_map_diff_next(m, &d, &s, &old_loc, &new_loc,
+					&err)) > 0) {
+		dhara_page_t p;
+
+		assert(s < NUM_SECTORS);
+		assert(!found || (s > last));
+		assert(expect(s));
+		assert(old_loc != new_loc);
+
+		if (dhara_map_find(m, s, &p, &err) < 0) {
+			assert(err == DHARA_E_NOT_FOUND);
+			p = DHARA_PAGE_NONE;
+		}
+
+		if (new_root == dhara_journal_root(&m->journal))
+			assert(p == new_loc);
+
+		last = s;
+		found++;
+	}
+
+	if (r < 0)
+		dabort("diff_next", err);
+
+	assert(found == expected);
+	return d.reads;
+}
+
+static int nothing(dhara_sector_t s)
+{
+	(void)s;
+	return 0;
+}
+
+static int is_mapped(dhara_sector_t s)
+{
+	return after[s] >= 0;
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	dhara_error_t err;
+	int seed = 0;
+	int round;
+	int i;
+
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(20, 30);
+
+	printf("Map init\n");
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(&map, 1);
+	dhara_map_resume(&map, NULL);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		after[i] = -1;
+		if (i & 3) {
+			after[i] = seed++;
+			mt_write(&map, i, after[i]);
+		}
+	}
+
+	printf("Empty and identical trees...\n");
+	assert(check_diff(&map, dhara_journal_root(&map.journal),
+			  dhara_journal_root(&map.journal), nothing) <= 2);
+	check_diff(&map, DHARA_PAGE_NONE, DHARA_PAGE_NONE, nothing);
+	check_diff(&map, DHARA_PAGE_NONE, dhara_journal_root(&map.journal),
+		   is_mapped);
+
+	for (round = 0; round < 5; round++) {
+		dhara_page_t root;
+		int reads;
+		int n = 0;
+
+		printf("Round %d...\n", round);
+
+		if (dhara_map_snapshot(&map, 0, &err) < 0)
+			dabort("snapshot", err);
+
+		for (i = 0; i < NUM_SECTORS; i++) {
+			before[i] = after[i];
+			written[i] = 0;
+		}
+
+		for (i = 0; i < NUM_CHANGES; i++) {
+			const dhara_sector_t s = random() % NUM_SECTORS;
+
+			if (random() & 3) {
+				after[s] = seed++;
+				written[s] = 1;
+				mt_write(&map, s, after[s]);
+			} else {
+				after[s] = -1;
+				mt_trim(&map, s);
+			}
+		}
+
+		for (i = 0; i < NUM_SECTORS; i++)
+			if (is_changed(i))
+				n++;
+
+		if (dhara_map_snapshot_root(&map, 0, &root, &err) < 0)
+			dabort("snapshot_root", err);
+
+		reads = check_diff(&map, root,
+				   dhara_journal_root(&map.journal),
+				   is_changed);
+		printf("  %d changed sectors, %d metadata reads\n",
+		       n, reads);
+		assert(reads <= 2 + n * 2 * (int)DHARA_RADIX_DEPTH);
+
+		if (dhara_map_snapshot_release(&map, 0, &err) < 0)
+			dabort("snapshot_release", err);
+
+		mt_check(&map);
+		for (i = 0; i < NUM_SECTORS; i++) {
+			if (after[i] < 0)
+				mt_assert_blank(&map, i);
+			else
+				mt_assert(&map, i, after[i]);
+		}
+	}
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
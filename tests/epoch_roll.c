@@ -18,33 +18,11 @@
 #include <assert.h>
 #include "dhara/map.h"
 #include "util.h"
+#include "mtutil.h"
 #include "sim.h"
 
 #define GC_RATIO		4
 
-static void mt_write(struct dhara_map *m, dhara_sector_t s, int seed)
-{
-	const size_t page_size = 1 << m->journal.nand->log2_page_size;
-	uint8_t buf[page_size];
-	dhara_error_t err;
-
-	seq_gen(seed, buf, sizeof(buf));
-	if (dhara_map_write(m, s, buf, &err) < 0)
-		dabort("map_write", err);
-}
-
-static void mt_assert(struct dhara_map *m, dhara_sector_t s, int seed)
-{
-	const size_t page_size = 1 << m->journal.nand->log2_page_size;
-	uint8_t buf[page_size];
-	dhara_error_t err;
-
-	if (dhara_map_read(m, s, buf, &err) < 0)
-		dabort("map_read", err);
-
-	seq_assert(seed, buf, sizeof(buf));
-}
-
 int main(void)
 {
 	const size_t page_size = 1 << sim_nand.log2_page_size;
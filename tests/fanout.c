@@ -0,0 +1,137 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+/* This test is built once for each radix. It measures the cost of
+ * lookups and updates, so that the formats can be compared.
+ */
+#define NUM_SECTORS		200
+#define NUM_UPDATES		1000
+#define GC_RATIO		4
+
+static int seeds[NUM_SECTORS];
+
+static void run(uint8_t format)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	dhara_error_t err;
+	int reads = 0;
+	int max_reads = 0;
+	int progs;
+	int i;
+
+	sim_reset();
+	srandom(0);
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_journal_set_meta_format(&map.journal, format);
+	dhara_map_resume(&map, NULL);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		seeds[i] = i;
+		mt_write(&map, i, i);
+	}
+
+	progs = sim_progs();
+	for (i = 0; i < NUM_UPDATES; i++) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+
+		seeds[s] = i + NUM_SECTORS;
+		mt_write(&map, s, seeds[s]);
+	}
+	progs = sim_progs() - progs;
+
+	/* Lookups all start from flash */
+	if (dhara_map_sync(&map, &err) < 0)
+		dabort("sync", err);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		const int before = sim_reads();
+		dhara_page_t loc;
+		int r;
+
+		if (dhara_map_find(&map, i, &loc, &err) < 0)
+			dabort("find", err);
+
+		r = sim_reads() - before;
+		reads += r;
+		if (r > max_reads)
+			max_reads = r;
+	}
+
+	/* At most one metadata read per level, plus the root. Compact
+	 * metadata may take two, if its encoding is far from its table
+	 * entry.
+	 */
+	assert(max_reads <= ((map.journal.meta_format == DHARA_META_COMPACT) ?
+			     2 : 1) * (DHARA_RADIX_DEPTH + 1));
+
+	printf("  %s: ppc = %d, reads/lookup = %.2f (max %d), "
+	       "progs/update = %.2f\n",
+	       (map.journal.meta_format == DHARA_META_COMPACT) ?
+	       "compact" : "fixed",
+	       1 << map.journal.log2_ppc, (double)reads / NUM_SECTORS,
+	       max_reads, (double)progs / NUM_UPDATES);
+
+	mt_check(&map);
+	for (i = 0; i < NUM_SECTORS; i++)
+		mt_assert(&map, i, seeds[i]);
+
+	/* Trims of every order, including those which don't fall on a
+	 * digit boundary.
+	 */
+	for (i = 0; i < 6; i++) {
+		const dhara_sector_t s = (i * 37) & ~((1 << i) - 1);
+		int j;
+
+		if (dhara_map_trim_group(&map, s, i, &err) < 0)
+			dabort("trim_group", err);
+
+		for (j = 0; j < (1 << i); j++)
+			seeds[s + j] = -1;
+
+		mt_check(&map);
+	}
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (seeds[i] < 0)
+			mt_assert_blank(&map, i);
+		else
+			mt_assert(&map, i, seeds[i]);
+	}
+}
+
+int main(void)
+{
+	printf("Radix %d: %d levels, %d-byte metadata\n",
+	       DHARA_RADIX_FANOUT, DHARA_RADIX_DEPTH, DHARA_META_SIZE);
+
+	run(DHARA_META_FIXED);
+	run(DHARA_META_COMPACT);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
@@ -0,0 +1,145 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define NUM_WRITES		2000
+#define GC_RATIO		4
+
+static int seeds[NUM_SECTORS];
+
+/* Write random sectors, syncing after each one. Returns the longest
+ * time taken by a sync, in simulated microseconds.
+ */
+static unsigned long sync_latency(int fast)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	unsigned long worst = 0;
+	int i;
+
+	sim_reset();
+	srandom(0);
+
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_fast_sync(&map, fast);
+	dhara_map_resume(&map, NULL);
+
+	for (i = 0; i < NUM_WRITES; i++) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+		dhara_error_t err;
+		unsigned long start;
+
+		mt_write(&map, s, i);
+
+		start = sim_elapsed();
+		if (dhara_map_sync(&map, &err) < 0)
+			dabort("sync", err);
+
+		if (sim_elapsed() - start > worst)
+			worst = sim_elapsed() - start;
+	}
+
+	printf("  %s: worst sync %lu us, %d pages\n",
+	       fast ? "fast" : "normal", worst, map.sync_padded);
+	return worst;
+}
+
+/* Check that everything synced survives a restart */
+static void check_resume(struct dhara_map *m)
+{
+	dhara_error_t err;
+	int i;
+
+	dhara_map_init(m, &sim_nand, m->journal.page_buf, GC_RATIO);
+	dhara_map_set_fast_sync(m, 1);
+	if (dhara_map_resume(m, &err) < 0)
+		dabort("resume", err);
+
+	mt_check(m);
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (seeds[i] < 0)
+			mt_assert_blank(m, i);
+		else
+			mt_assert(m, i, seeds[i]);
+	}
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	unsigned long normal;
+	unsigned long fast;
+	int i;
+
+	printf("Sync latency...\n");
+	normal = sync_latency(0);
+	fast = sync_latency(1);
+	assert(fast < normal);
+
+	printf("Resume after fast syncs...\n");
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(20, 30);
+
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_fast_sync(&map, 1);
+	dhara_map_resume(&map, NULL);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		seeds[i] = -1;
+
+	for (i = 0; i < NUM_WRITES; i++) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+
+		if (random() & 7) {
+			seeds[s] = i;
+			mt_write(&map, s, i);
+		} else {
+			seeds[s] = -1;
+			mt_trim(&map, s);
+		}
+
+		if (!(random() & 3)) {
+			dhara_error_t err;
+
+			if (dhara_map_sync(&map, &err) < 0)
+				dabort("sync", err);
+
+			if (!(random() & 15))
+				check_resume(&map);
+		}
+	}
+
+	if (dhara_map_sync(&map, NULL) < 0)
+		dabort("sync", DHARA_E_NONE);
+	check_resume(&map);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
@@ -0,0 +1,115 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define GC_RATIO		4
+#define HEADROOM		16
+#define BUDGET			4
+
+static int seeds[NUM_SECTORS];
+
+/* Rewrite random sectors, optionally collecting garbage in between.
+ * Returns the number of writes which had to collect garbage themselves.
+ */
+static int run(struct dhara_map *m, int count, int background)
+{
+	int stalls = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+		const dhara_page_t tail = m->journal.tail;
+
+		seeds[s] = random();
+		mt_write(m, s, seeds[s]);
+
+		if (m->journal.tail != tail)
+			stalls++;
+
+		if (background) {
+			dhara_sector_t debt;
+			dhara_error_t err;
+
+			if (dhara_map_gc_budget(m, BUDGET, HEADROOM,
+						&debt, &err) < 0)
+				dabort("map_gc_budget", err);
+
+			if (dhara_map_pre_erase(m, &err) < 0)
+				dabort("map_pre_erase", err);
+		}
+	}
+
+	return stalls;
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	dhara_sector_t debt;
+	int stalls;
+	int i;
+
+	sim_reset();
+	sim_inject_bad(10);
+
+	printf("Map init\n");
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_resume(&map, NULL);
+
+	srandom(0);
+	for (i = 0; i < NUM_SECTORS; i++) {
+		seeds[i] = i;
+		mt_write(&map, i, i);
+	}
+
+	printf("Foreground collection only...\n");
+	stalls = run(&map, 1000, 0);
+	printf("  writes stalled: %d\n", stalls);
+	printf("  debt: %d\n", (int)dhara_map_gc_debt(&map, HEADROOM));
+	assert(stalls > 0);
+
+	printf("Pay off debt...\n");
+	while (dhara_map_gc_debt(&map, HEADROOM)) {
+		if (dhara_map_gc_budget(&map, BUDGET, HEADROOM,
+					&debt, NULL) < 0)
+			dabort("map_gc_budget", 0);
+
+		printf("  debt: %d\n", (int)debt);
+	}
+
+	printf("Background collection...\n");
+	stalls = run(&map, 1000, 1);
+	printf("  writes stalled: %d\n", stalls);
+	assert(!stalls);
+
+	mt_check(&map);
+	for (i = 0; i < NUM_SECTORS; i++)
+		mt_assert(&map, i, seeds[i]);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
@@ -0,0 +1,168 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define GC_RATIO		4
+#define MAX_EXTENTS		NUM_SECTORS
+
+static dhara_page_t flat[NUM_SECTORS];
+static struct dhara_map_extent extents[MAX_EXTENTS];
+
+/* Compare the index against full lookups of every sector */
+static void check_index(struct dhara_map *m)
+{
+	const uint8_t valid = m->index.valid;
+	dhara_sector_t i;
+
+	if (!valid)
+		return;
+
+	for (i = 1; i < m->index.used; i++) {
+		const struct dhara_map_extent *a = &m->index.extents[i - 1];
+		const struct dhara_map_extent *b = a + 1;
+
+		assert(a->length && b->length);
+		assert(a->sector + a->length <= b->sector);
+	}
+
+	for (i = 0; i < NUM_SECTORS * 2; i++) {
+		dhara_page_t expect = DHARA_PAGE_NONE;
+		dhara_page_t p = DHARA_PAGE_NONE;
+		dhara_error_t err;
+
+		sim_freeze();
+		m->index.valid = 0;
+		if ((dhara_map_find(m, i, &expect, &err) < 0) &&
+		    (err != DHARA_E_NOT_FOUND))
+			dabort("map_find", err);
+		m->index.valid = valid;
+		sim_thaw();
+
+		if ((dhara_map_find(m, i, &p, &err) < 0) &&
+		    (err != DHARA_E_NOT_FOUND))
+			dabort("map_find", err);
+
+		assert(p == expect);
+	}
+}
+
+static void resume(struct dhara_map *m, uint8_t *page_buf,
+		   uint8_t type, dhara_sector_t size)
+{
+	clock_t start;
+
+	dhara_map_init(m, &sim_nand, page_buf, GC_RATIO);
+
+	if (type == DHARA_MAP_INDEX_FLAT)
+		dhara_map_set_flat_index(m, flat, size);
+	else
+		dhara_map_set_extent_index(m, extents, size);
+
+	start = clock();
+	dhara_map_resume(m, NULL);
+
+	printf("  build: %d sectors, %d reads, %d bytes, %ld us, %s\n",
+	       m->index.build_sectors, m->index.build_reads,
+	       (int)dhara_map_index_bytes(m),
+	       (long)((clock() - start) * 1000000 / CLOCKS_PER_SEC),
+	       m->index.valid ? "valid" : "overflowed");
+	check_index(m);
+}
+
+static void run(const char *name, uint8_t type, dhara_sector_t size)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	int i;
+
+	printf("========================================"
+	       "================================\n"
+	       "%s\n"
+	       "========================================"
+	       "================================\n\n", name);
+
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(30, 20);
+
+	resume(&map, page_buf, type, size);
+
+	printf("Sequential write...\n");
+	for (i = 0; i < NUM_SECTORS; i++)
+		mt_write(&map, i, i);
+	check_index(&map);
+	mt_check(&map);
+
+	printf("Sync/resume...\n");
+	dhara_map_sync(&map, NULL);
+	resume(&map, page_buf, type, size);
+
+	printf("Random rewrite/trim...\n");
+	srandom(0);
+	for (i = 0; i < NUM_SECTORS * 4; i++) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+
+		if (i & 3)
+			mt_write(&map, s, s);
+		else
+			mt_trim(&map, s);
+
+		if (!(i % 50))
+			check_index(&map);
+	}
+	check_index(&map);
+	mt_check(&map);
+
+	printf("Sync/resume...\n");
+	dhara_map_sync(&map, NULL);
+	resume(&map, page_buf, type, size);
+
+	printf("Sequential rewrite...\n");
+	for (i = 0; i < NUM_SECTORS; i++)
+		mt_write(&map, i, i);
+	check_index(&map);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		mt_assert(&map, i, i);
+
+	printf("Sync/resume...\n");
+	dhara_map_sync(&map, NULL);
+	resume(&map, page_buf, type, size);
+
+	printf("\n");
+	sim_dump();
+	printf("\n");
+}
+
+int main(void)
+{
+	run("Flat index", DHARA_MAP_INDEX_FLAT, NUM_SECTORS);
+	run("Partial flat index", DHARA_MAP_INDEX_FLAT, NUM_SECTORS / 3);
+	run("Extent index", DHARA_MAP_INDEX_EXTENT, MAX_EXTENTS);
+	run("Overflowing extent index", DHARA_MAP_INDEX_EXTENT, 8);
+
+	return 0;
+}
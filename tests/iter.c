@@ -0,0 +1,151 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		300
+#define GC_RATIO		4
+
+/* Sectors are scattered over the whole sector space */
+static dhara_sector_t sectors[NUM_SECTORS];
+static int seeds[NUM_SECTORS];
+
+static int cmp_index(const void *a, const void *b)
+{
+	const dhara_sector_t sa = sectors[*(const int *)a];
+	const dhara_sector_t sb = sectors[*(const int *)b];
+
+	return (sa > sb) - (sa < sb);
+}
+
+static void check_iter(struct dhara_map *m)
+{
+	const size_t page_size = 1 << m->journal.nand->log2_page_size;
+	int order[NUM_SECTORS];
+	struct dhara_map_iter it;
+	dhara_error_t err;
+	dhara_sector_t s;
+	dhara_page_t p;
+	int count = 0;
+	int n = 0;
+	int r;
+	int i;
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		if (seeds[i] >= 0)
+			order[count++] = i;
+
+	qsort(order, count, sizeof(order[0]), cmp_index);
+
+	if (dhara_map_iter_begin(m, &it, &err) < 0)
+		dabort("iter_begin", err);
+
+	while ((r = dhara_map_iter_next(m, &it, &s, &p, &err)) > 0) {
+		uint8_t buf[page_size];
+		dhara_page_t q;
+
+		assert(n < count);
+		assert(s == sectors[order[n]]);
+
+		if (dhara_map_find(m, s, &q, &err) < 0)
+			dabort("find", err);
+		assert(p == q);
+
+		if (dhara_nand_read(m->journal.nand, p, 0, page_size,
+				    buf, &err) < 0)
+			dabort("nand_read", err);
+		seq_assert(seeds[order[n]], buf, page_size);
+
+		n++;
+	}
+
+	if (r < 0)
+		dabort("iter_next", err);
+
+	assert(n == count);
+	printf("  %d sectors, %d metadata reads\n", count, it.reads);
+	assert(it.reads <= (uint32_t)dhara_map_size(m) * 2 + 1);
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	dhara_error_t err;
+	int i;
+
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(20, 30);
+
+	printf("Map init\n");
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(&map, 1);
+	dhara_map_resume(&map, NULL);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		sectors[i] = ((dhara_sector_t)random() << 1) ^ i;
+		if (sectors[i] >= DHARA_MAP_SNAPSHOT_BASE)
+			sectors[i] = i;
+		seeds[i] = -1;
+	}
+
+	printf("Empty map...\n");
+	check_iter(&map);
+
+	printf("Populate...\n");
+	for (i = 0; i < NUM_SECTORS; i++) {
+		seeds[i] = i;
+		mt_write(&map, sectors[i], i);
+	}
+	check_iter(&map);
+
+	printf("Rewrite and trim...\n");
+	for (i = 0; i < 1000; i++) {
+		const int j = random() % NUM_SECTORS;
+
+		if (random() & 3) {
+			seeds[j] = NUM_SECTORS + i;
+			mt_write(&map, sectors[j], seeds[j]);
+		} else {
+			seeds[j] = -1;
+			mt_trim(&map, sectors[j]);
+		}
+	}
+	mt_check(&map);
+	check_iter(&map);
+
+	printf("With a snapshot...\n");
+	if (dhara_map_snapshot(&map, 1, &err) < 0)
+		dabort("snapshot", err);
+	check_iter(&map);
+
+	if (dhara_map_snapshot_release(&map, 1, &err) < 0)
+		dabort("snapshot_release", err);
+	check_iter(&map);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
@@ -0,0 +1,180 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "dhara/bytes.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define GC_RATIO		4
+#define NUM_PAGES		(sim_nand.num_blocks << sim_nand.log2_ppb)
+
+static uint8_t live_map[4096];
+static dhara_sector_t owner[4096 * 8];
+
+/* Record the sector which owns each live page */
+static void mark_recurse(struct dhara_map *m, dhara_page_t page, int depth)
+{
+	uint8_t meta[DHARA_META_SIZE];
+	dhara_error_t err;
+	dhara_sector_t id;
+	int i;
+
+	if (page == DHARA_PAGE_NONE)
+		return;
+
+	if (dhara_journal_read_meta(&m->journal, page, meta, &err) < 0)
+		dabort("read_meta", err);
+
+	id = dhara_r32(meta);
+	if (id == DHARA_SECTOR_NONE)
+		return;
+
+	owner[page] = id;
+
+	for (i = 0; i < 32; i++) {
+		const dhara_page_t alt = dhara_r32(meta + 4 + (i << 2));
+
+		if ((alt != DHARA_PAGE_NONE) && (alt & 0x80000000))
+			owner[alt & 0x7fffffff] = id;
+		else if (i >= depth)
+			mark_recurse(m, alt, i + 1);
+	}
+}
+
+/* A complete bitmap must agree exactly with the tree, except in bad
+ * blocks, which may have been abandoned during recovery. During a
+ * rebuild, the pages of sectors visited so far must all be marked.
+ */
+static void check_live(struct dhara_map *m)
+{
+	dhara_page_t p;
+
+	sim_freeze();
+	for (p = 0; p < NUM_PAGES; p++)
+		owner[p] = DHARA_SECTOR_NONE;
+
+	mark_recurse(m, dhara_journal_root(&m->journal), 0);
+
+	for (p = 0; p < NUM_PAGES; p++) {
+		const int bit = (live_map[p >> 3] >> (p & 7)) & 1;
+
+		if (m->live.valid) {
+			if (!dhara_nand_is_bad(&sim_nand,
+					       p >> sim_nand.log2_ppb))
+				assert(bit == (owner[p] != DHARA_SECTOR_NONE));
+		} else if (owner[p] < m->live.next) {
+			assert(bit);
+		}
+	}
+	sim_thaw();
+}
+
+static void resume(struct dhara_map *m, uint8_t *page_buf)
+{
+	dhara_map_init(m, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_live_map(m, live_map);
+	dhara_map_resume(m, NULL);
+	check_live(m);
+}
+
+static void dump_stats(const struct dhara_map *m)
+{
+	printf("  bitmap %s, next sector %d\n",
+	       m->live.valid ? "complete" : "rebuilding",
+	       (int)m->live.next);
+	printf("  pages skipped: %d\n", m->live.skipped);
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	int rep;
+	int i;
+
+	assert(dhara_map_live_bytes(&sim_nand) <= sizeof(live_map));
+
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(30, 20);
+
+	printf("Map init\n");
+	resume(&map, page_buf);
+
+	for (rep = 0; rep < 8; rep++) {
+		printf("Rep %d: write/trim...\n", rep);
+		for (i = 0; i < NUM_SECTORS; i++) {
+			const dhara_sector_t s = (i * 7) % NUM_SECTORS;
+			dhara_error_t err;
+
+			if ((s + rep) % 5)
+				mt_write(&map, s, s + rep);
+			else
+				mt_trim(&map, s);
+
+			if (!(i % 50) &&
+			    (dhara_map_trim_group(&map, NUM_SECTORS + 8 * rep,
+						  3, &err) < 0))
+				dabort("map_trim_group", err);
+
+			check_live(&map);
+		}
+
+		mt_check(&map);
+		dump_stats(&map);
+
+		printf("Rep %d: sync/resume...\n", rep);
+		dhara_map_sync(&map, NULL);
+		check_live(&map);
+		resume(&map, page_buf);
+
+		for (i = 0; i < NUM_SECTORS; i++) {
+			if ((i + rep) % 5)
+				mt_assert(&map, i, i + rep);
+			else
+				mt_assert_blank(&map, i);
+		}
+	}
+
+	printf("Build...\n");
+	if (dhara_map_build_live(&map, NULL) < 0)
+		dabort("build_live", 0);
+	assert(map.live.valid);
+	check_live(&map);
+
+	printf("Rewrite...\n");
+	for (i = 0; i < NUM_SECTORS; i++) {
+		mt_write(&map, i, i);
+		check_live(&map);
+	}
+
+	dhara_map_sync(&map, NULL);
+	check_live(&map);
+	dump_stats(&map);
+	assert(map.live.skipped > 0);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
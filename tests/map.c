@@ -18,8 +18,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include "dhara/map.h"
-#include "dhara/bytes.h"
 #include "util.h"
+#include "mtutil.h"
 #include "sim.h"
 
 #define NUM_SECTORS		200
@@ -44,106 +44,80 @@ static void shuffle(int seed)
 	}
 }
 
-static int check_recurse(struct dhara_map *m,
-			 dhara_page_t parent,
-			 dhara_page_t page,
-			 dhara_sector_t id_expect,
-			 int depth)
+static void mt_write_multi(struct dhara_map *m, dhara_sector_t first,
+			   int count, int seed)
 {
-	uint8_t meta[DHARA_META_SIZE];
+	const size_t page_size = 1 << m->journal.nand->log2_page_size;
+	uint8_t buf[page_size * count];
 	dhara_error_t err;
-	const dhara_page_t h_offset = m->journal.head - m->journal.tail;
-	const dhara_page_t p_offset = parent - m->journal.tail;
-	const dhara_page_t offset = page - m->journal.tail;
-	dhara_sector_t id;
-	int count = 1;
 	int i;
 
-	if (page == DHARA_PAGE_NONE)
-		return 0;
-
-	/* Make sure this is a valid journal user page, and one which is
-	 * older than the page pointing to it.
-	 */
-	assert(offset < p_offset);
-	assert(offset < h_offset);
-	assert((~page) & ((1 << m->journal.log2_ppc) - 1));
-
-	/* Fetch metadata */
-	if (dhara_journal_read_meta(&m->journal, page, meta, &err) < 0)
-		dabort("mt_check", err);
-
-	/* Check the first <depth> bits of the ID field */
-	id = dhara_r32(meta);
-	if (!depth) {
-		id_expect = id;
-	} else {
-		assert(!((id ^ id_expect) >> (32 - depth)));
-	}
-
-	/* Check all alt-pointers */
-	for (i = depth; i < 32; i++) {
-		dhara_page_t child = dhara_r32(meta + (i << 2) + 4);
-
-		count += check_recurse(m, page, child,
-			id ^ (1 << (31 - i)), i + 1);
-	}
-
-	return count;
-}
-
-static void mt_check(struct dhara_map *m)
-{
-	int count;
+	for (i = 0; i < count; i++)
+		seq_gen(seed + first + i, buf + page_size * i, page_size);
 
-	sim_freeze();
-	count = check_recurse(m, m->journal.head,
-		dhara_journal_root(&m->journal), 0, 0);
-	sim_thaw();
-
-	assert(m->count == count);
+	if (dhara_map_write_multi(m, first, count, buf, &err) < 0)
+		dabort("map_write_multi", err);
 }
 
-static void mt_write(struct dhara_map *m, dhara_sector_t s, int seed)
+static void mt_write_scatter(struct dhara_map *m,
+			     const dhara_sector_t *sectors,
+			     int count, int seed)
 {
 	const size_t page_size = 1 << m->journal.nand->log2_page_size;
-	uint8_t buf[page_size];
+	uint8_t buf[page_size * count];
+	const uint8_t *data[count];
 	dhara_error_t err;
+	int i;
 
-	seq_gen(seed, buf, sizeof(buf));
-	if (dhara_map_write(m, s, buf, &err) < 0)
-		dabort("map_write", err);
+	for (i = 0; i < count; i++) {
+		seq_gen(seed + sectors[i], buf + page_size * i, page_size);
+		data[i] = buf + page_size * i;
+	}
+
+	if (dhara_map_write_scatter(m, sectors, data, count, &err) < 0)
+		dabort("map_write_scatter", err);
 }
 
-static void mt_assert(struct dhara_map *m, dhara_sector_t s, int seed)
+/* Read a batch of sectors, some of which (those >= NUM_SECTORS) are
+ * unmapped.
+ */
+static void mt_read_multi(struct dhara_map *m,
+			  const dhara_sector_t *sectors,
+			  int count, int seed)
 {
 	const size_t page_size = 1 << m->journal.nand->log2_page_size;
-	uint8_t buf[page_size];
+	uint8_t buf[page_size * count];
+	struct dhara_map_read_req reqs[count];
 	dhara_error_t err;
+	int i;
 
-	if (dhara_map_read(m, s, buf, &err) < 0)
-		dabort("map_read", err);
+	for (i = 0; i < count; i++) {
+		reqs[i].sector = sectors[i];
+		reqs[i].data = buf + page_size * i;
+	}
 
-	seq_assert(seed, buf, sizeof(buf));
-}
+	if (dhara_map_read_multi(m, reqs, count, &err) < 0)
+		dabort("map_read_multi", err);
 
-static void mt_trim(struct dhara_map *m, dhara_sector_t s)
-{
-	dhara_error_t err;
+	for (i = 0; i < count; i++) {
+		const struct dhara_map_read_req *r = &reqs[i];
+		dhara_page_t p;
+		size_t j;
 
-	if (dhara_map_trim(m, s, &err) < 0)
-		dabort("map_trim", err);
-}
+		if (i)
+			assert(reqs[i - 1].page <= r->page);
 
-static void mt_assert_blank(struct dhara_map *m, dhara_sector_t s)
-{
-	dhara_error_t err;
-	dhara_page_t loc;
-	int r;
+		if (r->sector >= NUM_SECTORS) {
+			assert(r->page == DHARA_PAGE_NONE);
+			for (j = 0; j < page_size; j++)
+				assert(r->data[j] == 0xff);
+			continue;
+		}
 
-	r = dhara_map_find(m, s, &loc, &err);
-	assert(r < 0);
-	assert(err == DHARA_E_NOT_FOUND);
+		assert(dhara_map_find(m, r->sector, &p, NULL) == 0);
+		assert(p == r->page);
+		seq_assert(seed + r->sector, r->data, page_size);
+	}
 }
 
 int main(void)
@@ -228,6 +202,46 @@ int main(void)
 		mt_assert_blank(&map, s1);
 	}
 
+	printf("Batched rewrite...\n");
+	for (i = 0; i < NUM_SECTORS; i += 25) {
+		mt_write_multi(&map, i, 25, 1000);
+		mt_check(&map);
+	}
+
+	printf("Scattered rewrite...\n");
+	shuffle(3);
+	for (i = 0; i < NUM_SECTORS; i += 10) {
+		mt_write_scatter(&map, sector_list + i, 10, 2000);
+		mt_check(&map);
+	}
+
+	printf("Sync...\n");
+	dhara_map_sync(&map, NULL);
+	printf("Resume...\n");
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_resume(&map, NULL);
+	printf("  capacity: %d\n", dhara_map_capacity(&map));
+	printf("  use count: %d\n", dhara_map_size(&map));
+	printf("\n");
+
+	printf("Read back...\n");
+	for (i = 0; i < NUM_SECTORS; i++)
+		mt_assert(&map, i, 2000 + i);
+
+	printf("Batched read back...\n");
+	shuffle(4);
+	for (i = 0; i < NUM_SECTORS; i += 20) {
+		dhara_sector_t list[25];
+		int j;
+
+		for (j = 0; j < 20; j++)
+			list[j] = sector_list[i + j];
+		for (j = 0; j < 5; j++)
+			list[20 + j] = NUM_SECTORS + random() % 1000;
+
+		mt_read_multi(&map, list, 25, 2000);
+	}
+
 	printf("\n");
 	sim_dump();
 	return 0;
@@ -0,0 +1,142 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define GC_RATIO		4
+#define CACHE_SLOTS		61
+
+static struct dhara_meta_cache_slot cache[CACHE_SLOTS];
+
+/* Every valid cache slot must agree with the checkpoint page on the
+ * chip.
+ */
+static void check_cache(const struct dhara_journal *j)
+{
+	const dhara_page_t ppc_mask = (1 << j->log2_ppc) - 1;
+	int i;
+
+	sim_freeze();
+	for (i = 0; i < CACHE_SLOTS; i++) {
+		const struct dhara_meta_cache_slot *s = &cache[i];
+		uint8_t meta[DHARA_META_SIZE];
+		dhara_error_t err;
+
+		if (s->page == DHARA_PAGE_NONE)
+			continue;
+
+		assert(s->page % CACHE_SLOTS == i);
+		if (dhara_nand_read(j->nand, s->page | ppc_mask,
+				    DHARA_HEADER_SIZE + DHARA_COOKIE_SIZE +
+				    (s->page & ppc_mask) *
+				    DHARA_META_SIZE,
+				    DHARA_META_SIZE, meta, &err) < 0)
+			dabort("nand_read", err);
+
+		assert(!memcmp(meta, s->meta, DHARA_META_SIZE));
+	}
+	sim_thaw();
+}
+
+static void resume(struct dhara_map *m, uint8_t *page_buf)
+{
+	dhara_map_init(m, &sim_nand, page_buf, GC_RATIO);
+	dhara_journal_set_meta_cache(&m->journal, cache, CACHE_SLOTS);
+	dhara_map_resume(m, NULL);
+	check_cache(&m->journal);
+}
+
+static void dump_stats(const struct dhara_map *m)
+{
+	printf("  cache hits: %d\n", m->journal.mcache_hits);
+	printf("  cache misses: %d\n", m->journal.mcache_misses);
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	int rep;
+	int i;
+
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(30, 20);
+
+	printf("Map init\n");
+	resume(&map, page_buf);
+
+	/* Rewrite the same sectors over and over, so that the journal
+	 * wraps around (epoch roll) several times.
+	 */
+	for (rep = 0; rep < 8; rep++) {
+		printf("Rep %d: write...\n", rep);
+		for (i = 0; i < NUM_SECTORS; i++) {
+			const dhara_sector_t s = (i * 7) % NUM_SECTORS;
+
+			mt_write(&map, s, s + rep);
+			check_cache(&map.journal);
+		}
+
+		mt_check(&map);
+
+		printf("Rep %d: read back...\n", rep);
+		for (i = 0; i < NUM_SECTORS; i++)
+			mt_assert(&map, i, i + rep);
+		check_cache(&map.journal);
+		dump_stats(&map);
+	}
+
+	printf("Trim odd sectors...\n");
+	for (i = 1; i < NUM_SECTORS; i += 2) {
+		mt_trim(&map, i);
+		check_cache(&map.journal);
+	}
+	mt_check(&map);
+
+	printf("Sync...\n");
+	dhara_map_sync(&map, NULL);
+	printf("Resume...\n");
+	resume(&map, page_buf);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (i & 1)
+			mt_assert_blank(&map, i);
+		else
+			mt_assert(&map, i, i + rep - 1);
+	}
+
+	dump_stats(&map);
+	assert(map.journal.mcache_hits > 0);
+
+	printf("Clear...\n");
+	dhara_map_clear(&map);
+	for (i = 0; i < CACHE_SLOTS; i++)
+		assert(cache[i].page == DHARA_PAGE_NONE);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
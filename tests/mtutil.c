@@ -0,0 +1,194 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/bytes.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+static inline int level_shift(int level)
+{
+	return DHARA_SECTOR_BITS - (level + 1) * DHARA_RADIX_BITS;
+}
+
+/* Order of a run record, kept in the last alt-pointer slot */
+static int run_order(const uint8_t *meta)
+{
+	const dhara_page_t tag =
+		dhara_r32(meta + 4 + ((DHARA_MAP_ALTS - 1) << 2));
+
+	if ((tag == DHARA_PAGE_NONE) || ((tag & 0xc0000000) != 0xc0000000))
+		return 0;
+
+	return tag & 0x3fffffff;
+}
+
+static int check_recurse(struct dhara_map *m,
+			 dhara_page_t parent,
+			 dhara_page_t page,
+			 dhara_sector_t id_expect,
+			 int depth)
+{
+	uint8_t meta[DHARA_META_SIZE];
+	dhara_error_t err;
+	const dhara_page_t h_offset = m->journal.head - m->journal.tail;
+	const dhara_page_t p_offset = parent - m->journal.tail;
+	const dhara_page_t offset = page - m->journal.tail;
+	dhara_page_t data = page;
+	dhara_sector_t id;
+	dhara_page_t span;
+	int order;
+	int term;
+	int count;
+	int i;
+
+	if (page == DHARA_PAGE_NONE)
+		return 0;
+
+	/* Make sure this is a valid journal user page, and one which is
+	 * older than the page pointing to it.
+	 */
+	assert(offset < p_offset);
+	assert(offset < h_offset);
+	assert((~page) & ((1 << m->journal.log2_ppc) - 1));
+
+	/* Fetch metadata */
+	if (dhara_journal_read_meta(&m->journal, page, meta, &err) < 0)
+		dabort("mt_check", err);
+
+	/* A run record holds every digit from its run's level down, and
+	 * it may be reached below that level on another sector's behalf.
+	 */
+	order = run_order(meta);
+	assert(!(order % DHARA_RADIX_BITS));
+	term = DHARA_RADIX_DEPTH - order / DHARA_RADIX_BITS;
+
+	/* Check the first <depth> digits of the ID field */
+	id = dhara_r32(meta);
+	if (!depth) {
+		id_expect = id;
+	} else {
+		const int n = (depth < term) ? depth : term;
+
+		if (n)
+			assert(!((id ^ id_expect) >> level_shift(n - 1)));
+	}
+
+	count = 1 << (DHARA_SECTOR_BITS -
+		      ((depth > term) ? depth : term) * DHARA_RADIX_BITS);
+
+	/* Check all alt-pointers. A slot with the top bits set to 10
+	 * holds the data page of a tombstone, which must be an older
+	 * page. Each level has a slot for every digit but the node's own.
+	 */
+	for (i = 0; i < DHARA_MAP_ALTS; i++) {
+		const int level = i / (DHARA_RADIX_FANOUT - 1);
+		const int k = i % (DHARA_RADIX_FANOUT - 1);
+		const int own = (id >> level_shift(level)) &
+			(DHARA_RADIX_FANOUT - 1);
+		const int d = k + (k >= own);
+		dhara_page_t child = dhara_r32(meta + (i << 2) + 4);
+
+		if (child == DHARA_PAGE_NONE)
+			continue;
+
+		if ((child & 0xc0000000) == 0xc0000000) {
+			assert(i == DHARA_MAP_ALTS - 1);
+			continue;
+		}
+
+		if (child & 0x80000000) {
+			child &= 0x3fffffff;
+			assert(child - m->journal.tail < offset);
+			assert((~child) & ((1 << m->journal.log2_ppc) - 1));
+			data = child;
+			continue;
+		}
+
+		assert(level < term);
+		if (level < depth)
+			continue;
+
+		count += check_recurse(m, page, child,
+			id ^ ((dhara_sector_t)(own ^ d) << level_shift(level)),
+			level + 1);
+	}
+
+	/* A run's members, and the other pages of each sector, are in
+	 * the same checkpoint group as its data.
+	 */
+	span = ((1 << order) << m->log2_pps) - 1;
+	assert(!((data ^ (data - span)) >> m->journal.log2_ppc));
+
+	return count;
+}
+
+void mt_check(struct dhara_map *m)
+{
+	int count;
+
+	sim_freeze();
+	count = check_recurse(m, m->journal.head,
+		dhara_journal_root(&m->journal), 0, 0);
+	sim_thaw();
+
+	assert(m->count == count);
+}
+
+void mt_write(struct dhara_map *m, dhara_sector_t s, int seed)
+{
+	const size_t sector_size = dhara_map_sector_size(m);
+	uint8_t buf[sector_size];
+	dhara_error_t err;
+
+	seq_gen(seed, buf, sizeof(buf));
+	if (dhara_map_write(m, s, buf, &err) < 0)
+		dabort("map_write", err);
+}
+
+void mt_assert(struct dhara_map *m, dhara_sector_t s, int seed)
+{
+	const size_t sector_size = dhara_map_sector_size(m);
+	uint8_t buf[sector_size];
+	dhara_error_t err;
+
+	if (dhara_map_read(m, s, buf, &err) < 0)
+		dabort("map_read", err);
+
+	seq_assert(seed, buf, sizeof(buf));
+}
+
+void mt_trim(struct dhara_map *m, dhara_sector_t s)
+{
+	dhara_error_t err;
+
+	if (dhara_map_trim(m, s, &err) < 0)
+		dabort("map_trim", err);
+}
+
+void mt_assert_blank(struct dhara_map *m, dhara_sector_t s)
+{
+	dhara_error_t err;
+	dhara_page_t loc;
+	int r;
+
+	r = dhara_map_find(m, s, &loc, &err);
+	assert(r < 0);
+	assert(err == DHARA_E_NOT_FOUND);
+}
@@ -0,0 +1,39 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TESTS_MTUTIL_H_
+#define TESTS_MTUTIL_H_
+
+#include "dhara/map.h"
+
+/* Check the map's radix tree invariants, and make sure that the number
+ * of reachable sectors agrees with the map's count.
+ */
+void mt_check(struct dhara_map *m);
+
+/* Write a seed/payload sector. All errors are fatal. */
+void mt_write(struct dhara_map *m, dhara_sector_t s, int seed);
+
+/* Read a sector back and check its payload. All errors are fatal. */
+void mt_assert(struct dhara_map *m, dhara_sector_t s, int seed);
+
+/* Trim a sector. All errors are fatal. */
+void mt_trim(struct dhara_map *m, dhara_sector_t s);
+
+/* Make sure that the given sector is unmapped. */
+void mt_assert_blank(struct dhara_map *m, dhara_sector_t s);
+
+#endif
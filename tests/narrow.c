@@ -0,0 +1,165 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+/* This test is built with 16-bit sector numbers */
+#define NUM_SECTORS		200
+#define NUM_WRITES		2000
+#define GC_RATIO		4
+#define SPREAD			0x141
+
+static int seeds[NUM_SECTORS];
+
+static void check_all(struct dhara_map *m)
+{
+	int i;
+
+	mt_check(m);
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (seeds[i] < 0)
+			mt_assert_blank(m, i * SPREAD);
+		else
+			mt_assert(m, i * SPREAD, seeds[i]);
+	}
+}
+
+static void check_resume(struct dhara_map *m)
+{
+	dhara_error_t err;
+
+	dhara_map_init(m, &sim_nand, m->journal.page_buf, GC_RATIO);
+	if (dhara_map_resume(m, &err) < 0)
+		dabort("resume", err);
+
+	check_all(m);
+}
+
+/* Sectors beyond the address width must not alias those within it */
+static void check_range(struct dhara_map *m)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t buf[page_size];
+	dhara_error_t err;
+	int i;
+
+	memset(buf, 0x55, page_size);
+	assert(dhara_map_write(m, DHARA_SECTOR_MAX + 1, buf, &err) < 0);
+	assert(err == DHARA_E_SECTOR_RANGE);
+	assert(dhara_map_copy_sector(m, 0, DHARA_SECTOR_MAX + 1, &err) < 0);
+	assert(err == DHARA_E_SECTOR_RANGE);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		assert(dhara_map_find(m, (DHARA_SECTOR_MAX + 1) | (i * SPREAD),
+				      NULL, &err) < 0);
+		assert(err == DHARA_E_NOT_FOUND);
+	}
+}
+
+/* A chip holding checkpoints from a build with a different width must
+ * be refused, rather than treated as blank.
+ */
+static void check_foreign(struct dhara_map *m)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page[page_size];
+	dhara_error_t err;
+
+	sim_reset();
+
+	memset(page, 0xff, page_size);
+	memcpy(page, "Dha", 3);
+	page[3] = 0;
+
+	if ((dhara_nand_erase(&sim_nand, 0, &err) < 0) ||
+	    (dhara_nand_prog(&sim_nand, (1 << m->journal.log2_ppc) - 1,
+			     page, &err) < 0))
+		dabort("prog", err);
+
+	dhara_map_init(m, &sim_nand, m->journal.page_buf, GC_RATIO);
+	assert(dhara_map_resume(m, &err) < 0);
+	assert(err == DHARA_E_BAD_FORMAT);
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	int i;
+
+	assert(DHARA_RADIX_DEPTH == 16);
+	assert(DHARA_META_SIZE == 68);
+
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(20, 30);
+
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_resume(&map, NULL);
+	printf("checkpoint period: %d pages\n", 1 << map.journal.log2_ppc);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		seeds[i] = -1;
+
+	printf("Random writes and trims...\n");
+	for (i = 0; i < NUM_WRITES; i++) {
+		const int s = random() % NUM_SECTORS;
+
+		if (random() & 7) {
+			seeds[s] = i;
+			mt_write(&map, s * SPREAD, i);
+		} else {
+			seeds[s] = -1;
+			mt_trim(&map, s * SPREAD);
+		}
+
+		if (!(random() & 15)) {
+			dhara_error_t err;
+
+			if (dhara_map_sync(&map, &err) < 0)
+				dabort("sync", err);
+
+			if (!(random() & 7))
+				check_resume(&map);
+		}
+	}
+
+	check_all(&map);
+
+	printf("Out-of-range sectors...\n");
+	check_range(&map);
+	check_all(&map);
+
+	if (dhara_map_sync(&map, NULL) < 0)
+		dabort("sync", DHARA_E_NONE);
+	check_resume(&map);
+
+	printf("Foreign format...\n");
+	check_foreign(&map);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
@@ -0,0 +1,104 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define NUM_WRITES		4000
+#define GC_RATIO		4
+
+static unsigned long latency[NUM_WRITES];
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	const unsigned long x = *(const unsigned long *)a;
+	const unsigned long y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Rewrite random sectors on a fresh chip, and return the 99th
+ * percentile of simulated write latency. If idle is set, the next block
+ * is erased in advance between writes.
+ */
+static unsigned long run(dhara_sector_t window, int idle)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	unsigned long total = 0;
+	unsigned long p99;
+	dhara_error_t err;
+	int i;
+
+	sim_reset();
+	sim_inject_bad(10);
+
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_resume(&map, NULL);
+	dhara_map_set_gc_pacing(&map, window);
+
+	srandom(0);
+	for (i = 0; i < NUM_SECTORS; i++)
+		mt_write(&map, i, i);
+
+	for (i = 0; i < NUM_WRITES; i++) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+		const unsigned long start = sim_elapsed();
+
+		mt_write(&map, s, s + i);
+		latency[i] = sim_elapsed() - start;
+		total += latency[i];
+
+		if (idle && (dhara_map_pre_erase(&map, &err) < 0))
+			dabort("pre_erase", err);
+	}
+
+	mt_check(&map);
+
+	qsort(latency, NUM_WRITES, sizeof(latency[0]), cmp_ulong);
+	p99 = latency[NUM_WRITES * 99 / 100];
+
+	printf("  mean: %lu us, p99: %lu us, max: %lu us\n",
+	       total / NUM_WRITES, p99, latency[NUM_WRITES - 1]);
+	return p99;
+}
+
+int main(void)
+{
+	unsigned long threshold;
+	unsigned long paced;
+	unsigned long erased;
+
+	printf("Threshold collection...\n");
+	threshold = run(0, 0);
+
+	printf("Paced collection...\n");
+	paced = run(32, 0);
+
+	printf("Paced collection with idle erase...\n");
+	erased = run(32, 1);
+
+	assert(paced < threshold);
+	assert(erased < paced);
+	return 0;
+}
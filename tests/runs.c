@@ -0,0 +1,372 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		192
+#define MAX_RUN_ORDER		5
+#define FILL_CHUNK		64
+#define GC_RATIO		4
+#define NUM_ROUNDS		400
+
+/* Seed of each sector's payload, or -1 if it's unmapped */
+static int seeds[NUM_SECTORS];
+static int old_seeds[NUM_SECTORS];
+
+static void write_range(struct dhara_map *m, dhara_sector_t first,
+			dhara_sector_t count, int seed)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t buf[page_size * count];
+	dhara_error_t err;
+	dhara_sector_t i;
+
+	for (i = 0; i < count; i++) {
+		seeds[first + i] = seed + i;
+		seq_gen(seed + i, buf + i * page_size, page_size);
+	}
+
+	if (dhara_map_write_multi(m, first, count, buf, &err) < 0)
+		dabort("write_multi", err);
+}
+
+static void trim_group(struct dhara_map *m, dhara_sector_t s, int order)
+{
+	dhara_error_t err;
+	int i;
+
+	if (dhara_map_trim_group(m, s, order, &err) < 0)
+		dabort("trim_group", err);
+
+	s &= ~((1 << order) - 1);
+	for (i = 0; i < (1 << order); i++)
+		seeds[s + i] = -1;
+}
+
+static void check_all(struct dhara_map *m)
+{
+	int i;
+
+	mt_check(m);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (seeds[i] < 0)
+			mt_assert_blank(m, i);
+		else
+			mt_assert(m, i, seeds[i]);
+	}
+}
+
+/* Every mapped sector must be enumerated once, in order, along with
+ * the page which holds its data.
+ */
+static void check_iter(struct dhara_map *m)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t buf[page_size];
+	struct dhara_map_iter it;
+	dhara_error_t err;
+	dhara_sector_t s;
+	dhara_page_t loc;
+	int expect = 0;
+	int r;
+
+	if (dhara_map_iter_begin(m, &it, &err) < 0)
+		dabort("iter_begin", err);
+
+	while ((r = dhara_map_iter_next(m, &it, &s, &loc, &err)) > 0) {
+		while ((expect < NUM_SECTORS) && (seeds[expect] < 0))
+			expect++;
+
+		assert((int)s == expect);
+		if (dhara_nand_read(&sim_nand, loc, 0, page_size, buf,
+				    &err) < 0)
+			dabort("nand_read", err);
+
+		seq_assert(seeds[s], buf, page_size);
+		expect++;
+	}
+
+	if (r < 0)
+		dabort("iter_next", err);
+
+	while ((expect < NUM_SECTORS) && (seeds[expect] < 0))
+		expect++;
+
+	assert(expect == NUM_SECTORS);
+}
+
+/* Compare a snapshot with the current map. Exactly the sectors written
+ * or unmapped since should differ, and the snapshot must still read
+ * back as it was.
+ */
+static void check_snapshot(struct dhara_map *m, const char *written)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t buf[page_size];
+	struct dhara_map_diff d;
+	dhara_error_t err;
+	dhara_page_t root;
+	dhara_sector_t s;
+	dhara_page_t old_loc;
+	dhara_page_t new_loc;
+	int expected = 0;
+	int found = 0;
+	int r;
+	int i;
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (dhara_map_snapshot_read(m, 0, i, buf, &err) < 0)
+			dabort("snapshot_read", err);
+
+		if (old_seeds[i] < 0) {
+			int j;
+
+			for (j = 0; j < (int)page_size; j++)
+				assert(buf[j] == 0xff);
+		} else {
+			seq_assert(old_seeds[i], buf, page_size);
+		}
+
+		if (((old_seeds[i] < 0) != (seeds[i] < 0)) ||
+		    ((seeds[i] >= 0) && written[i]))
+			expected++;
+	}
+
+	if (dhara_map_snapshot_root(m, 0, &root, &err) < 0)
+		dabort("snapshot_root", err);
+
+	if (dhara_map_diff_begin(m, &d, root,
+				 dhara_journal_root(&m->journal), &err) < 0)
+		dabort("diff_begin", err);
+
+	while ((r = dhara_map_diff_next(m, &d, &s, &old_loc, &new_loc,
+					&err)) > 0) {
+		assert(s < NUM_SECTORS);
+		assert(old_loc != new_loc);
+		found++;
+	}
+
+	if (r < 0)
+		dabort("diff_next", err);
+
+	assert(found == expected);
+}
+
+/* Fill the map sequentially, and measure the cost of writing it and of
+ * looking up each sector afterwards. Returns the number of metadata
+ * reads taken by read_multi.
+ */
+static int measure(uint8_t format, int max_order)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map_read_req reqs[NUM_SECTORS];
+	uint8_t data[NUM_SECTORS][page_size];
+	struct dhara_map map;
+	dhara_error_t err;
+	int fill_reads;
+	int find_reads;
+	int multi_reads;
+	int i;
+
+	sim_reset();
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(&map, 1);
+	dhara_journal_set_meta_format(&map.journal, format);
+	dhara_map_set_runs(&map, max_order);
+	dhara_map_resume(&map, NULL);
+
+	fill_reads = sim_reads();
+	for (i = 0; i < NUM_SECTORS; i += FILL_CHUNK)
+		write_range(&map, i, FILL_CHUNK, i);
+	fill_reads = sim_reads() - fill_reads;
+
+	if (dhara_map_sync(&map, &err) < 0)
+		dabort("sync", err);
+
+	find_reads = sim_reads();
+	for (i = 0; i < NUM_SECTORS; i++) {
+		dhara_page_t loc;
+
+		if (dhara_map_find(&map, i, &loc, &err) < 0)
+			dabort("find", err);
+	}
+	find_reads = sim_reads() - find_reads;
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		reqs[i].sector = i;
+		reqs[i].data = data[i];
+	}
+
+	multi_reads = sim_reads();
+	if (dhara_map_read_multi(&map, reqs, NUM_SECTORS, &err) < 0)
+		dabort("read_multi", err);
+	multi_reads = sim_reads() - multi_reads - NUM_SECTORS;
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		seq_assert(reqs[i].sector, reqs[i].data, page_size);
+
+	printf("  %s, runs %s: fill reads = %d, "
+	       "reads/lookup = %.2f, read_multi reads = %d\n",
+	       (map.journal.meta_format == DHARA_META_COMPACT) ?
+	       "compact" : "fixed", max_order ? "on" : "off",
+	       fill_reads, (double)find_reads / NUM_SECTORS, multi_reads);
+
+	check_all(&map);
+	check_iter(&map);
+	return multi_reads;
+}
+
+/* Mixed runs, single writes and trims, with bad blocks, garbage
+ * collection, a snapshot and a resume along the way.
+ */
+static void stress(uint8_t format)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	uint8_t *live = malloc(dhara_map_live_bytes(&sim_nand));
+	struct dhara_map_cache_slot cache[16];
+	char written[NUM_SECTORS];
+	struct dhara_map map;
+	dhara_error_t err;
+	int seed = 0;
+	int round;
+	int i;
+
+	assert(live);
+
+	sim_reset();
+	sim_inject_bad(5);
+	sim_inject_timebombs(20, 30);
+	srandom(0);
+
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(&map, 1);
+	dhara_journal_set_meta_format(&map.journal, format);
+	dhara_map_set_runs(&map, MAX_RUN_ORDER);
+	dhara_map_set_cache(&map, cache, 16);
+	dhara_map_set_live_map(&map, live);
+	dhara_map_resume(&map, NULL);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		seeds[i] = -1;
+
+	for (round = 0; round < NUM_ROUNDS; round++) {
+		const int op = random() % 20;
+		const dhara_sector_t s = random() % NUM_SECTORS;
+
+		if (op < 10) {
+			dhara_sector_t count = random() % 48 + 1;
+
+			if (s + count > NUM_SECTORS)
+				count = NUM_SECTORS - s;
+
+			write_range(&map, s, count, seed);
+			seed += count;
+		} else if (op < 14) {
+			seeds[s] = seed;
+			mt_write(&map, s, seed++);
+		} else if (op < 17) {
+			mt_trim(&map, s);
+			seeds[s] = -1;
+		} else if (op < 19) {
+			trim_group(&map, s, random() % 6);
+		} else if (dhara_map_sync(&map, &err) < 0) {
+			dabort("sync", err);
+		}
+
+		if (!(round % 50))
+			check_all(&map);
+	}
+
+	check_all(&map);
+	check_iter(&map);
+
+	printf("  %s: %d rounds, %d programs\n",
+	       (map.journal.meta_format == DHARA_META_COMPACT) ?
+	       "compact" : "fixed", NUM_ROUNDS, sim_progs());
+
+	/* Runs and partial trims of runs, seen from a snapshot */
+	if (dhara_map_snapshot(&map, 0, &err) < 0)
+		dabort("snapshot", err);
+
+	memcpy(old_seeds, seeds, sizeof(seeds));
+	memset(written, 0, sizeof(written));
+
+	for (i = 0; i < 4; i++) {
+		const dhara_sector_t s = (i * 48) + (i & 3);
+
+		write_range(&map, i * 48, 8, seed);
+		seed += 8;
+		memset(written + i * 48, 1, 8);
+
+		trim_group(&map, s, i & 3);
+	}
+
+	check_snapshot(&map, written);
+	check_all(&map);
+
+	if (dhara_map_snapshot_release(&map, 0, &err) < 0)
+		dabort("snapshot_release", err);
+
+	/* Everything must survive a resume */
+	if (dhara_map_sync(&map, &err) < 0)
+		dabort("sync", err);
+
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(&map, 1);
+	dhara_journal_set_meta_format(&map.journal, format);
+	if (dhara_map_resume(&map, &err) < 0)
+		dabort("resume", err);
+
+	check_all(&map);
+	check_iter(&map);
+	free(live);
+}
+
+int main(void)
+{
+	int without;
+	int with;
+
+	printf("Sequential fill of %d sectors:\n", NUM_SECTORS);
+	measure(DHARA_META_FIXED, 0);
+	measure(DHARA_META_FIXED, MAX_RUN_ORDER);
+
+	/* Fixed-format groups on small pages are too short to hold a
+	 * run, but compact groups aren't.
+	 */
+	without = measure(DHARA_META_COMPACT, 0);
+	with = measure(DHARA_META_COMPACT, MAX_RUN_ORDER);
+	assert(with < without);
+
+	printf("Random runs, writes and trims:\n");
+	stress(DHARA_META_FIXED);
+	stress(DHARA_META_COMPACT);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
@@ -0,0 +1,141 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define GC_RATIO		4
+#define CACHE_SLOTS		64
+
+static struct dhara_map_cache_slot cache[CACHE_SLOTS];
+
+/* Every valid cache slot must agree with a full lookup */
+static void check_cache(struct dhara_map *m)
+{
+	int i;
+
+	sim_freeze();
+	m->scache_size = 0;
+
+	for (i = 0; i < CACHE_SLOTS; i++) {
+		const struct dhara_map_cache_slot *s = &cache[i];
+		dhara_error_t err;
+		dhara_page_t p;
+
+		if (s->sector == DHARA_SECTOR_NONE)
+			continue;
+
+		assert(s->sector % CACHE_SLOTS == i);
+		if (dhara_map_find(m, s->sector, &p, &err) < 0) {
+			if (err != DHARA_E_NOT_FOUND)
+				dabort("map_find", err);
+
+			p = DHARA_PAGE_NONE;
+		}
+
+		assert(p == s->page);
+	}
+
+	m->scache_size = CACHE_SLOTS;
+	sim_thaw();
+}
+
+static void resume(struct dhara_map *m, uint8_t *page_buf)
+{
+	dhara_map_init(m, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_cache(m, cache, CACHE_SLOTS);
+	dhara_map_resume(m, NULL);
+	check_cache(m);
+}
+
+static void dump_stats(const struct dhara_map *m)
+{
+	printf("  cache hits: %d\n", m->scache_hits);
+	printf("  cache misses: %d\n", m->scache_misses);
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	int rep;
+	int i;
+
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(30, 20);
+
+	printf("Map init\n");
+	resume(&map, page_buf);
+
+	for (rep = 0; rep < 8; rep++) {
+		printf("Rep %d: write/trim...\n", rep);
+		for (i = 0; i < NUM_SECTORS; i++) {
+			const dhara_sector_t s = (i * 7) % NUM_SECTORS;
+
+			if ((s + rep) % 5)
+				mt_write(&map, s, s + rep);
+			else
+				mt_trim(&map, s);
+
+			check_cache(&map);
+		}
+
+		mt_check(&map);
+
+		printf("Rep %d: read back...\n", rep);
+		for (i = 0; i < NUM_SECTORS; i++) {
+			if ((i + rep) % 5)
+				mt_assert(&map, i, i + rep);
+			else
+				mt_assert_blank(&map, i);
+		}
+
+		check_cache(&map);
+		dump_stats(&map);
+	}
+
+	printf("Sync...\n");
+	dhara_map_sync(&map, NULL);
+	check_cache(&map);
+
+	printf("Resume...\n");
+	resume(&map, page_buf);
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if ((i + rep - 1) % 5)
+			mt_assert(&map, i, i + rep - 1);
+		else
+			mt_assert_blank(&map, i);
+	}
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		mt_assert_blank(&map, NUM_SECTORS + i % 4);
+
+	check_cache(&map);
+	dump_stats(&map);
+	assert(map.scache_hits > 0);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
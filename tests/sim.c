@@ -17,6 +17,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "sim.h"
 #include "util.h"
 
@@ -36,6 +38,11 @@ const struct dhara_nand sim_nand = {
 	.num_blocks		= NUM_BLOCKS
 };
 
+/* Typical SLC operation times (us) */
+#define T_READ			25
+#define T_PROG			250
+#define T_ERASE			2000
+
 #define BLOCK_BAD_MARK		0x01
 #define BLOCK_FAILED		0x02
 
@@ -55,6 +62,9 @@ struct sim_stats {
 
 	int		read;
 	int		read_bytes;
+
+	/* Simulated time spent in NAND operations (us) */
+	unsigned long	elapsed;
 };
 
 struct block_status {
@@ -71,15 +81,40 @@ struct block_status {
 	int		timebomb;
 };
 
+/* Readers on other threads may use the simulator at the same time as
+ * the writer, so the statistics are only touched under this lock.
+ */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct sim_stats stats;
 static struct block_status blocks[NUM_BLOCKS];
 static uint8_t pages[MEM_SIZE];
+static int realtime;
+
+/* Count an operation, unless the counts are frozen */
+static void stat_count(int *counter, size_t bytes, unsigned long us)
+{
+	pthread_mutex_lock(&stats_lock);
+	if (!stats.frozen) {
+		(*counter)++;
+		stats.read_bytes += bytes;
+		stats.elapsed += us;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void delay(unsigned int us)
+{
+	if (realtime)
+		usleep(us);
+}
 
 void sim_reset(void)
 {
 	int i;
 
+	pthread_mutex_lock(&stats_lock);
 	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_unlock(&stats_lock);
 	memset(blocks, 0, sizeof(blocks));
 	memset(pages, 0x55, sizeof(pages));
 
@@ -106,8 +141,7 @@ int dhara_nand_is_bad(const struct dhara_nand *n, dhara_block_t bno)
 		abort();
 	}
 
-	if (!stats.frozen)
-		stats.is_bad++;
+	stat_count(&stats.is_bad, 0, 0);
 	return blocks[bno].flags & BLOCK_BAD_MARK;
 }
 
@@ -119,8 +153,7 @@ void dhara_nand_mark_bad(const struct dhara_nand *n, dhara_block_t bno)
 		abort();
 	}
 
-	if (!stats.frozen)
-		stats.mark_bad++;
+	stat_count(&stats.mark_bad, 0, 0);
 	blocks[bno].flags |= BLOCK_BAD_MARK;
 }
 
@@ -141,15 +174,14 @@ int dhara_nand_erase(const struct dhara_nand *n, dhara_block_t bno,
 		abort();
 	}
 
-	if (!stats.frozen)
-		stats.erase++;
+	stat_count(&stats.erase, 0, T_ERASE);
+	delay(T_ERASE);
 	blocks[bno].next_page = 0;
 
 	timebomb_tick(bno);
 
 	if (blocks[bno].flags & BLOCK_FAILED) {
-		if (!stats.frozen)
-			stats.erase_fail++;
+		stat_count(&stats.erase_fail, 0, 0);
 		seq_gen(bno * 57 + 29, blk, BLOCK_SIZE);
 		dhara_set_error(err, DHARA_E_BAD_BLOCK);
 		return -1;
@@ -186,15 +218,14 @@ int dhara_nand_prog(const struct dhara_nand *n, dhara_page_t p,
 		abort();
 	}
 
-	if (!stats.frozen)
-		stats.prog++;
+	stat_count(&stats.prog, 0, T_PROG);
+	delay(T_PROG);
 	blocks[bno].next_page = pno + 1;
 
 	timebomb_tick(bno);
 
 	if (blocks[bno].flags & BLOCK_FAILED) {
-		if (!stats.frozen)
-			stats.prog_fail++;
+		stat_count(&stats.prog_fail, 0, 0);
 		seq_gen(p * 57 + 29, page, PAGE_SIZE);
 		dhara_set_error(err, DHARA_E_BAD_BLOCK);
 		return -1;
@@ -215,8 +246,7 @@ int dhara_nand_is_free(const struct dhara_nand *n, dhara_page_t p)
 		abort();
 	}
 
-	if (!stats.frozen)
-		stats.is_erased++;
+	stat_count(&stats.is_erased, 0, 0);
 	return blocks[bno].next_page <= pno;
 }
 
@@ -241,10 +271,8 @@ int dhara_nand_read(const struct dhara_nand *n, dhara_page_t p,
 		abort();
 	}
 
-	if (!stats.frozen) {
-		stats.read++;
-		stats.read_bytes += length;
-	}
+	stat_count(&stats.read, length, T_READ);
+	delay(T_READ);
 
 	memcpy(data, page + offset, length);
 	return 0;
@@ -322,28 +350,75 @@ void sim_inject_timebombs(int count, int max_ttl)
 
 void sim_freeze(void)
 {
+	pthread_mutex_lock(&stats_lock);
 	stats.frozen++;
+	pthread_mutex_unlock(&stats_lock);
 }
 
 void sim_thaw(void)
 {
+	pthread_mutex_lock(&stats_lock);
 	stats.frozen--;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void sim_set_realtime(int enable)
+{
+	realtime = enable;
+}
+
+unsigned long sim_elapsed(void)
+{
+	unsigned long ret;
+
+	pthread_mutex_lock(&stats_lock);
+	ret = stats.elapsed;
+	pthread_mutex_unlock(&stats_lock);
+
+	return ret;
+}
+
+int sim_reads(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&stats_lock);
+	ret = stats.read;
+	pthread_mutex_unlock(&stats_lock);
+
+	return ret;
+}
+
+int sim_progs(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&stats_lock);
+	ret = stats.prog;
+	pthread_mutex_unlock(&stats_lock);
+
+	return ret;
 }
 
 void sim_dump(void)
 {
+	struct sim_stats s;
 	int i;
 
+	pthread_mutex_lock(&stats_lock);
+	s = stats;
+	pthread_mutex_unlock(&stats_lock);
+
 	printf("NAND operation counts:\n");
-	printf("    is_bad:         %d\n", stats.is_bad);
-	printf("    mark_bad        %d\n", stats.mark_bad);
-	printf("    erase:          %d\n", stats.erase);
-	printf("    erase failures: %d\n", stats.erase_fail);
-	printf("    is_erased:      %d\n", stats.is_erased);
-	printf("    prog:           %d\n", stats.prog);
-	printf("    prog failures:  %d\n", stats.prog_fail);
-	printf("    read:           %d\n", stats.read);
-	printf("    read (bytes):   %d\n", stats.read_bytes);
+	printf("    is_bad:         %d\n", s.is_bad);
+	printf("    mark_bad        %d\n", s.mark_bad);
+	printf("    erase:          %d\n", s.erase);
+	printf("    erase failures: %d\n", s.erase_fail);
+	printf("    is_erased:      %d\n", s.is_erased);
+	printf("    prog:           %d\n", s.prog);
+	printf("    prog failures:  %d\n", s.prog_fail);
+	printf("    read:           %d\n", s.read);
+	printf("    read (bytes):   %d\n", s.read_bytes);
 	printf("\n");
 
 	printf("Block status:\n");
@@ -34,6 +34,20 @@ void sim_dump(void);
 void sim_freeze(void);
 void sim_thaw(void);
 
+/* Obtain the simulated time spent in NAND operations so far, in
+ * microseconds.
+ */
+unsigned long sim_elapsed(void);
+
+/* Obtain the number of page reads and programs counted so far */
+int sim_reads(void);
+int sim_progs(void);
+
+/* If enabled, each operation also takes its simulated time in real
+ * time. This is useful only for measuring concurrent access.
+ */
+void sim_set_realtime(int enable);
+
 /* Set faults on individual blocks */
 void sim_set_failed(dhara_block_t blk);
 void sim_set_timebomb(dhara_block_t blk, int ttl);
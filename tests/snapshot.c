@@ -0,0 +1,278 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		100
+#define GC_RATIO		4
+
+static int seeds[DHARA_MAP_SNAPSHOTS][NUM_SECTORS];
+static int current[NUM_SECTORS];
+
+static void write_all(struct dhara_map *m, int base)
+{
+	int i;
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if ((i % 7) == 3) {
+			mt_trim(m, i);
+			current[i] = -1;
+		} else {
+			current[i] = base + i;
+			mt_write(m, i, current[i]);
+		}
+	}
+}
+
+static void check_current(struct dhara_map *m)
+{
+	int i;
+
+	mt_check(m);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (current[i] < 0)
+			mt_assert_blank(m, i);
+		else
+			mt_assert(m, i, current[i]);
+	}
+}
+
+static dhara_sector_t count_current(void)
+{
+	dhara_sector_t n = 0;
+	int i;
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		if (current[i] >= 0)
+			n++;
+
+	return n;
+}
+
+static void check_snapshot(struct dhara_map *m, unsigned int id)
+{
+	const size_t page_size = 1 << m->journal.nand->log2_page_size;
+	uint8_t buf[page_size];
+	int i;
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		dhara_error_t err;
+		dhara_page_t p;
+
+		if (seeds[id][i] < 0) {
+			assert(dhara_map_snapshot_find(m, id, i, &p,
+						       &err) < 0);
+			assert(err == DHARA_E_NOT_FOUND);
+			continue;
+		}
+
+		if (dhara_map_snapshot_read(m, id, i, buf, &err) < 0)
+			dabort("snapshot_read", err);
+
+		seq_assert(seeds[id][i], buf, page_size);
+	}
+}
+
+static void take(struct dhara_map *m, unsigned int id)
+{
+	dhara_error_t err;
+	int i;
+
+	if (dhara_map_snapshot(m, id, &err) < 0)
+		dabort("snapshot", err);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		seeds[id][i] = current[i];
+
+	assert(dhara_journal_is_clean(&m->journal));
+	assert(m->journal.flags & DHARA_JOURNAL_F_HOLD);
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	uint8_t data[page_size];
+	struct dhara_map map;
+	dhara_error_t err;
+	dhara_page_t p;
+	int writes;
+	int step;
+	int i;
+
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(20, 30);
+
+	printf("Map init\n");
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(&map, 1);
+	dhara_map_resume(&map, NULL);
+
+	printf("Snapshot of an empty map...\n");
+	for (i = 0; i < NUM_SECTORS; i++)
+		current[i] = -1;
+	take(&map, 2);
+	check_snapshot(&map, 2);
+
+	printf("First snapshot...\n");
+	write_all(&map, 1000);
+	take(&map, 0);
+	check_current(&map);
+
+	printf("Second snapshot...\n");
+	write_all(&map, 2000);
+	check_snapshot(&map, 0);
+	take(&map, 1);
+	write_all(&map, 3000);
+	check_current(&map);
+	check_snapshot(&map, 0);
+	check_snapshot(&map, 1);
+	check_snapshot(&map, 2);
+
+	printf("Resume...\n");
+	dhara_map_sync(&map, NULL);
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(&map, 1);
+	if (dhara_map_resume(&map, &err) < 0)
+		dabort("resume", err);
+
+	assert(map.journal.flags & DHARA_JOURNAL_F_HOLD);
+	check_current(&map);
+	check_snapshot(&map, 0);
+	check_snapshot(&map, 1);
+
+	printf("Rollback...\n");
+	if (dhara_map_snapshot_rollback(&map, 0, &err) < 0)
+		dabort("snapshot_rollback", err);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		current[i] = seeds[0][i];
+
+	check_current(&map);
+	check_snapshot(&map, 0);
+	check_snapshot(&map, 1);
+	check_snapshot(&map, 2);
+
+	printf("Release...\n");
+	for (i = 0; i < DHARA_MAP_SNAPSHOTS; i++)
+		if (dhara_map_snapshot_release(&map, i, &err) < 0)
+			dabort("snapshot_release", err);
+
+	assert(!(map.journal.flags & DHARA_JOURNAL_F_HOLD));
+	assert(dhara_map_snapshot_find(&map, 0, 0, &p, &err) < 0);
+	assert(err == DHARA_E_NOT_FOUND);
+	check_current(&map);
+
+	printf("Fill the journal while held...\n");
+	take(&map, 3);
+	writes = 0;
+	for (;;) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+
+		seq_gen(writes, data, page_size);
+		if (dhara_map_write(&map, s, data, &err) < 0)
+			break;
+
+		writes++;
+	}
+
+	printf("  writes before the journal filled: %d (%s)\n",
+	       writes, dhara_strerror(err));
+	assert(err == DHARA_E_JOURNAL_FULL);
+	assert(dhara_map_trim(&map, 0, &err) < 0);
+	assert(err == DHARA_E_JOURNAL_FULL);
+	check_snapshot(&map, 3);
+
+	printf("Rollback and release...\n");
+	if ((dhara_map_snapshot_rollback(&map, 3, &err) < 0) ||
+	    (dhara_map_snapshot_release(&map, 3, &err) < 0))
+		dabort("snapshot", err);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		current[i] = seeds[3][i];
+	check_current(&map);
+
+	printf("Collect after release...\n");
+	for (i = 0; i < 2000; i++) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+
+		current[s] = i;
+		mt_write(&map, s, i);
+	}
+
+	check_current(&map);
+
+	printf("Trim the whole volume while held...\n");
+	for (step = 0; step < 2; step++) {
+		struct dhara_map_op op;
+
+		write_all(&map, 4000 + step * 1000);
+		take(&map, 0);
+		assert(dhara_map_size(&map) == count_current());
+
+		dhara_map_begin_trim(&op, 0, DHARA_SECTOR_BITS);
+		if (step) {
+			int r;
+
+			while ((r = dhara_map_step(&map, &op, &err)))
+				if (r < 0)
+					dabort("map_step", err);
+		} else if (dhara_map_trim_group(&map, 0, DHARA_SECTOR_BITS,
+						&err) < 0) {
+			dabort("trim_group", err);
+		}
+
+		for (i = 0; i < NUM_SECTORS; i++)
+			current[i] = -1;
+
+		assert(!dhara_map_size(&map));
+		assert(map.journal.flags & DHARA_JOURNAL_F_HOLD);
+		check_current(&map);
+		check_snapshot(&map, 0);
+
+		if (dhara_map_snapshot_release(&map, 0, &err) < 0)
+			dabort("snapshot_release", err);
+
+		assert(!(map.journal.flags & DHARA_JOURNAL_F_HOLD));
+	}
+
+	printf("Reserved sectors...\n");
+	take(&map, 1);
+	assert(!dhara_map_size(&map));
+	seq_gen(0, data, page_size);
+	assert(dhara_map_write(&map, DHARA_MAP_SNAPSHOT_BASE, data, &err) < 0);
+	assert(err == DHARA_E_SECTOR_RANGE);
+	assert(dhara_map_trim(&map, DHARA_MAP_SNAPSHOT_BASE + 1, &err) < 0);
+	assert(err == DHARA_E_SECTOR_RANGE);
+	check_snapshot(&map, 1);
+
+	if (dhara_map_snapshot_release(&map, 1, &err) < 0)
+		dabort("snapshot_release", err);
+
+	assert(!(map.journal.flags & DHARA_JOURNAL_F_HOLD));
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
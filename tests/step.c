@@ -0,0 +1,181 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define NUM_OPS			3000
+#define GC_RATIO		4
+
+struct result {
+	dhara_page_t		head;
+	dhara_page_t		tail;
+	dhara_page_t		root;
+	dhara_sector_t		count;
+	unsigned long		elapsed;
+	int			max_steps;
+};
+
+static int seeds[NUM_SECTORS];
+
+/* Run an operation to completion, either by stepping it or by calling
+ * the equivalent blocking function. Returns the number of steps taken.
+ */
+static int run_op(struct dhara_map *m, struct dhara_map_op *op, int step)
+{
+	dhara_error_t err;
+	int n = 0;
+	int r;
+
+	if (!step) {
+		switch (op->type) {
+		case DHARA_MAP_OP_WRITE:
+			r = dhara_map_write(m, op->sector, op->data, &err);
+			break;
+
+		case DHARA_MAP_OP_TRIM:
+			r = dhara_map_trim_group(m, op->sector, op->order,
+						 &err);
+			break;
+
+		case DHARA_MAP_OP_SYNC:
+			r = dhara_map_sync(m, &err);
+			break;
+
+		default:
+			r = dhara_map_gc(m, &err);
+			break;
+		}
+
+		if (r < 0)
+			dabort("blocking op", err);
+
+		return 1;
+	}
+
+	do {
+		r = dhara_map_step(m, op, &err);
+		if (r < 0)
+			dabort("map_step", err);
+		n++;
+	} while (r);
+
+	assert(!dhara_map_step(m, op, NULL));
+	return n;
+}
+
+static void run(struct result *res, int step)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	uint8_t data[page_size];
+	struct dhara_map map;
+	int i;
+
+	sim_reset();
+	srandom(0);
+	sim_inject_bad(10);
+	sim_inject_timebombs(30, 20);
+
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_resume(&map, NULL);
+	dhara_map_set_gc_pacing(&map, 32);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		seeds[i] = -1;
+
+	res->max_steps = 0;
+
+	for (i = 0; i < NUM_OPS; i++) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+		const int kind = random() % 32;
+		struct dhara_map_op op;
+		int n;
+
+		if (kind < 26) {
+			seeds[s] = random();
+			seq_gen(seeds[s], data, page_size);
+			dhara_map_begin_write(&op, s, data);
+		} else if (kind < 29) {
+			const unsigned int order = random() % 3;
+			const dhara_sector_t first = s & ~((1 << order) - 1);
+			dhara_sector_t j;
+
+			for (j = 0; j < (1u << order); j++)
+				if (first + j < NUM_SECTORS)
+					seeds[first + j] = -1;
+
+			dhara_map_begin_trim(&op, s, order);
+		} else if (kind < 31) {
+			dhara_map_begin_gc(&op);
+		} else {
+			dhara_map_begin_sync(&op);
+		}
+
+		n = run_op(&map, &op, step);
+		if (n > res->max_steps)
+			res->max_steps = n;
+	}
+
+	mt_check(&map);
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (seeds[i] < 0)
+			mt_assert_blank(&map, i);
+		else
+			mt_assert(&map, i, seeds[i]);
+	}
+
+	res->head = map.journal.head;
+	res->tail = map.journal.tail;
+	res->root = map.journal.root;
+	res->count = map.count;
+	res->elapsed = sim_elapsed();
+
+	printf("  head: %d, tail: %d, count: %d, elapsed: %lu us\n",
+	       (int)res->head, (int)res->tail, (int)res->count,
+	       res->elapsed);
+}
+
+int main(void)
+{
+	struct result blocking;
+	struct result stepped;
+
+	printf("Blocking operations...\n");
+	run(&blocking, 0);
+
+	printf("Stepped operations...\n");
+	run(&stepped, 1);
+	printf("  most steps for one operation: %d\n", stepped.max_steps);
+
+	assert(blocking.head == stepped.head);
+	assert(blocking.tail == stepped.tail);
+	assert(blocking.root == stepped.root);
+	assert(blocking.count == stepped.count);
+	assert(blocking.elapsed == stepped.elapsed);
+	assert(stepped.max_steps > 1);
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}
@@ -0,0 +1,482 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "dhara/map.h"
+#include "dhara/bytes.h"
+#include "util.h"
+#include "mtutil.h"
+#include "examples/rwmap.h"
+#include "examples/gcommit.h"
+#include "sim.h"
+
+#define NUM_SECTORS		200
+#define NUM_WRITES		3000
+#define NUM_TIMED_WRITES	300
+#define NUM_READERS		4
+#define NUM_CLIENTS		4
+#define CLIENT_WRITES		100
+#define SYNC_WINDOW		500
+#define SYNC_INTERVAL		16
+#define GC_RATIO		4
+#define MARGIN			4
+
+#define PAGE_SIZE		(1 << 9)
+
+/* Each payload records the sector and a version number, followed by a
+ * sequence generated from both. A reader must never see a torn or
+ * misplaced page, or a version older than one it has already seen.
+ *
+ * seq_gen() isn't reentrant, so we use our own generator here.
+ */
+static void fill(dhara_sector_t s, uint32_t version, uint8_t *buf)
+{
+	uint32_t x = s * 100003 + version + 1;
+	int i;
+
+	for (i = 8; i < PAGE_SIZE; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		buf[i] = x;
+	}
+}
+
+static void gen_payload(dhara_sector_t s, uint32_t version, uint8_t *buf)
+{
+	dhara_w32(buf, s);
+	dhara_w32(buf + 4, version);
+	fill(s, version, buf);
+}
+
+static uint32_t check_payload(dhara_sector_t s, const uint8_t *buf)
+{
+	const uint32_t version = dhara_r32(buf + 4);
+	uint8_t expect[PAGE_SIZE];
+
+	assert(dhara_r32(buf) == s);
+	fill(s, version, expect);
+	assert(!memcmp(buf + 8, expect + 8, PAGE_SIZE - 8));
+	return version;
+}
+
+/* Shared between the writer and readers */
+static struct dhara_map map;
+static struct rwmap rw;
+static struct gcommit gc;
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static int done;
+static int use_rwmap;
+
+struct reader {
+	pthread_t		thread;
+	unsigned int		seed;
+	unsigned long		reads;
+	uint32_t		seen[NUM_SECTORS];
+};
+
+static int is_done(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&done_lock);
+	ret = done;
+	pthread_mutex_unlock(&done_lock);
+
+	return ret;
+}
+
+static void set_done(int value)
+{
+	pthread_mutex_lock(&done_lock);
+	done = value;
+	pthread_mutex_unlock(&done_lock);
+}
+
+static void *reader_main(void *arg)
+{
+	struct reader *rd = arg;
+	uint8_t page_buf[PAGE_SIZE];
+	uint8_t data[PAGE_SIZE];
+
+	while (!is_done()) {
+		const dhara_sector_t s = rand_r(&rd->seed) % NUM_SECTORS;
+		dhara_error_t err;
+		uint32_t version;
+		int ret;
+
+		if (use_rwmap) {
+			ret = rwmap_read(&rw, s, data, page_buf, &err);
+		} else {
+			pthread_mutex_lock(&big_lock);
+			ret = dhara_map_read(&map, s, data, &err);
+			pthread_mutex_unlock(&big_lock);
+		}
+
+		if (ret < 0)
+			dabort("read", err);
+
+		version = check_payload(s, data);
+		assert(version >= rd->seen[s]);
+		rd->seen[s] = version;
+		rd->reads++;
+	}
+
+	return NULL;
+}
+
+static void do_write(dhara_sector_t s, const uint8_t *data)
+{
+	dhara_error_t err;
+	int ret;
+
+	if (use_rwmap) {
+		ret = rwmap_write(&rw, s, data, &err);
+	} else {
+		pthread_mutex_lock(&big_lock);
+		ret = dhara_map_write(&map, s, data, &err);
+		pthread_mutex_unlock(&big_lock);
+	}
+
+	if (ret < 0)
+		dabort("write", err);
+}
+
+static void do_sync(void)
+{
+	dhara_error_t err;
+	int ret;
+
+	if (use_rwmap) {
+		ret = rwmap_sync(&rw, &err);
+	} else {
+		pthread_mutex_lock(&big_lock);
+		ret = dhara_map_sync(&map, &err);
+		pthread_mutex_unlock(&big_lock);
+	}
+
+	if (ret < 0)
+		dabort("sync", err);
+}
+
+/* Rewrite random sectors while readers check them. Returns the total
+ * number of reads performed. If timed is set, NAND operations take
+ * real time, and fewer writes are done.
+ */
+static unsigned long run(int rwmap, int timed)
+{
+	const int num_writes = timed ? NUM_TIMED_WRITES : NUM_WRITES;
+	uint8_t page_buf[PAGE_SIZE];
+	uint8_t view_buf[PAGE_SIZE];
+	uint8_t data[PAGE_SIZE];
+	static uint32_t versions[NUM_SECTORS];
+	static struct reader readers[NUM_READERS];
+	unsigned long total = 0;
+	int i;
+
+	assert(sim_nand.log2_page_size == 9);
+
+	sim_reset();
+	srandom(0);
+	sim_inject_bad(10);
+
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_resume(&map, NULL);
+
+	use_rwmap = 0;
+	for (i = 0; i < NUM_SECTORS; i++) {
+		versions[i] = 0;
+		gen_payload(i, 0, data);
+		do_write(i, data);
+	}
+
+	use_rwmap = rwmap;
+	if (rwmap)
+		rwmap_init(&rw, &map, view_buf, MARGIN);
+
+	set_done(0);
+	sim_set_realtime(timed);
+
+	for (i = 0; i < NUM_READERS; i++) {
+		struct reader *rd = &readers[i];
+
+		rd->seed = i;
+		rd->reads = 0;
+		memset(rd->seen, 0, sizeof(rd->seen));
+		pthread_create(&rd->thread, NULL, reader_main, rd);
+	}
+
+	for (i = 0; i < num_writes; i++) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+
+		gen_payload(s, ++versions[s], data);
+		do_write(s, data);
+
+		if (!(i % SYNC_INTERVAL))
+			do_sync();
+	}
+
+	set_done(1);
+	for (i = 0; i < NUM_READERS; i++) {
+		pthread_join(readers[i].thread, NULL);
+		total += readers[i].reads;
+	}
+
+	sim_set_realtime(0);
+
+	if (rwmap) {
+		printf("  writer waited for readers: %d times\n", rw.drains);
+		rwmap_destroy(&rw);
+	}
+
+	mt_check(&map);
+	for (i = 0; i < NUM_SECTORS; i++) {
+		dhara_error_t err;
+
+		if (dhara_map_read(&map, i, data, &err) < 0)
+			dabort("read", err);
+
+		assert(check_payload(i, data) == versions[i]);
+	}
+
+	printf("  reads during %d writes: %lu\n", num_writes, total);
+	return total;
+}
+
+/* Capture a view and pin it, then keep writing until the journal runs
+ * into the pin. The view must still show the old contents throughout.
+ */
+static void pinned_view(void)
+{
+	uint8_t page_buf[PAGE_SIZE];
+	uint8_t view_buf[PAGE_SIZE];
+	uint8_t data[PAGE_SIZE];
+	struct dhara_journal_view v;
+	dhara_error_t err;
+	int writes = 0;
+	int i;
+
+	sim_reset();
+	srandom(0);
+	sim_inject_bad(10);
+
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_resume(&map, NULL);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		gen_payload(i, 0, data);
+		if (dhara_map_write(&map, i, data, &err) < 0)
+			dabort("write", err);
+	}
+
+	if (dhara_map_view_capture(&map, &v, view_buf, &err) < 0)
+		dabort("view_capture", err);
+
+	dhara_journal_pin(&map.journal, v.tail);
+
+	for (;;) {
+		const dhara_sector_t s = random() % NUM_SECTORS;
+
+		gen_payload(s, 1, data);
+		if (dhara_map_write(&map, s, data, &err) < 0) {
+			assert(err == DHARA_E_PINNED);
+			break;
+		}
+
+		writes++;
+	}
+
+	assert(dhara_journal_pin_room(&map.journal) <= 1);
+	printf("  writes before reaching the pin: %d\n", writes);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (dhara_map_view_read(&v, i, data, &err) < 0)
+			dabort("view_read", err);
+
+		assert(check_payload(i, data) == 0);
+	}
+
+	dhara_journal_pin(&map.journal, DHARA_PAGE_NONE);
+	for (i = 0; i < NUM_SECTORS; i++) {
+		gen_payload(i, 2, data);
+		if (dhara_map_write(&map, i, data, &err) < 0)
+			dabort("write", err);
+	}
+
+	mt_check(&map);
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (dhara_map_read(&map, i, data, &err) < 0)
+			dabort("read", err);
+
+		assert(check_payload(i, data) == 2);
+	}
+}
+
+/* Sync requests are satisfied by the next sync, or by a checkpoint
+ * which happens anyway.
+ */
+static void sync_tickets(void)
+{
+	uint8_t page_buf[PAGE_SIZE];
+	uint8_t data[PAGE_SIZE];
+	dhara_error_t err;
+	uint32_t a;
+	uint32_t b;
+
+	sim_reset();
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_resume(&map, NULL);
+
+	a = dhara_map_sync_request(&map);
+	assert(dhara_map_sync_done(&map, a));
+
+	gen_payload(0, 0, data);
+	if (dhara_map_write(&map, 0, data, &err) < 0)
+		dabort("write", err);
+	a = dhara_map_sync_request(&map);
+	assert(!dhara_map_sync_done(&map, a));
+
+	gen_payload(1, 0, data);
+	if (dhara_map_write(&map, 1, data, &err) < 0)
+		dabort("write", err);
+	b = dhara_map_sync_request(&map);
+	assert(b != a);
+	assert(!dhara_map_sync_done(&map, b));
+
+	if (dhara_map_sync(&map, &err) < 0)
+		dabort("sync", err);
+
+	assert(dhara_map_sync_done(&map, a));
+	assert(dhara_map_sync_done(&map, b));
+	assert(map.sync_requests == 3);
+	assert(map.sync_saved > 0);
+	printf("  padded %d pages, saved %d\n",
+	       map.sync_padded, map.sync_saved);
+}
+
+/* Several clients, each writing its own sector and then syncing */
+struct client {
+	pthread_t		thread;
+	dhara_sector_t		sector;
+};
+
+static void *client_main(void *arg)
+{
+	const struct client *c = arg;
+	uint8_t data[PAGE_SIZE];
+	uint32_t i;
+
+	for (i = 1; i <= CLIENT_WRITES; i++) {
+		dhara_error_t err;
+
+		gen_payload(c->sector, i, data);
+		if (rwmap_write(&rw, c->sector, data, &err) < 0)
+			dabort("write", err);
+
+		if (gcommit_sync(&gc, &err) < 0)
+			dabort("sync", err);
+	}
+
+	return NULL;
+}
+
+/* Returns the number of pages written to complete checkpoints */
+static uint32_t group_commit(unsigned int window)
+{
+	uint8_t page_buf[PAGE_SIZE];
+	uint8_t view_buf[PAGE_SIZE];
+	uint8_t data[PAGE_SIZE];
+	static struct client clients[NUM_CLIENTS];
+	uint32_t padded;
+	int i;
+
+	sim_reset();
+	srandom(0);
+	sim_inject_bad(10);
+
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_resume(&map, NULL);
+	rwmap_init(&rw, &map, view_buf, MARGIN);
+	gcommit_init(&gc, &rw, window);
+
+	for (i = 0; i < NUM_CLIENTS; i++) {
+		clients[i].sector = i;
+		pthread_create(&clients[i].thread, NULL, client_main,
+			       &clients[i]);
+	}
+
+	for (i = 0; i < NUM_CLIENTS; i++)
+		pthread_join(clients[i].thread, NULL);
+
+	gcommit_destroy(&gc);
+	rwmap_destroy(&rw);
+	padded = map.sync_padded;
+	printf("  window %d us: %d requests, padded %d pages, saved %d\n",
+	       window, map.sync_requests, padded, map.sync_saved);
+
+	/* Everything was synced, so it must survive a restart */
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	if (dhara_map_resume(&map, NULL) < 0)
+		dabort("resume", DHARA_E_NONE);
+
+	for (i = 0; i < NUM_CLIENTS; i++) {
+		dhara_error_t err;
+
+		if (dhara_map_read(&map, i, data, &err) < 0)
+			dabort("read", err);
+
+		assert(check_payload(i, data) == CLIENT_WRITES);
+	}
+
+	return padded;
+}
+
+int main(void)
+{
+	unsigned long locked;
+	unsigned long concurrent;
+
+	printf("Pinned view...\n");
+	pinned_view();
+
+	printf("Sync tickets...\n");
+	sync_tickets();
+
+	printf("Group commit...\n");
+	assert(group_commit(SYNC_WINDOW) < group_commit(0));
+
+	printf("Single lock...\n");
+	run(0, 0);
+
+	printf("Concurrent readers...\n");
+	run(1, 0);
+
+	printf("Single lock, timed...\n");
+	locked = run(0, 1);
+
+	printf("Concurrent readers, timed...\n");
+	concurrent = run(1, 1);
+
+	printf("  read throughput: %.1fx\n",
+	       (double)concurrent / (double)locked);
+
+	return 0;
+}
@@ -0,0 +1,194 @@
+/* Dhara - NAND flash management layer
+ * Copyright (C) 2013 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "dhara/map.h"
+#include "util.h"
+#include "mtutil.h"
+#include "sim.h"
+
+#define NUM_SECTORS		256
+#define GC_RATIO		4
+#define CACHE_SLOTS		64
+#define INDEX_EXTENTS		256
+
+static struct dhara_map_cache_slot cache[CACHE_SLOTS];
+static struct dhara_map_extent extents[INDEX_EXTENTS];
+static int seeds[NUM_SECTORS];
+
+static void resume(struct dhara_map *m, uint8_t *page_buf)
+{
+	dhara_map_init(m, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(m, 1);
+	dhara_map_set_cache(m, cache, CACHE_SLOTS);
+	dhara_map_set_extent_index(m, extents, INDEX_EXTENTS);
+	dhara_map_resume(m, NULL);
+}
+
+static void check_all(struct dhara_map *m)
+{
+	dhara_sector_t count = 0;
+	int i;
+
+	mt_check(m);
+
+	for (i = 0; i < NUM_SECTORS; i++) {
+		if (seeds[i] < 0) {
+			mt_assert_blank(m, i);
+		} else {
+			mt_assert(m, i, seeds[i]);
+			count++;
+		}
+	}
+
+	assert(dhara_map_size(m) == count);
+}
+
+static void trim_group(struct dhara_map *m, dhara_sector_t s, int order)
+{
+	const dhara_sector_t mask = (1 << order) - 1;
+	dhara_error_t err;
+	dhara_sector_t i;
+
+	if (dhara_map_trim_group(m, s, order, &err) < 0)
+		dabort("map_trim_group", err);
+
+	for (i = s & ~mask; i <= (s | mask); i++)
+		if (i < NUM_SECTORS)
+			seeds[i] = -1;
+}
+
+/* With tombstones, a trim records the sector's new path in metadata
+ * alone. On the simulator, a checkpoint group holds three user pages,
+ * so three trims fill one, and only its checkpoint page is programmed.
+ * Without them, each trim copies a data page, and checkpoints keep the
+ * marker which earlier versions recognise.
+ */
+static void check_cost(uint8_t *page_buf, int tombstones)
+{
+	struct dhara_map map;
+	dhara_error_t err;
+	uint8_t magic[3];
+	dhara_page_t mask;
+	int progs;
+	int i;
+
+	sim_reset();
+	dhara_map_init(&map, &sim_nand, page_buf, GC_RATIO);
+	dhara_map_set_tombstones(&map, tombstones);
+	dhara_map_resume(&map, NULL);
+
+	for (i = 0; i < 16; i++)
+		mt_write(&map, i, i);
+
+	if (dhara_map_sync(&map, &err) < 0)
+		dabort("sync", err);
+
+	progs = sim_progs();
+	for (i = 0; i < 3; i++)
+		mt_trim(&map, i * 5);
+
+	if (tombstones)
+		assert(sim_progs() == progs + 1);
+	else
+		assert(sim_progs() > progs + 3);
+
+	assert(dhara_map_size(&map) == 13);
+
+	for (i = 0; i < 16; i++) {
+		if (i % 5 || i >= 15)
+			mt_assert(&map, i, i);
+		else
+			mt_assert_blank(&map, i);
+	}
+
+	mt_check(&map);
+
+	if (dhara_map_sync(&map, &err) < 0)
+		dabort("sync", err);
+
+	mask = (1 << map.journal.log2_ppc) - 1;
+	if (dhara_nand_read(&sim_nand, dhara_journal_root(&map.journal) | mask,
+			    0, sizeof(magic), magic, &err) < 0)
+		dabort("nand_read", err);
+
+	assert(magic[2] == (tombstones ? 'b' : 'a'));
+}
+
+int main(void)
+{
+	const size_t page_size = 1 << sim_nand.log2_page_size;
+	uint8_t page_buf[page_size];
+	struct dhara_map map;
+	int rep;
+	int i;
+
+	printf("Trim cost...\n");
+	check_cost(page_buf, 0);
+	check_cost(page_buf, 1);
+
+	sim_reset();
+	sim_inject_bad(10);
+	sim_inject_timebombs(30, 20);
+
+	printf("Map init\n");
+	resume(&map, page_buf);
+
+	for (i = 0; i < NUM_SECTORS; i++)
+		seeds[i] = -1;
+
+	srandom(0);
+	for (rep = 0; rep < 8; rep++) {
+		printf("Rep %d: write...\n", rep);
+		for (i = 0; i < NUM_SECTORS; i++) {
+			if ((i + rep) % 3) {
+				mt_write(&map, i, i + rep * 1000);
+				seeds[i] = i + rep * 1000;
+			}
+		}
+
+		check_all(&map);
+
+		printf("Rep %d: group trim...\n", rep);
+		for (i = 0; i < 8; i++) {
+			const int order = random() % 7;
+
+			trim_group(&map, random() % (NUM_SECTORS + 64), order);
+			check_all(&map);
+		}
+
+		printf("  use count: %d\n", dhara_map_size(&map));
+		printf("  index extents: %d%s\n", (int)map.index.used,
+		       map.index.valid ? "" : " (overflow)");
+	}
+
+	printf("Sync...\n");
+	dhara_map_sync(&map, NULL);
+	printf("Resume...\n");
+	resume(&map, page_buf);
+	check_all(&map);
+
+	printf("Trim everything...\n");
+	trim_group(&map, 0, 9);
+	check_all(&map);
+	assert(!dhara_map_size(&map));
+
+	printf("\n");
+	sim_dump();
+	return 0;
+}